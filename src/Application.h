@@ -21,6 +21,7 @@
 #include <boost/asio/io_service.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
 #include <memory>
 
 namespace Admin {
@@ -101,7 +102,7 @@ private:
 
     int m_returnCode;
     bool m_closingDown;
-    UAHFState m_uahfState;
+    std::atomic<UAHFState> m_uahfState; // read by the message handler threads
     int64_t m_uahfStartTme;
 };
 
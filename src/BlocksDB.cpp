@@ -11,10 +11,13 @@
 #include "init.h" // for StartShutdown
 
 #include "chain.h"
+#include "crypto/common.h"
 #include "main.h"
 #include "uint256.h"
 #include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -25,6 +28,9 @@ static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 static const char DB_UAHF_FORK_BLOCK = 'U';
 
+// Block files are 128MiB at most, on 32 bit systems address space is scarce.
+static const size_t MAX_MAPPED_BLOCK_FILES = sizeof(void*) > 4 ? 256 : 8;
+
 namespace {
 CBlockIndex * InsertBlockIndex(uint256 hash)
 {
@@ -214,6 +220,11 @@ void reimportBlockFiles(std::vector<boost::filesystem::path> vImportFiles)
         }
     }
 
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool(mempool);
+        fDumpMempoolLater = !ShutdownRequested();
+    }
+
     if (GetBoolArg("-stopafterblockimport", DEFAULT_STOPAFTERBLOCKIMPORT)) {
         LogPrintf("Stopping after block import\n");
         StartShutdown();
@@ -513,6 +524,18 @@ CBlockIndex *Blocks::DB::uahfForkBlock() const
     return d->uahfStartBlock;
 }
 
+Streaming::ConstBuffer Blocks::DB::loadBlock(const CDiskBlockPos &pos)
+{
+    if (pos.IsNull())
+        return Streaming::ConstBuffer();
+    return d->loadBlock(pos.nFile, pos.nPos);
+}
+
+void Blocks::DB::unmapFile(int fileIndex)
+{
+    d->unmapFile(fileIndex);
+}
+
 
 ///////////////////////////////////////////////
 
@@ -567,6 +590,78 @@ boost::filesystem::path Blocks::getFilepathForIndex(int fileIndex, const char *p
 
 Blocks::DBPrivate::DBPrivate()
     : isReindexing(false),
-      uahfStartBlock(nullptr)
+      uahfStartBlock(nullptr),
+      useCounter(0)
+{
+}
+
+namespace {
+/// Returns the block written at pos, which is preceded by the message start and its size.
+Streaming::ConstBuffer blockAt(const std::shared_ptr<char> &buffer, size_t fileSize, unsigned int pos)
+{
+    if (pos < 8 || pos > fileSize)
+        return Streaming::ConstBuffer();
+    const char *start = buffer.get() + pos;
+    const uint32_t blockSize = ReadLE32(reinterpret_cast<const unsigned char*>(start - 4));
+    // the file may have been extended since we mapped it.
+    if (blockSize < 80 || blockSize > fileSize - pos)
+        return Streaming::ConstBuffer();
+    return Streaming::ConstBuffer(buffer, start, start + blockSize);
+}
+}
+
+Streaming::ConstBuffer Blocks::DBPrivate::loadBlock(int fileIndex, unsigned int pos)
+{
+    std::lock_guard<std::mutex> lock(mappedFilesLock);
+    Streaming::ConstBuffer block;
+    MappedFiles::iterator iter = mappedFiles.find(fileIndex);
+    if (iter != mappedFiles.end())
+        block = blockAt(iter->second.buffer, iter->second.size, pos);
+    if (!block.isValid()) {
+        iter = mapFile(fileIndex);
+        if (iter != mappedFiles.end())
+            block = blockAt(iter->second.buffer, iter->second.size, pos);
+    }
+    if (iter != mappedFiles.end())
+        iter->second.lastUse = ++useCounter;
+    return block;
+}
+
+void Blocks::DBPrivate::unmapFile(int fileIndex)
 {
+    std::lock_guard<std::mutex> lock(mappedFilesLock);
+    mappedFiles.erase(fileIndex);
+}
+
+Blocks::DBPrivate::MappedFiles::iterator Blocks::DBPrivate::mapFile(int fileIndex)
+{
+    namespace bip = boost::interprocess;
+    const boost::filesystem::path path = Blocks::getFilepathForIndex(fileIndex, "blk", true);
+    std::shared_ptr<bip::mapped_region> region;
+    try {
+        bip::file_mapping mapping(path.string().c_str(), bip::read_only);
+        region = std::make_shared<bip::mapped_region>(mapping, bip::read_only);
+    } catch (const bip::interprocess_exception &e) {
+        LogPrintf("Unable to map block file %s: %s\n", path.string(), e.what());
+        return mappedFiles.end();
+    }
+    // The buffer owns the region, buffers handed out keep the file mapped after we forget about it.
+    MappedFile file;
+    file.buffer = std::shared_ptr<char>(static_cast<char*>(region->get_address()), [region](char*) {});
+    file.size = region->get_size();
+    file.lastUse = ++useCounter;
+    MappedFiles::iterator iter = mappedFiles.find(fileIndex);
+    if (iter != mappedFiles.end()) {
+        iter->second = file;
+        return iter;
+    }
+    if (mappedFiles.size() >= MAX_MAPPED_BLOCK_FILES) {
+        MappedFiles::iterator oldest = mappedFiles.begin();
+        for (MappedFiles::iterator i = mappedFiles.begin(); i != mappedFiles.end(); ++i) {
+            if (i->second.lastUse < oldest->second.lastUse)
+                oldest = i;
+        }
+        mappedFiles.erase(oldest);
+    }
+    return mappedFiles.insert(std::make_pair(fileIndex, file)).first;
 }
@@ -8,6 +8,7 @@
 #define BITCOIN_BLOCKSDB_H
 
 #include "dbwrapper.h"
+#include "streaming/ConstBuffer.h"
 
 #include <boost/unordered_map.hpp>
 #include <string>
@@ -98,6 +99,16 @@ public:
 
     void loadConfig();
 
+    /**
+     * Returns the serialized block stored at pos.
+     * The buffer points directly into the memory mapped block file, no copy
+     * is made and the mapping stays alive for as long as the buffer is used.
+     * @returns an invalid buffer if the block could not be found.
+     */
+    Streaming::ConstBuffer loadBlock(const CDiskBlockPos &pos);
+    /// Drop the mapping of a block file, to be called before it is deleted.
+    void unmapFile(int fileIndex);
+
     /// \internal
     DBPrivate *priv() {
         return d;
@@ -20,8 +20,12 @@
 #define BITCOIN_BLOCKCHAIN_BLOCK_P_H
 
 #include "chain.h"
+#include "streaming/ConstBuffer.h"
 
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 
 class CBlockIndex;
 
@@ -33,6 +37,9 @@ public:
 
     void updateUahfProperties();
 
+    Streaming::ConstBuffer loadBlock(int fileIndex, unsigned int pos);
+    void unmapFile(int fileIndex);
+
     bool isReindexing;
 
     CChain headersChain;
@@ -40,6 +47,19 @@ public:
     CBlockIndex *uahfStartBlock;
 
     std::vector<std::string> blocksDataDirs;
+
+private:
+    struct MappedFile {
+        std::shared_ptr<char> buffer;
+        size_t size;
+        uint64_t lastUse;
+    };
+    typedef std::map<int, MappedFile> MappedFiles;
+    MappedFiles::iterator mapFile(int fileIndex);
+
+    std::mutex mappedFilesLock;
+    MappedFiles mappedFiles;
+    uint64_t useCounter;
 };
 }
 
@@ -5,6 +5,7 @@
 
 #include "allowed_args.h"
 
+#include "blockcache.h"
 #include "chainparams.h"
 #include "httpserver.h"
 #include "init.h"
@@ -15,6 +16,7 @@
 #include "script/sigcache.h"
 #include "tinyformat.h"
 #include "torcontrol.h"
+#include "txdb.h"
 #include "BlocksDB.h"
 #include "qt/guiconstants.h"
 #include "wallet/wallet.h"
@@ -216,6 +218,7 @@ static void addGeneralOptions(AllowedArgs& allowedArgs, HelpMessageMode mode)
     allowedArgs
         .addHeader(_("General options:"))
         .addArg("alertnotify=<cmd>", requiredStr, _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"))
+        .addArg("blockcachesize=<n>", requiredInt, strprintf(_("Keep up to <n> megabytes of recently connected blocks in memory, to speed up reorgs and serving them to peers (default: %u)"), DEFAULT_BLOCK_CACHE_SIZE))
         .addArg("blocknotify=<cmd>", requiredStr, _("Execute command when the best block changes (%s in cmd is replaced by block hash)"))
         .addDebugArg("blocksonly", optionalBool, strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY))
         .addArg("checkblocks=<n>", requiredInt, strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS))
@@ -228,6 +231,7 @@ static void addGeneralOptions(AllowedArgs& allowedArgs, HelpMessageMode mode)
 #endif
 
     allowedArgs
+        .addArg("backgroundflush", optionalBool, strprintf(_("Write the coin database from a background thread while validation continues, the coins being written are kept in memory on top of -dbcache until they are on disk (default: %u)"), DEFAULT_BACKGROUND_FLUSH))
         .addArg("dbcache=<n>", requiredInt, strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache))
         .addArg("loadblock=<file>", requiredStr, _("Imports blocks from external blk000??.dat file on startup"))
         .addArg("maxorphantx=<n>", requiredInt, strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS))
@@ -235,9 +239,12 @@ static void addGeneralOptions(AllowedArgs& allowedArgs, HelpMessageMode mode)
         .addArg("mempoolexpiry=<n>", requiredInt, strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY))
         .addArg("par=<n>", requiredInt, strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
             -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS))
+        .addArg("parinputs=<n>", requiredInt, strprintf(_("Set the number of threads checking the inputs of block transactions, 0 checks them on the validating thread (default: %d)"),
+            DEFAULT_INPUTCHECK_THREADS))
 #ifndef WIN32
         .addArg("pid=<file>", requiredStr, strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME))
 #endif
+        .addArg("persistmempool", optionalBool, strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL))
         .addArg("prune=<n>", requiredInt, strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode is incompatible with -txindex and -rescan. "
                 "Warning: Reverting this setting requires re-downloading the entire blockchain. "
                 "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024))
@@ -268,6 +275,8 @@ static void addConnectionOptions(AllowedArgs& allowedArgs)
         .addArg("min-thin-peers=<n>", requiredInt, strprintf(_("Maintain at minimum <n> connections to thin-capable peers (default: %d)"), DEFAULT_MIN_THIN_PEERS))
         .addArg("maxreceivebuffer=<n>", requiredInt, strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER))
         .addArg("maxsendbuffer=<n>", requiredInt, strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER))
+        .addArg("msghandthreads=<n>", requiredInt, strprintf(_("Number of threads to process messages from peers (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+            -GetNumCores(), MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS))
         .addArg("onion=<ip:port>", requiredStr, strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"))
         .addArg("onlynet=<net>", requiredStr, _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"))
         .addArg("permitbaremultisig", optionalBool, strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG))
@@ -416,6 +425,7 @@ static void addBlockCreationOptions(AllowedArgs& allowedArgs)
         .addArg("blockminsize=<n>", requiredInt, strprintf(_("Set minimum block size in bytes (default: %u)"), DEFAULT_BLOCK_MIN_SIZE))
         .addArg("blockmaxsize=<n>", requiredInt, strprintf("Set maximum block size in bytes (default: %d)", DEFAULT_BLOCK_MAX_SIZE))
         .addArg("blockprioritysize=<n>", requiredInt, strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE))
+        .addArg("blocktemplatecheck", optionalBool, strprintf("Fully validate each new block template before handing it out, blocks are validated on submission regardless (default: %u)", DEFAULT_CHECK_BLOCK_TEMPLATE))
         .addDebugArg("blockversion=<n>", requiredInt, "Override block version to test forking scenarios")
         ;
 }
@@ -0,0 +1,155 @@
+/*
+ * This file is part of the bitcoin-classic project
+ * Copyright (C) 2017 The Bitcoin Classic developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "blockcache.h"
+
+#include "core_memusage.h"
+#include "memusage.h"
+#include "primitives/block.h"
+#include "undo.h"
+
+namespace {
+size_t UndoUsage(const CBlockUndo &undo)
+{
+    size_t mem = memusage::DynamicUsage(undo.vtxundo);
+    for (auto txundo = undo.vtxundo.begin(); txundo != undo.vtxundo.end(); ++txundo) {
+        mem += memusage::DynamicUsage(txundo->vprevout);
+        for (auto in = txundo->vprevout.begin(); in != txundo->vprevout.end(); ++in) {
+            mem += RecursiveDynamicUsage(in->txout);
+        }
+    }
+    return mem;
+}
+}
+
+CBlockCache::CBlockCache()
+    : m_usage(0),
+      m_maxUsage(DEFAULT_BLOCK_CACHE_SIZE << 20),
+      m_blockHits(0),
+      m_blockMisses(0),
+      m_undoHits(0),
+      m_undoMisses(0)
+{
+}
+
+CBlockCache* CBlockCache::s_instance = 0;
+CBlockCache* CBlockCache::instance()
+{
+    if (s_instance == 0)
+        s_instance = new CBlockCache();
+    return s_instance;
+}
+
+void CBlockCache::add(const CBlock &block, CBlockUndo &undo)
+{
+    LOCK(m_lock);
+    if (m_maxUsage == 0)
+        return;
+    const uint256 hash = block.GetHash();
+    EntryList::iterator iter = find(hash);
+    if (iter != m_entries.end()) {
+        m_usage -= iter->usage;
+        m_index.erase(hash);
+        m_entries.erase(iter);
+    }
+
+    std::shared_ptr<CBlockUndo> undoCopy = std::make_shared<CBlockUndo>();
+    undoCopy->vtxundo.swap(undo.vtxundo);
+    Entry entry;
+    entry.hash = hash;
+    entry.block = std::make_shared<const CBlock>(block);
+    entry.usage = sizeof(CBlock) + sizeof(CBlockUndo) + RecursiveDynamicUsage(block) + UndoUsage(*undoCopy);
+    entry.undo = undoCopy;
+    m_entries.push_front(entry);
+    m_index.insert(std::make_pair(hash, m_entries.begin()));
+    m_usage += entry.usage;
+    limitUsage();
+}
+
+std::shared_ptr<const CBlock> CBlockCache::block(const uint256 &hash)
+{
+    LOCK(m_lock);
+    EntryList::iterator iter = find(hash);
+    if (iter == m_entries.end()) {
+        ++m_blockMisses;
+        return std::shared_ptr<const CBlock>();
+    }
+    ++m_blockHits;
+    return iter->block;
+}
+
+std::shared_ptr<const CBlockUndo> CBlockCache::undo(const uint256 &hash)
+{
+    LOCK(m_lock);
+    EntryList::iterator iter = find(hash);
+    if (iter == m_entries.end()) {
+        ++m_undoMisses;
+        return std::shared_ptr<const CBlockUndo>();
+    }
+    ++m_undoHits;
+    return iter->undo;
+}
+
+void CBlockCache::setMaxUsage(size_t maxUsage)
+{
+    LOCK(m_lock);
+    m_maxUsage = maxUsage;
+    limitUsage();
+}
+
+void CBlockCache::clear()
+{
+    LOCK(m_lock);
+    m_entries.clear();
+    m_index.clear();
+    m_usage = 0;
+}
+
+CBlockCache::Stats CBlockCache::stats() const
+{
+    LOCK(m_lock);
+    Stats stats;
+    stats.nBlocks = m_entries.size();
+    stats.nUsage = m_usage;
+    stats.nMaxUsage = m_maxUsage;
+    stats.nBlockHits = m_blockHits;
+    stats.nBlockMisses = m_blockMisses;
+    stats.nUndoHits = m_undoHits;
+    stats.nUndoMisses = m_undoMisses;
+    return stats;
+}
+
+CBlockCache::EntryList::iterator CBlockCache::find(const uint256 &hash)
+{
+    AssertLockHeld(m_lock);
+    std::map<uint256, EntryList::iterator>::iterator iter = m_index.find(hash);
+    if (iter == m_index.end())
+        return m_entries.end();
+    // move to the front, it is the most recently used now.
+    m_entries.splice(m_entries.begin(), m_entries, iter->second);
+    return iter->second;
+}
+
+void CBlockCache::limitUsage()
+{
+    AssertLockHeld(m_lock);
+    while (m_usage > m_maxUsage && !m_entries.empty()) {
+        m_usage -= m_entries.back().usage;
+        m_index.erase(m_entries.back().hash);
+        m_entries.pop_back();
+    }
+}
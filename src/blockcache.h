@@ -0,0 +1,97 @@
+/*
+ * This file is part of the bitcoin-classic project
+ * Copyright (C) 2017 The Bitcoin Classic developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <memory>
+
+class CBlock;
+class CBlockUndo;
+
+/** Default for -blockcachesize, in MiB */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 64;
+
+/**
+ * Keeps the most recently connected blocks together with their undo data.
+ *
+ * Blocks near the tip are needed again soon after they were connected; a
+ * short reorg disconnects them and may connect them again, and peers ask for
+ * them. This cache avoids reading and parsing the blk and rev files for those.
+ * The size is an estimate of the memory used, the least recently used block
+ * is dropped when the limit is reached.
+ */
+class CBlockCache
+{
+public:
+    CBlockCache();
+    static CBlockCache *instance();
+
+    struct Stats {
+        size_t nBlocks;
+        size_t nUsage;
+        size_t nMaxUsage;
+        uint64_t nBlockHits;
+        uint64_t nBlockMisses;
+        uint64_t nUndoHits;
+        uint64_t nUndoMisses;
+    };
+
+    /// Remember a block that was just connected. This takes over the contents of undo.
+    void add(const CBlock &block, CBlockUndo &undo);
+
+    /// Returns the block, or nullptr if it is not cached.
+    std::shared_ptr<const CBlock> block(const uint256 &hash);
+    /// Returns the undo data of a block, or nullptr if it is not cached.
+    std::shared_ptr<const CBlockUndo> undo(const uint256 &hash);
+
+    /// Set the maximum memory usage in bytes, zero disables the cache.
+    void setMaxUsage(size_t maxUsage);
+    void clear();
+    Stats stats() const;
+
+private:
+    struct Entry {
+        uint256 hash;
+        std::shared_ptr<const CBlock> block;
+        std::shared_ptr<const CBlockUndo> undo;
+        size_t usage;
+    };
+    typedef std::list<Entry> EntryList;
+
+    EntryList::iterator find(const uint256 &hash);
+    void limitUsage();
+
+    mutable CCriticalSection m_lock;
+    EntryList m_entries; // most recently used first
+    std::map<uint256, EntryList::iterator> m_index;
+    size_t m_usage;
+    size_t m_maxUsage;
+    uint64_t m_blockHits;
+    uint64_t m_blockMisses;
+    uint64_t m_undoHits;
+    uint64_t m_undoMisses;
+
+    static CBlockCache *s_instance;
+};
+
+#endif
@@ -6,12 +6,16 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 template <typename T>
 class CCheckQueueControl;
@@ -21,140 +25,200 @@ class CCheckQueueControl;
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * One or more threads push batches of verifications onto the queue, where
+  * they are processed by N-1 worker threads. When the master is done adding
+  * work, it temporarily joins the worker pool as an N'th worker, until all
+  * jobs are done.
+  *
+  * Every worker owns a deque of checks; Add() spreads new checks over the
+  * deques so the workers mostly take work without contending on a shared lock.
+  * A worker that runs out of work steals half of the deque of another one.
+  * The single mutex left is only taken to go to sleep and to wake up sleepers.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
+    friend class CCheckQueueControl<T>;
 
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    struct WorkQueue {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
 
-    //! Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+    //! The per-worker queues. Slot 0 is used by the master, workers share the others if there are more workers than slots.
+    std::vector<std::unique_ptr<WorkQueue> > queues;
+
+    //! Mutex to sleep on, protects nIdle
+    boost::mutex mutex;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Threads block on this when out of work, and the master when waiting for the workers to finish.
+    boost::condition_variable cond;
 
     //! The number of workers (including the master) that are idle.
     int nIdle;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of worker threads (excluding the master).
+    std::atomic<int> nWorkers;
+
+    //! Used to spread Add() calls over the queues.
+    std::atomic<unsigned int> nNextQueue;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<int> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Number of verifications that are still in one of the queues.
+    std::atomic<int> nQueued;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Held by the CCheckQueueControl using the queue, there is only one at a time. See CCheckQueueControl.
+    boost::mutex controlMutex;
+
+    /**
+     * Move a batch of checks out of the queue of slot into vChecks.
+     * From our own queue we take from the back, a thief takes from the front, to keep apart.
+     */
+    unsigned int Take(size_t slot, bool fSteal, std::vector<T> &vChecks)
+    {
+        WorkQueue &wq = *queues[slot];
+        boost::unique_lock<boost::mutex> lock(wq.mutex);
+        const unsigned int nSize = wq.checks.size();
+        if (nSize == 0)
+            return 0;
+        // Decide how many work units to process now.
+        // * Do not try to do everything at once, but aim for increasingly smaller batches as the
+        //   remaining number of checks goes down, so all workers finish approximately simultaneously.
+        // * When stealing, take at most half the queue, its owner is likely working on it too.
+        // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
+        const int nRemaining = std::max(0, nQueued.load());
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)nRemaining / (nWorkers + 1)));
+        nNow = std::min(nNow, fSteal ? (nSize + 1) / 2 : nSize);
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // We want the lock on the mutex to be as short as possible, so swap jobs from the
+            // queue to the local batch vector instead of copying.
+            if (fSteal) {
+                vChecks[i].swap(wq.checks.front());
+                wq.checks.pop_front();
+            } else {
+                vChecks[i].swap(wq.checks.back());
+                wq.checks.pop_back();
+            }
+        }
+        nQueued -= nNow;
+        return nNow;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(size_t slot, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
+            unsigned int nNow = Take(slot, false, vChecks);
+            for (size_t i = 1; nNow == 0 && i < queues.size(); ++i) {
+                nNow = Take((slot + i) % queues.size(), true, vChecks);
+            }
+            if (nNow == 0) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+                if (fMaster && nTodo == 0) {
+                    bool fRet = fAllOk;
+                    // reset the status for new work later
+                    fAllOk = true;
+                    // return the current status
+                    return fRet;
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
+                // Checks may have been added between our last look in the queues and taking the lock,
+                // Add() wakes us up only after it increased nQueued.
+                if (nQueued <= 0) {
                     nIdle++;
                     cond.wait(lock); // wait
                     nIdle--;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
+            // Check whether we need to do work at all
+            bool fOk = fAllOk;
             // execute work
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
             vChecks.clear();
+            if (!fOk)
+                fAllOk = false;
+            if ((nTodo -= nNow) == 0) {
+                // We processed the last element; inform the master it can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutex);
+                cond.notify_all();
+            }
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn)
+        : nIdle(0), nWorkers(0), nNextQueue(0), fAllOk(true), nTodo(0), nQueued(0), nBatchSize(nBatchSizeIn)
+    {
+        const unsigned int nCores = std::min(std::max(boost::thread::hardware_concurrency(), 1U), 256U);
+        for (unsigned int i = 0; i <= nCores; ++i) {
+            queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+        }
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        const size_t slot = 1 + nWorkers++ % (queues.size() - 1);
+        Loop(slot);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
-    //! Add a batch of checks to the queue
+    //! Add a batch of checks to the queue. This may be called from several threads at the same time.
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        const int nCount = vChecks.size();
+        // account for the checks before anyone can take them
+        nTodo += nCount;
+        nQueued += nCount;
+
+        // Hand every queue that has a worker its own part.
+        const size_t nActive = std::min<size_t>(queues.size(), nWorkers + 1);
+        const size_t nPart = (vChecks.size() + nActive - 1) / nActive;
+        size_t slot = nNextQueue++ % nActive;
+        typename std::vector<T>::iterator iter = vChecks.begin();
+        while (iter != vChecks.end()) {
+            WorkQueue &wq = *queues[slot];
+            boost::unique_lock<boost::mutex> lock(wq.mutex);
+            for (size_t i = 0; i < nPart && iter != vChecks.end(); ++i, ++iter) {
+                wq.checks.push_back(T());
+                iter->swap(wq.checks.back());
+            }
+            slot = (slot + 1) % nActive;
         }
-        nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nIdle == 0)
+            return;
+        if (nCount == 1)
+            cond.notify_one();
+        else
+            cond.notify_all();
     }
 
     ~CCheckQueue()
@@ -163,8 +227,7 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return nTodo == 0 && nQueued == 0 && fAllOk;
     }
 
 };
@@ -172,6 +235,12 @@ public:
 /** 
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
+ *
+ * A queue has one controller at a time. The constructor of a second controller
+ * of the same queue blocks until the first one is destroyed, so controllers may
+ * be created from any thread. A caller that must not wait behind another one,
+ * for instance because it holds a lock the other does not, should not share
+ * its queue with callers that run without that lock.
  */
 template <typename T>
 class CCheckQueueControl
@@ -179,14 +248,16 @@ class CCheckQueueControl
 private:
     CCheckQueue<T>* pqueue;
     bool fDone;
+    boost::unique_lock<boost::mutex> controlLock;
 
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
-            bool isIdle = pqueue->IsIdle();
-            assert(isIdle);
+            boost::unique_lock<boost::mutex> lock(pqueue->controlMutex);
+            controlLock.swap(lock);
+            assert(pqueue->IsIdle());
         }
     }
 
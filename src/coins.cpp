@@ -7,7 +7,9 @@
 #include "memusage.h"
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <limits>
 
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
@@ -41,8 +43,33 @@ bool CCoins::Spend(uint32_t nPos)
     return true;
 }
 
+namespace {
+// one key for the process, drawn before the first coins map is created.
+struct SipHashKey {
+    SipHashKey() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+    const uint64_t k0, k1;
+};
+}
+
+SaltedTxidHasher::SaltedTxidHasher()
+{
+    static const SipHashKey key;
+    k0 = key.k0;
+    k1 = key.k1;
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
+void CCoinsView::BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const
+{
+    CCoins coins;
+    BOOST_FOREACH (const uint256 &txid, txids) {
+        if (GetCoins(txid, coins)) {
+            result.push_back(std::make_pair(txid, CCoins()));
+            result.back().second.swap(coins);
+        }
+    }
+}
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
@@ -51,6 +78,7 @@ bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
 bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { return base->GetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
+void CCoinsViewBacked::BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const { base->BatchGetCoins(txids, result); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
@@ -94,6 +122,50 @@ bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     return false;
 }
 
+void CCoinsViewCache::BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const
+{
+    PrefetchCoins(txids);
+    BOOST_FOREACH (const uint256 &txid, txids) {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        if (it != cacheCoins.end())
+            result.push_back(std::make_pair(txid, it->second.coins));
+    }
+}
+
+size_t CCoinsViewCache::PrefetchCoins(const std::vector<uint256> &txids) const
+{
+    std::vector<uint256> missing;
+    missing.reserve(txids.size());
+    BOOST_FOREACH (const uint256 &txid, txids) {
+        if (cacheCoins.find(txid) == cacheCoins.end())
+            missing.push_back(txid);
+    }
+    if (missing.empty())
+        return 0;
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+    std::vector<std::pair<uint256, CCoins> > found;
+    found.reserve(missing.size());
+    base->BatchGetCoins(missing, found);
+
+    size_t added = 0;
+    for (size_t i = 0; i < found.size(); ++i) {
+        std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(found[i].first, CCoinsCacheEntry()));
+        if (!ret.second)
+            continue;
+        found[i].second.swap(ret.first->second.coins);
+        if (ret.first->second.coins.IsPruned()) {
+            // The parent only has an empty entry for this txid; we can consider our
+            // version as fresh.
+            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        }
+        cachedCoinsUsage += ret.first->second.coins.DynamicMemoryUsage();
+        ++added;
+    }
+    return added;
+}
+
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
@@ -8,6 +8,8 @@
 
 #include "compressor.h"
 #include "core_memusage.h"
+#include "flathashmap.h"
+#include "hash.h"
 #include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -17,7 +19,6 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
-#include <boost/unordered_map.hpp>
 
 /** 
  * Pruned version of CTransaction: only retains metadata and unspent transaction outputs
@@ -278,7 +279,24 @@ struct CCoinsCacheEntry
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, Blocks::BlockHashShortener> CCoinsMap;
+/**
+ * Hashes transaction ids with SipHash and a random key chosen at startup. Peers pick
+ * the ids, so the truncated id itself would let them line up entries in a hash table.
+ */
+class SaltedTxidHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedTxidHasher();
+
+    size_t operator()(const uint256& txid) const {
+        return SipHashUint256(k0, k1, txid);
+    }
+};
+
+typedef FlatHashMap<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
 
 struct CCoinsStats
 {
@@ -305,6 +323,10 @@ public:
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256 &txid) const;
 
+    //! Retrieve the CCoins for a list of txids in one go.
+    //! Only the txids that were found are appended to result, in no particular order.
+    virtual void BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const;
+
     //! Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock() const;
 
@@ -330,6 +352,7 @@ public:
     CCoinsViewBacked(CCoinsView *viewIn);
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
+    void BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
@@ -384,6 +407,7 @@ public:
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
+    void BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256 &hashBlock);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
@@ -395,6 +419,15 @@ public:
      */
     bool HaveCoinsInCache(const uint256 &txid) const;
 
+    /**
+     * Load all the listed txids that are not in this cache yet from the backing
+     * view with a single BatchGetCoins() call, instead of one lookup per miss.
+     * Typically called with the prevouts of a block or a batch of transactions
+     * before they are processed.
+     * @return the number of entries that were added to the cache.
+     */
+    size_t PrefetchCoins(const std::vector<uint256> &txids) const;
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
@@ -93,6 +93,11 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+#if !defined(WIN32) && defined(HAVE_SYS_EPOLL_H)
+// the socket handler waits with epoll instead of select()
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s) {
 #ifdef WIN32
     return true;
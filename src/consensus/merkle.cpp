@@ -5,8 +5,10 @@
 
 #include "merkle.h"
 #include "hash.h"
+#include "crypto/sha256.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
 #include <boost/atomic.hpp>
 
 /*     WARNING! If you're reading this because you're learning about crypto
@@ -45,7 +47,8 @@
        root.
 */
 
-/* This implements a constant-space merkle root/path calculator, limited to 2^32 leaves. */
+/* This implements a constant-space merkle root/path calculator, limited to 2^32 leaves.
+ * ComputeMerkleRoot() hashes whole levels at once instead, see below. */
 static void MerkleComputation(const std::vector<uint256>& leaves, uint256* proot, bool* pmutated, uint32_t branchpos, std::vector<uint256>* pbranch) {
     if (pbranch) pbranch->clear();
     if (leaves.size() == 0) {
@@ -133,10 +136,25 @@ static void MerkleComputation(const std::vector<uint256>& leaves, uint256* proot
     if (proot) *proot = h;
 }
 
-uint256 ComputeMerkleRoot(const std::vector<uint256>& leaves, bool* mutated) {
-    uint256 hash;
-    MerkleComputation(leaves, &hash, mutated, -1, NULL);
-    return hash;
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated) {
+    bool mutation = false;
+    while (hashes.size() > 1) {
+        if (mutated) {
+            for (size_t pos = 0; pos + 1 < hashes.size(); pos += 2) {
+                if (hashes[pos] == hashes[pos + 1]) mutation = true;
+            }
+        }
+        if (hashes.size() & 1) {
+            hashes.push_back(hashes.back());
+        }
+        // Every pair of 32 byte hashes is one 64 byte input, the results of
+        // a level overwrite the first half of the same buffer.
+        SHA256D64(hashes[0].begin(), hashes[0].begin(), hashes.size() / 2);
+        hashes.resize(hashes.size() / 2);
+    }
+    if (mutated) *mutated = mutation;
+    if (hashes.size() == 0) return uint256();
+    return hashes[0];
 }
 
 std::vector<uint256> ComputeMerkleBranch(const std::vector<uint256>& leaves, uint32_t position) {
@@ -162,11 +180,13 @@ uint256 BlockMerkleRoot(const CBlock& block, bool* mutated)
 {
     std::vector<uint256> leaves;
     const uint32_t size = block.vtx.size();
+    // one spare entry so odd levels never reallocate
+    leaves.reserve(size + 1);
     leaves.resize(size);
     int txWithDetachableSigsCount = 0;
     for (uint32_t s = 0; s < size; s++) {
-        leaves[s] = block.vtx[s].GetHash();
-        if (s != 0 && block.vtx[s].nVersion == 4)
+        leaves[s] = block.vtx[s]->GetHash();
+        if (s != 0 && block.vtx[s]->nVersion == 4)
             ++txWithDetachableSigsCount;
     }
 
@@ -176,15 +196,16 @@ uint256 BlockMerkleRoot(const CBlock& block, bool* mutated)
      * we append the v4 transactions signature hash to the tree.
      */
     if (flexTransActive) {
+        leaves.reserve(size + txWithDetachableSigsCount + 1);
         leaves.resize(size + txWithDetachableSigsCount);
         uint32_t pos = size;
         for (uint32_t s = 1; s < size; s++) {
-            if (block.vtx[s].nVersion == 4)
-                leaves[pos++] = block.vtx[s].CalculateSignaturesHash();
+            if (block.vtx[s]->nVersion == 4)
+                leaves[pos++] = block.vtx[s]->CalculateSignaturesHash();
         }
         assert(pos == size + txWithDetachableSigsCount);
     }
-    return ComputeMerkleRoot(leaves, mutated);
+    return ComputeMerkleRoot(std::move(leaves), mutated);
 }
 
 std::vector<uint256> BlockMerkleBranch(const CBlock& block, uint32_t position)
@@ -192,7 +213,64 @@ std::vector<uint256> BlockMerkleBranch(const CBlock& block, uint32_t position)
     std::vector<uint256> leaves;
     leaves.resize(block.vtx.size());
     for (size_t s = 0; s < block.vtx.size(); s++) {
-        leaves[s] = block.vtx[s].GetHash();
+        leaves[s] = block.vtx[s]->GetHash();
     }
     return ComputeMerkleBranch(leaves, position);
 }
+
+// Hash the node at position of the level above level, if the right child is missing the left one is used twice.
+static void HashNode(const std::vector<uint256> &level, uint32_t position, uint256 &out, bool &mutated)
+{
+    const uint32_t left = position * 2;
+    if (left + 1 < level.size()) {
+        if (level[left] == level[left + 1])
+            mutated = true;
+        SHA256D64(out.begin(), level[left].begin(), 1);
+    } else {
+        CHash256().Write(level[left].begin(), 32).Write(level[left].begin(), 32).Finalize(out.begin());
+    }
+}
+
+IncompleteMerkleTree::IncompleteMerkleTree(std::vector<uint256> leaves)
+    : m_mutated(false)
+{
+    m_levels.push_back(std::move(leaves));
+    while (m_levels.back().size() > 1) {
+        const std::vector<uint256> &level = m_levels.back();
+        std::vector<uint256> next((level.size() + 1) / 2);
+        for (uint32_t pos = 0; pos < next.size(); ++pos) {
+            const uint32_t left = pos * 2;
+            if (level[left].IsNull() || (left + 1 < level.size() && level[left + 1].IsNull()))
+                continue; // waits for setLeaf()
+            HashNode(level, pos, next[pos], m_mutated);
+        }
+        m_levels.push_back(std::move(next));
+    }
+}
+
+void IncompleteMerkleTree::setLeaf(uint32_t position, const uint256 &hash)
+{
+    assert(position < m_levels[0].size());
+    m_levels[0][position] = hash;
+    m_setLeaves.push_back(position);
+}
+
+uint256 IncompleteMerkleTree::root(bool *mutated)
+{
+    std::vector<uint32_t> positions;
+    positions.swap(m_setLeaves);
+    for (size_t l = 1; l < m_levels.size(); ++l) {
+        // the parents of the nodes that changed on the level below
+        for (size_t i = 0; i < positions.size(); ++i)
+            positions[i] /= 2;
+        std::sort(positions.begin(), positions.end());
+        positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+        for (uint32_t pos : positions) {
+            if (m_levels[l][pos].IsNull())
+                HashNode(m_levels[l - 1], pos, m_levels[l][pos], m_mutated);
+        }
+    }
+    if (mutated) *mutated = m_mutated;
+    if (m_levels[0].empty()) return uint256();
+    return m_levels.back()[0];
+}
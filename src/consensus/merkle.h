@@ -12,7 +12,14 @@
 #include "primitives/block.h"
 #include "uint256.h"
 
-uint256 ComputeMerkleRoot(const std::vector<uint256>& leaves, bool* mutated = NULL);
+/*
+ * Compute the Merkle root of the hashes, one tree level at a time using the
+ * multi-way SHA256D64(). The hashes are replaced level by level, pass them with
+ * std::move to avoid a copy. Reserve one entry more than the number of
+ * leaves to avoid a reallocation on odd levels.
+ * *mutated is set to true if a duplicated subtree was found.
+ */
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated = NULL);
 std::vector<uint256> ComputeMerkleBranch(const std::vector<uint256>& leaves, uint32_t position);
 uint256 ComputeMerkleRootFromBranch(const uint256& leaf, const std::vector<uint256>& branch, uint32_t position);
 
@@ -29,4 +36,30 @@ uint256 BlockMerkleRoot(const CBlock& block, bool* mutated = NULL);
  */
 std::vector<uint256> BlockMerkleBranch(const CBlock& block, uint32_t position);
 
+/*
+ * The merkle tree of a list of hashes of which some are not known yet, for
+ * instance a thin block that waits for some of its transactions.
+ * Every node that does not depend on a missing leaf is hashed on construction,
+ * after the missing leaves are set root() only hashes their paths to the top.
+ */
+class IncompleteMerkleTree
+{
+public:
+    /// Null hashes in \a leaves are the missing ones.
+    explicit IncompleteMerkleTree(std::vector<uint256> leaves);
+
+    void setLeaf(uint32_t position, const uint256 &hash);
+
+    /*
+     * Returns the merkle root, which needs all leaves to be set.
+     * *mutated is set to true if a duplicated subtree was found, like ComputeMerkleRoot().
+     */
+    uint256 root(bool *mutated = NULL);
+
+private:
+    std::vector<std::vector<uint256> > m_levels; // m_levels[0] are the leaves
+    std::vector<uint32_t> m_setLeaves;
+    bool m_mutated;
+};
+
 #endif
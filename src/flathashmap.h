@@ -0,0 +1,356 @@
+// Copyright (c) 2017 The Bitcoin Classic developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATHASHMAP_H
+#define BITCOIN_FLATHASHMAP_H
+
+#include "memusage.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Hash map for large numbers of small entries, such as the coins cache.
+ *
+ * The lookup table is an open-addressing (linear probing) array of 8 byte buckets
+ * holding the hash and the index of the entry, so a lookup typically touches a
+ * single cache line before it reaches the entry itself.
+ * The entries are not allocated one by one; they are placed in an arena made of
+ * chunks that double in size up to 1024 entries, so a big map wastes little of
+ * it. Entries never move once inserted, which means that pointers and iterators
+ * stay valid until that entry is erased, also when the table grows. The arena
+ * slots of erased entries are kept on a free list and reused by later inserts,
+ * and clear() releases the whole arena at once.
+ *
+ * Iteration follows the arena order, and erasing an entry does not invalidate
+ * iterators to other entries.
+ *
+ * Linear probing degrades badly when many keys share a bucket, so with keys that
+ * peers choose, Hash has to be keyed with a secret (see SaltedTxidHasher).
+ */
+template <typename K, typename V, typename Hash>
+class FlatHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+private:
+    static const uint32_t EMPTY = 0xFFFFFFFF;
+    static const uint32_t DELETED = 0xFFFFFFFE;
+    static const uint32_t FIRST_CHUNK_SIZE = 16;
+    static const uint32_t MAX_CHUNK_SHIFT = 6; // chunks stop growing at 1024 nodes
+
+    struct Bucket {
+        uint32_t hash;
+        uint32_t node;
+    };
+    typedef typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type NodeStorage;
+
+    std::vector<Bucket> m_buckets;
+    std::vector<NodeStorage*> m_chunks;
+    std::vector<bool> m_used;    // per arena slot, up to m_highWater
+    std::vector<uint32_t> m_free; // arena slots that have been erased
+    uint32_t m_highWater;         // number of arena slots ever handed out
+    size_t m_size;
+    size_t m_deleted;             // buckets marked DELETED
+    Hash m_hasher;
+
+    static inline uint32_t chunkSize(uint32_t k) {
+        return FIRST_CHUNK_SIZE << (k < MAX_CHUNK_SHIFT ? k : MAX_CHUNK_SHIFT);
+    }
+    static inline uint32_t chunkIndex(uint32_t node, uint32_t &offset) {
+        // chunk k < MAX_CHUNK_SHIFT holds FIRST_CHUNK_SIZE << k nodes and starts at FIRST_CHUNK_SIZE * (2^k - 1),
+        // after that all chunks have the same size.
+        const uint32_t doubled = FIRST_CHUNK_SIZE * ((1U << MAX_CHUNK_SHIFT) - 1);
+        if (node >= doubled) {
+            const uint32_t size = FIRST_CHUNK_SIZE << MAX_CHUNK_SHIFT;
+            offset = (node - doubled) % size;
+            return MAX_CHUNK_SHIFT + (node - doubled) / size;
+        }
+        const uint32_t n = node / FIRST_CHUNK_SIZE + 1;
+        const uint32_t k = 31 - __builtin_clz(n);
+        offset = node - FIRST_CHUNK_SIZE * ((1U << k) - 1);
+        return k;
+    }
+    inline value_type *nodeAt(uint32_t node) const {
+        uint32_t offset;
+        const uint32_t k = chunkIndex(node, offset);
+        return reinterpret_cast<value_type*>(m_chunks[k] + offset);
+    }
+    inline uint32_t hashOf(const K &key) const {
+        return static_cast<uint32_t>(m_hasher(key));
+    }
+
+    uint32_t allocateNode() {
+        if (!m_free.empty()) {
+            const uint32_t node = m_free.back();
+            m_free.pop_back();
+            return node;
+        }
+        const uint32_t node = m_highWater;
+        uint32_t offset;
+        const uint32_t k = chunkIndex(node, offset);
+        if (k >= m_chunks.size()) {
+            assert(k == m_chunks.size());
+            m_chunks.push_back(new NodeStorage[chunkSize(k)]);
+        }
+        ++m_highWater;
+        m_used.push_back(false);
+        return node;
+    }
+
+    /// Returns the bucket holding key, or the bucket to insert it into if the key is not present.
+    size_t findBucket(const K &key, uint32_t hash, bool &found) const {
+        assert(!m_buckets.empty());
+        const size_t mask = m_buckets.size() - 1;
+        size_t pos = hash & mask;
+        size_t firstDeleted = EMPTY;
+        while (true) {
+            const Bucket &b = m_buckets[pos];
+            if (b.node == EMPTY) {
+                found = false;
+                return firstDeleted != EMPTY ? firstDeleted : pos;
+            }
+            if (b.node == DELETED) {
+                if (firstDeleted == EMPTY)
+                    firstDeleted = pos;
+            } else if (b.hash == hash && nodeAt(b.node)->first == key) {
+                found = true;
+                return pos;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    void rehash(size_t newBucketCount) {
+        std::vector<Bucket> buckets(newBucketCount);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i].node = EMPTY;
+        }
+        const size_t mask = newBucketCount - 1;
+        for (size_t i = 0; i < m_buckets.size(); ++i) {
+            const Bucket &b = m_buckets[i];
+            if (b.node == EMPTY || b.node == DELETED)
+                continue;
+            size_t pos = b.hash & mask;
+            while (buckets[pos].node != EMPTY)
+                pos = (pos + 1) & mask;
+            buckets[pos] = b;
+        }
+        m_buckets.swap(buckets);
+        m_deleted = 0;
+    }
+
+    void reserveOne() {
+        // keep the load (including deleted markers) under 3/4
+        if ((m_size + m_deleted + 1) * 4 <= m_buckets.size() * 3)
+            return;
+        size_t count = m_buckets.empty() ? FIRST_CHUNK_SIZE : m_buckets.size();
+        while ((m_size + 1) * 2 > count)
+            count *= 2;
+        rehash(count);
+    }
+
+    void eraseNode(size_t bucket) {
+        const uint32_t node = m_buckets[bucket].node;
+        nodeAt(node)->~value_type();
+        m_used[node] = false;
+        m_free.push_back(node);
+        m_buckets[bucket].node = DELETED;
+        ++m_deleted;
+        --m_size;
+    }
+
+    FlatHashMap(const FlatHashMap&);
+    FlatHashMap &operator=(const FlatHashMap&);
+
+public:
+    template <typename MapType, typename ValueType>
+    class iterator_base
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef ValueType value_type;
+        typedef ptrdiff_t difference_type;
+        typedef ValueType *pointer;
+        typedef ValueType &reference;
+
+        iterator_base() : map(0), node(0) {}
+        iterator_base(MapType *m, uint32_t n) : map(m), node(n) {}
+        template <typename M2, typename V2>
+        iterator_base(const iterator_base<M2, V2> &other) : map(other.map), node(other.node) {}
+
+        ValueType &operator*() const { return *map->nodeAt(node); }
+        ValueType *operator->() const { return map->nodeAt(node); }
+        iterator_base &operator++() {
+            ++node;
+            while (node < map->m_highWater && !map->m_used[node])
+                ++node;
+            return *this;
+        }
+        iterator_base operator++(int) {
+            iterator_base copy(*this);
+            ++(*this);
+            return copy;
+        }
+        template <typename M2, typename V2>
+        bool operator==(const iterator_base<M2, V2> &other) const { return node == other.node; }
+        template <typename M2, typename V2>
+        bool operator!=(const iterator_base<M2, V2> &other) const { return node != other.node; }
+
+    private:
+        template <typename M2, typename V2> friend class iterator_base;
+        friend class FlatHashMap;
+        MapType *map;
+        uint32_t node;
+    };
+    typedef iterator_base<FlatHashMap, value_type> iterator;
+    typedef iterator_base<const FlatHashMap, const value_type> const_iterator;
+
+    FlatHashMap() : m_highWater(0), m_size(0), m_deleted(0) {}
+    ~FlatHashMap() {
+        clear();
+    }
+
+    iterator begin() {
+        iterator it(this, 0);
+        if (m_highWater > 0 && !m_used[0])
+            ++it;
+        return it;
+    }
+    const_iterator begin() const {
+        const_iterator it(this, 0);
+        if (m_highWater > 0 && !m_used[0])
+            ++it;
+        return it;
+    }
+    iterator end() { return iterator(this, m_highWater); }
+    const_iterator end() const { return const_iterator(this, m_highWater); }
+
+    size_type size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_type bucket_count() const { return m_buckets.size(); }
+
+    iterator find(const K &key) {
+        if (m_size == 0)
+            return end();
+        bool found;
+        const size_t pos = findBucket(key, hashOf(key), found);
+        return found ? iterator(this, m_buckets[pos].node) : end();
+    }
+    const_iterator find(const K &key) const {
+        if (m_size == 0)
+            return end();
+        bool found;
+        const size_t pos = findBucket(key, hashOf(key), found);
+        return found ? const_iterator(this, m_buckets[pos].node) : end();
+    }
+    size_type count(const K &key) const {
+        return find(key) == end() ? 0 : 1;
+    }
+
+    std::pair<iterator, bool> insert(const std::pair<K, V> &item) {
+        reserveOne();
+        const uint32_t hash = hashOf(item.first);
+        bool found;
+        const size_t pos = findBucket(item.first, hash, found);
+        if (found)
+            return std::make_pair(iterator(this, m_buckets[pos].node), false);
+        const uint32_t node = allocateNode();
+        new (nodeAt(node)) value_type(item.first, item.second);
+        m_used[node] = true;
+        if (m_buckets[pos].node == DELETED)
+            --m_deleted;
+        m_buckets[pos].hash = hash;
+        m_buckets[pos].node = node;
+        ++m_size;
+        return std::make_pair(iterator(this, node), true);
+    }
+
+    V &operator[](const K &key) {
+        return insert(std::make_pair(key, V())).first->second;
+    }
+
+    void erase(const_iterator it) {
+        assert(it.node < m_highWater && m_used[it.node]);
+        bool found;
+        const size_t pos = findBucket(it->first, hashOf(it->first), found);
+        assert(found);
+        assert(m_buckets[pos].node == it.node);
+        eraseNode(pos);
+    }
+    size_type erase(const K &key) {
+        if (m_size == 0)
+            return 0;
+        bool found;
+        const size_t pos = findBucket(key, hashOf(key), found);
+        if (!found)
+            return 0;
+        eraseNode(pos);
+        return 1;
+    }
+
+    /// Destroy all entries and release the lookup table and the arena.
+    void clear() {
+        for (uint32_t i = 0; i < m_highWater; ++i) {
+            if (m_used[i])
+                nodeAt(i)->~value_type();
+        }
+        for (size_t i = 0; i < m_chunks.size(); ++i) {
+            delete[] m_chunks[i];
+        }
+        std::vector<Bucket>().swap(m_buckets);
+        std::vector<NodeStorage*>().swap(m_chunks);
+        std::vector<bool>().swap(m_used);
+        std::vector<uint32_t>().swap(m_free);
+        m_highWater = 0;
+        m_size = 0;
+        m_deleted = 0;
+    }
+
+    /// Exchange the contents with other. Entries do not move, so pointers to them stay valid.
+    void swap(FlatHashMap &other) {
+        m_buckets.swap(other.m_buckets);
+        m_chunks.swap(other.m_chunks);
+        m_used.swap(other.m_used);
+        m_free.swap(other.m_free);
+        std::swap(m_highWater, other.m_highWater);
+        std::swap(m_size, other.m_size);
+        std::swap(m_deleted, other.m_deleted);
+        std::swap(m_hasher, other.m_hasher);
+    }
+
+    /// Memory allocated by the map itself, not including what the entries allocate.
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::MallocUsage(m_buckets.capacity() * sizeof(Bucket));
+        for (size_t i = 0; i < m_chunks.size(); ++i) {
+            ret += memusage::MallocUsage(chunkSize(i) * sizeof(NodeStorage));
+        }
+        ret += memusage::DynamicUsage(m_chunks);
+        ret += memusage::MallocUsage(m_used.capacity() / 8);
+        ret += memusage::DynamicUsage(m_free);
+        return ret;
+    }
+};
+
+namespace memusage
+{
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const FlatHashMap<X, Y, Z>& m)
+{
+    return m.DynamicMemoryUsage();
+}
+}
+
+#endif // BITCOIN_FLATHASHMAP_H
@@ -12,10 +12,12 @@
 #include "Application.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "crypto/sha256.h"
 #include "consensus/validation.h"
 #include "httpserver.h"
 #include "httprpc.h"
@@ -28,6 +30,7 @@
 #include "script/standard.h"
 #include "script/sigcache.h"
 #include "scheduler.h"
+#include "thinblock.h"
 #include "txdb.h"
 #include "BlocksDB.h"
 #include "txmempool.h"
@@ -154,10 +157,19 @@ public:
             abort();
         }
     }
+    void BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const {
+        try {
+            CCoinsViewBacked::BatchGetCoins(txids, result);
+        } catch(const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            // See GetCoins() for why we abort here.
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -212,6 +224,10 @@ void Shutdown()
 
     Application::quit(0);
     Application::exec(); // waits for threads to finish.
+    CThinBlockFilter::Stop();
+
+    if (fDumpMempoolLater)
+        DumpMempool(mempool);
 
     {
         LOCK(cs_main);
@@ -565,12 +581,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     int nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
     // Trim requested connection counts, to fit into system limitations
+#ifndef USE_EPOLL // with epoll the socket handler isn't limited to FD_SETSIZE
+    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -608,6 +626,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    // the input checks hand their scripts to the script check threads, without those they run inline
+    nTxInputCheckThreads = 0;
+    if (nScriptCheckThreads)
+        nTxInputCheckThreads = std::max(0, std::min<int>(GetArg("-parinputs", DEFAULT_INPUTCHECK_THREADS), MAX_SCRIPTCHECK_THREADS));
 
     fServer = GetBoolArg("-server", false);
 
@@ -731,6 +753,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
+    // Pick the fastest SHA256 implementation this CPU supports
+    const std::string sha256Implementation = SHA256AutoDetect();
+
     // Initialize elliptic curve code
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
@@ -770,6 +795,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Startup time: %s\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()));
     LogPrintf("Using data directory %s\n", strDataDir);
     LogPrintf("Using config file %s\n", GetConfigFile().string());
+    LogPrintf("Using the '%s' SHA256 implementation\n", sha256Implementation);
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
@@ -778,6 +804,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
+    LogPrintf("Using %u threads for block transaction input checks\n", nTxInputCheckThreads);
+    for (int i = 0; i < nTxInputCheckThreads; i++)
+        threadGroup.create_thread(&ThreadTxInputsCheck);
+    // verifying mempool transactions outside cs_main uses a pool of its own, next to the block's
+    if (nScriptCheckThreads) {
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
+    }
 
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
@@ -986,6 +1020,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
+    const int64_t nBlockCache = std::max((int64_t)0, GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE)) << 20;
+    CBlockCache::instance()->setMaxUsage(nBlockCache);
+    LogPrintf("* Using %.1fMiB for recently connected blocks\n", nBlockCache * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1004,6 +1041,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
                 Blocks::DB::createInstance(nBlockTreeDBCache, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pcoinsdbview->SetBackgroundFlush(GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH));
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
@@ -1322,6 +1360,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-listenonion", DEFAULT_LISTEN_ONION))
         StartTorControl(threadGroup, scheduler);
 
+    // Start keeping the bloom filter we send with get_xthin up to date
+    if (IsThinBlocksEnabled())
+        CThinBlockFilter::instance();
+
     StartNode(threadGroup, scheduler);
 
     // Monitor the chain, and alert if we get blocks much quicker or slower than expected
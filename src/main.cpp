@@ -9,6 +9,7 @@
 #include "addrman.h"
 #include "Application.h"
 #include "arith_uint256.h"
+#include "blockcache.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -63,7 +64,9 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nTxInputCheckThreads = 0;
 bool fImporting = false;
+bool fDumpMempoolLater = false;
 bool fTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
@@ -544,6 +547,97 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     return true;
 }
 
+namespace {
+/**
+ * The last blocks of the active chain, to answer getheaders from peers that are in sync
+ * without taking cs_main.
+ * Follows the tip through UpdatedBlockTip, which is not sent during initial block download,
+ * and is cleared when a block is disconnected.
+ */
+class RecentHeaders
+{
+public:
+    /// Requires cs_main, tip is the tip of chainActive
+    void setTip(CBlockIndex *tip);
+    void clear();
+    bool empty();
+    /**
+     * Collects the headers following the fork point of the locator, up to hashStop.
+     * Returns false if the fork point is not among the recent blocks.
+     */
+    bool find(const CBlockLocator &locator, const uint256 &hashStop, std::vector<CBlock> &headers, CBlockIndex *&pindexLast);
+
+private:
+    CCriticalSection m_lock;
+    std::vector<CBlockIndex*> m_chain; // oldest first
+    boost::unordered_map<uint256, int, Blocks::BlockHashShortener> m_positions; // in m_chain
+};
+
+void RecentHeaders::setTip(CBlockIndex *tip)
+{
+    std::vector<CBlockIndex*> chain;
+    chain.reserve(MAX_HEADERS_RESULTS);
+    for (CBlockIndex *index = tip; index && chain.size() < MAX_HEADERS_RESULTS; index = index->pprev)
+        chain.push_back(index);
+    std::reverse(chain.begin(), chain.end());
+    boost::unordered_map<uint256, int, Blocks::BlockHashShortener> positions;
+    for (size_t i = 0; i < chain.size(); ++i)
+        positions.insert(std::make_pair(chain[i]->GetBlockHash(), i));
+
+    LOCK(m_lock);
+    m_chain.swap(chain);
+    m_positions.swap(positions);
+}
+
+void RecentHeaders::clear()
+{
+    LOCK(m_lock);
+    m_chain.clear();
+    m_positions.clear();
+}
+
+bool RecentHeaders::empty()
+{
+    LOCK(m_lock);
+    return m_chain.empty();
+}
+
+bool RecentHeaders::find(const CBlockLocator &locator, const uint256 &hashStop, std::vector<CBlock> &headers, CBlockIndex *&pindexLast)
+{
+    LOCK(m_lock);
+    if (m_chain.empty())
+        return false;
+    // Like FindForkInGlobalIndex(), the locator starts at the peer's tip. Hashes that are
+    // not in the recent blocks are higher than the fork point and not in our chain.
+    BOOST_FOREACH (const uint256 &hash, locator.vHave) {
+        auto iter = m_positions.find(hash);
+        if (iter == m_positions.end())
+            continue;
+        pindexLast = m_chain.back();
+        for (size_t pos = iter->second + 1; pos < m_chain.size(); ++pos) {
+            headers.push_back(m_chain[pos]->GetBlockHeader());
+            if (headers.size() >= MAX_HEADERS_RESULTS || m_chain[pos]->GetBlockHash() == hashStop) {
+                pindexLast = m_chain[pos];
+                break;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+RecentHeaders s_recentHeaders;
+
+void UpdateRecentHeaders(const CBlockIndex *)
+{
+    // The signals of concurrent ActivateBestChain calls may arrive out of order and after an
+    // invalidateblock, the chain itself is what counts.
+    LOCK(cs_main);
+    if (!IsInitialBlockDownload())
+        s_recentHeaders.setTip(chainActive.Tip());
+}
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -551,6 +645,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
+    GetMainSignals().UpdatedBlockTip.connect(&UpdateRecentHeaders);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
@@ -560,6 +655,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
+    GetMainSignals().UpdatedBlockTip.disconnect(&UpdateRecentHeaders);
 }
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -578,6 +674,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
@@ -798,16 +895,7 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
 
 unsigned int GetLegacySigOpCount(const CTransaction& tx)
 {
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        nSigOps += txin.scriptSig.GetSigOpCount(false);
-    }
-    BOOST_FOREACH(const CTxOut& txout, tx.vout)
-    {
-        nSigOps += txout.scriptPubKey.GetSigOpCount(false);
-    }
-    return nSigOps;
+    return tx.GetLegacySigOpCount();
 }
 
 unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& inputs)
@@ -815,6 +903,11 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     if (tx.IsCoinBase())
         return 0;
 
+    // The spent outputs are fixed by the txids in the prevouts, so the count never changes.
+    const int cached = tx.GetCachedP2SHSigOpCount();
+    if (cached >= 0)
+        return cached;
+
     unsigned int nSigOps = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
@@ -822,6 +915,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
         if (prevout.scriptPubKey.IsPayToScriptHash())
             nSigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
     }
+    tx.SetCachedP2SHSigOpCount(nSigOps);
     return nSigOps;
 }
 
@@ -840,7 +934,7 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state)
     if (tx.vout.empty())
         return state.DoS(10, false, REJECT_INVALID, "bad-txns-vout-empty");
     // Size limits
-    if (::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+    if (tx.GetTxSize() > MAX_BLOCK_SIZE)
         return state.DoS(100, false, REJECT_INVALID, "bad-txns-oversize");
 
     // Check for negative or overflow output values
@@ -900,11 +994,304 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+/**
+ * Sets the state for a transaction whose script check failed.
+ * A failure caused by a non-mandatory script verification check, such as non-standard
+ * DER encodings or non-null dummy arguments, doesn't trigger DoS protection to avoid
+ * splitting the network between upgraded and non-upgraded nodes.
+ * Failures of other flags indicate a transaction that is invalid in new blocks, e.g. a
+ * invalid P2SH. We DoS ban such nodes as they are not following the protocol. That said
+ * during an upgrade careful thought should be taken as to the correct behavior - we may
+ * want to continue peering with non-upgraded nodes even after a soft-fork super-majority
+ * vote has passed.
+ */
+static bool ScriptCheckFailed(const CScriptCheck &check, CValidationState &state)
+{
+    if (!check.FailsMandatoryFlags())
+        return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+    return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+}
+
+/** Only used with cs_main held, so ConnectBlock() finds it idle. */
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("bitcoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+/**
+ * PreverifyMempoolScripts() runs without cs_main, on its own queue so that
+ * ConnectBlock() never waits for a batch of mempool transactions.
+ */
+static CCheckQueue<CScriptCheck> mempoolscriptcheckqueue(128);
+
+void ThreadMempoolScriptCheck() {
+    RenameThread("bitcoin-mempoolch");
+    mempoolscriptcheckqueue.Thread();
+}
+
+namespace {
+/**
+ * CheckInputs() for the mempool. Transactions with many inputs have their scripts
+ * verified by the script check threads. Their queue is only used with cs_main held,
+ * which AcceptToMemoryPool() holds, so this never waits for another controller.
+ * Callers verifying scripts without cs_main use mempoolscriptcheckqueue instead.
+ */
+bool CheckMempoolInputs(const CTransaction &tx, CValidationState &state, const CCoinsViewCache &view, unsigned int flags,
+                        const PrecomputedTransactionData &txdata)
+{
+    if (nScriptCheckThreads && tx.vin.size() >= MEMPOOL_PARALLEL_SCRIPTCHECK_INPUTS) {
+        std::vector<CScriptCheck> vChecks;
+        if (!CheckInputs(tx, state, view, true, flags, true, &vChecks, &txdata))
+            return false;
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        if (control.Wait())
+            return true;
+        // Do it again to find the input that failed and set the state accordingly.
+        // Valid signatures have been cached by now, so this is cheap.
+    }
+    return CheckInputs(tx, state, view, true, flags, true, NULL, &txdata);
+}
+
+/**
+ * Creates the mempool entry of a transaction whose inputs are all in view.
+ */
+CTxMemPoolEntry MakeMempoolEntry(CTxMemPool &pool, const CTransactionRef &ptx, const CCoinsViewCache &view,
+                                 int64_t nAcceptTime, const LockPoints &lp)
+{
+    const CTransaction &tx = *ptx;
+    const CAmount nFees = view.GetValueIn(tx) - tx.GetValueOut();
+
+    CAmount inChainInputValue;
+    const double dPriority = view.GetPriority(tx, chainActive.Height(), inChainInputValue);
+
+    // Keep track of transactions that spend a coinbase, which we re-scan
+    // during reorgs to ensure COINBASE_MATURITY is still met.
+    bool fSpendsCoinbase = false;
+    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+        const CCoins *coins = view.AccessCoins(txin.prevout.hash);
+        if (coins->IsCoinBase()) {
+            fSpendsCoinbase = true;
+            break;
+        }
+    }
+
+    unsigned int nSigOps = GetLegacySigOpCount(tx);
+    nSigOps += GetP2SHSigOpCount(tx, view);
+
+    return CTxMemPoolEntry(ptx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx),
+                           inChainInputValue, fSpendsCoinbase, nSigOps, lp);
+}
+
+/**
+ * The mempool policy checks on the inputs, fees, sigops and ancestors of a
+ * transaction. AcceptToMemoryPool() runs them before verifying the scripts, the
+ * script preverification runs them to skip the transactions they reject.
+ * nModifiedFees is set to the fees including any PrioritiseTransaction() delta.
+ */
+bool CheckMempoolPolicy(CTxMemPool &pool, CValidationState &state, const CTxMemPoolEntry &entry, const CCoinsViewCache &view,
+                        CAmount &nModifiedFees, CTxMemPool::setEntries &setAncestors)
+{
+    const CTransaction &tx = entry.GetTx();
+
+    // Check for non-standard pay-to-script-hash in inputs
+    if (fRequireStandard && !AreInputsStandard(tx, view))
+        return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
+
+    // don't allow negative fees into the mempool.
+    const CAmount nFees = entry.GetFee();
+    if (nFees < 0)
+        return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-negative-fee");
+
+    // nModifiedFees includes any fee deltas from PrioritiseTransaction
+    nModifiedFees = nFees;
+    double nPriorityDummy = 0;
+    pool.ApplyDeltas(tx.GetHash(), nPriorityDummy, nModifiedFees);
+
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS_PER_MB; we still consider this an invalid rather
+    // than merely non-standard transaction.
+    const unsigned int nSigOps = entry.GetSigOpCount();
+    const unsigned int nSize = entry.GetTxSize();
+    if ((nSigOps > MAX_STANDARD_TX_SIGOPS) || (nBytesPerSigOp && nSigOps > nSize / nBytesPerSigOp))
+        return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
+            strprintf("%d", nSigOps));
+
+    CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+    if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
+    } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
+        // Require that free transactions have sufficient priority to be mined in the next block.
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
+    }
+
+    // Calculate in-mempool ancestors, up to a limit.
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
+    }
+    return true;
+}
+}
+
+void PreverifyMempoolScripts(CTxMemPool &pool, const std::vector<CTransactionRef> &txs)
+{
+    if (nScriptCheckThreads == 0 || txs.size() < 2)
+        return;
+
+    unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (Application::uahfChainState() >= Application::UAHFRulesActive)
+        flags |= SCRIPT_ENABLE_SIGHASH_FORKID;
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    std::vector<uint256> vHashTxnToUncache;
+    std::vector<CScriptCheck> vChecks;
+    std::vector<PrecomputedTransactionData> txdata(txs.size());
+    std::vector<bool> fVerify(txs.size(), false);
+    {
+        // the checks copy the spent outputs, only collecting them needs the locks.
+        LOCK2(cs_main, pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        for (size_t n = 0; n < txs.size(); ++n) {
+            const CTransaction &tx = *txs[n];
+            // only spend the effort on transactions that would not be rejected on the cheap checks
+            CValidationState state;
+            std::string reason;
+            if (!CheckTransaction(tx, state) || tx.IsCoinBase() || (fRequireStandard && !IsStandardTx(tx, reason)))
+                continue;
+            bool fHaveInputs = true;
+            for (const CTxIn &txin : tx.vin) {
+                if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                    vHashTxnToUncache.push_back(txin.prevout.hash);
+                if (!view.HaveCoins(txin.prevout.hash)) {
+                    fHaveInputs = false;
+                    break;
+                }
+            }
+            if (!fHaveInputs || !view.HaveInputs(tx))
+                continue;
+            // the checks point to txdata, which is filled in after the locks are released.
+            fVerify[n] = true;
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                vChecks.push_back(CScriptCheck(*view.AccessCoins(tx.vin[i].prevout.hash), tx, i, flags, true, &txdata[n]));
+            }
+        }
+        view.SetBackend(dummy);
+    }
+    if (vChecks.size() >= MEMPOOL_PARALLEL_SCRIPTCHECK_INPUTS) {
+        // The outcome is not interesting here, AcceptToMemoryPool() does the full
+        // checks and finds the signatures that have been verified in the cache.
+        const int64_t nStart = GetTimeMicros();
+        if (flags & SCRIPT_ENABLE_SIGHASH_FORKID) {
+            for (size_t n = 0; n < txs.size(); ++n) {
+                if (fVerify[n])
+                    txdata[n] = PrecomputedTransactionData(*txs[n]);
+            }
+        }
+        const size_t nChecks = vChecks.size();
+        CCheckQueueControl<CScriptCheck> control(&mempoolscriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+        LogPrint("bench", "    - Preverified %u inputs of %u transactions: %.2fms\n", nChecks, txs.size(),
+                 0.001 * (GetTimeMicros() - nStart));
+    }
+    LOCK(cs_main);
+    BOOST_FOREACH(const uint256& hashTx, vHashTxnToUncache)
+        pcoinsTip->Uncache(hashTx);
+}
+
+bool PreverifyMempoolTransaction(CTxMemPool &pool, const CTransactionRef &ptx, CValidationState &state)
+{
+    const CTransaction &tx = *ptx;
+    {
+        // only spend the effort on transactions that would not be rejected on the cheap checks
+        CValidationState dummy;
+        std::string reason;
+        if (!CheckTransaction(tx, dummy) || tx.IsCoinBase() || (fRequireStandard && !IsStandardTx(tx, reason)))
+            return true;
+    }
+
+    unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (Application::uahfChainState() >= Application::UAHFRulesActive)
+        flags |= SCRIPT_ENABLE_SIGHASH_FORKID;
+
+    // Copy the spent outputs, this is the only part that needs the locks.
+    std::vector<CTxOut> spent;
+    spent.reserve(tx.vin.size());
+    std::vector<uint256> vHashTxnToUncache;
+    {
+        LOCK2(cs_main, pool.cs);
+        if (pool.exists(tx.GetHash()) || (recentRejects && recentRejects->contains(tx.GetHash())))
+            return true;
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                vHashTxnToUncache.push_back(txin.prevout.hash);
+            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
+            if (!coins || !coins->IsAvailable(txin.prevout.n) || pool.mapNextTx.count(txin.prevout)) {
+                spent.clear();
+                break;
+            }
+            spent.push_back(coins->vout[txin.prevout.n]);
+        }
+
+        // Leave the transactions the policy checks of AcceptToMemoryPool() reject to it,
+        // verifying their scripts first would only waste time. Free transactions are
+        // rate limited there, those are verified when their turn comes.
+        bool fPolicy = !spent.empty();
+        if (fPolicy) {
+            const CTxMemPoolEntry entry(MakeMempoolEntry(pool, ptx, view, 0, LockPoints()));
+            CValidationState policyState;
+            CAmount nModifiedFees;
+            CTxMemPool::setEntries setAncestors;
+            fPolicy = CheckMempoolPolicy(pool, policyState, entry, view, nModifiedFees, setAncestors)
+                    && nModifiedFees >= ::minRelayTxFee.GetFee(entry.GetTxSize());
+        }
+        if (!fPolicy) {
+            // orphan, double spend or policy failure, AcceptToMemoryPool() takes it from here.
+            BOOST_FOREACH(const uint256& hashTx, vHashTxnToUncache)
+                pcoinsTip->Uncache(hashTx);
+            return true;
+        }
+    }
+
+    // The scripts are verified without holding any lock, the signatures end up in the cache.
+    PrecomputedTransactionData txdata;
+    if (flags & SCRIPT_ENABLE_SIGHASH_FORKID)
+        txdata = PrecomputedTransactionData(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        CScriptCheck check(spent[i], tx, i, flags, true, &txdata);
+        if (!check()) {
+            // Don't let invalid transactions fill the coins cache.
+            {
+                LOCK(cs_main);
+                BOOST_FOREACH(const uint256& hashTx, vHashTxnToUncache)
+                    pcoinsTip->Uncache(hashTx);
+            }
+            // Same verdict as CheckInputs(), AcceptToMemoryPool() does not need to verify it again.
+            return ScriptCheckFailed(check, state);
+        }
+    }
+    return true;
+}
+
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
                               bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              std::vector<uint256>& vHashTxnToUncache, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
+    const CTransaction &tx = *ptx;
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -956,7 +1343,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         CCoinsView dummy;
         CCoinsViewCache view(&dummy);
 
-        CAmount nValueIn = 0;
         LockPoints lp;
         {
         LOCK(pool.cs);
@@ -991,8 +1377,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         // Bring the best block into scope
         view.GetBestBlock();
 
-        nValueIn = view.GetValueIn(tx);
-
         // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
         view.SetBackend(dummy);
 
@@ -1005,58 +1389,13 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
             return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
         }
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (fRequireStandard && !AreInputsStandard(tx, view))
-            return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
-
-        unsigned int nSigOps = GetLegacySigOpCount(tx);
-        nSigOps += GetP2SHSigOpCount(tx, view);
-
-        CAmount nValueOut = tx.GetValueOut();
-        CAmount nFees = nValueIn-nValueOut;
-
-        // don't allow negative fees into the mempool.
-        if (nFees < 0)
-            return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-negative-fee");
-
-        // nModifiedFees includes any fee deltas from PrioritiseTransaction
-        CAmount nModifiedFees = nFees;
-        double nPriorityDummy = 0;
-        pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
-
-        CAmount inChainInputValue;
-        double dPriority = view.GetPriority(tx, chainActive.Height(), inChainInputValue);
-
-        // Keep track of transactions that spend a coinbase, which we re-scan
-        // during reorgs to ensure COINBASE_MATURITY is still met.
-        bool fSpendsCoinbase = false;
-        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
-                fSpendsCoinbase = true;
-                break;
-            }
-        }
-
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
+        CTxMemPoolEntry entry(MakeMempoolEntry(pool, ptx, view, nAcceptTime, lp));
         unsigned int nSize = entry.GetTxSize();
-
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS_PER_MB; we still consider this an invalid rather
-        // than merely non-standard transaction.
-        if ((nSigOps > MAX_STANDARD_TX_SIGOPS) || (nBytesPerSigOp && nSigOps > nSize / nBytesPerSigOp))
-            return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
-                strprintf("%d", nSigOps));
-
-        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
-        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
-        } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
-            // Require that free transactions have sufficient priority to be mined in the next block.
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
-        }
+        const CAmount nFees = entry.GetFee();
+        CAmount nModifiedFees;
+        CTxMemPool::setEntries setAncestors;
+        if (!CheckMempoolPolicy(pool, state, entry, view, nModifiedFees, setAncestors))
+            return false;
 
         // Continuously rate-limit free (really, very-low-fee) transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
@@ -1086,17 +1425,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                 REJECT_HIGHFEE, "absurdly-high-fee",
                 strprintf("%d > %d", nFees, ::minRelayTxFee.GetFee(nSize) * 10000));
 
-        // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
-        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
-        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
-        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
-        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
-        std::string errString;
-        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
-            return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
-        }
-
         uint32_t scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
         if (Application::uahfChainState() >= Application::UAHFRulesActive) {
             // reject in memory pool transactions that use the OP_RETURN anti-replay ID.
@@ -1113,7 +1441,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true))
+        PrecomputedTransactionData txdata;
+        if (scriptVerifyFlags & SCRIPT_ENABLE_SIGHASH_FORKID)
+            txdata = PrecomputedTransactionData(tx);
+        if (!CheckMempoolInputs(tx, state, view, scriptVerifyFlags, txdata))
             return false;
 
         // Check again against just the consensus-critical mandatory script
@@ -1129,7 +1460,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         if (Application::uahfChainState() >= Application::UAHFRulesActive)
             scriptVerifyFlags |= SCRIPT_ENABLE_SIGHASH_FORKID;
 
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true))
+        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, NULL, &txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
@@ -1150,11 +1481,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee)
 {
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache, GetTime());
     if (!res) {
         BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
@@ -1162,6 +1493,145 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee)
+{
+    return AcceptToMemoryPool(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee);
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool(CTxMemPool &pool)
+{
+    const int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE *filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    const int64_t nStart = GetTimeMicros();
+    std::vector<std::pair<CTransactionRef, int64_t> > txs;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unknown mempool file version %u. Continuing anyway.\n", version);
+            return false;
+        }
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransactionRef tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+            txs.push_back(std::make_pair(tx, nTime));
+        }
+        file >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    const int64_t nRead = GetTimeMicros();
+
+    // the deltas go first so the fees are right when the transactions are accepted.
+    for (auto it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+        pool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+    // The file has the parents before their children. Each batch has its scripts verified in
+    // parallel without holding cs_main and is then accepted in order, under a single cs_main lock.
+    static const size_t BATCH_SIZE = 1000;
+    const int64_t nNow = GetTime();
+    int count = 0, failed = 0, expired = 0;
+    for (size_t start = 0; start < txs.size(); start += BATCH_SIZE) {
+        if (ShutdownRequested())
+            return false;
+        const size_t end = std::min(txs.size(), start + BATCH_SIZE);
+        std::vector<CTransactionRef> batch;
+        batch.reserve(end - start);
+        for (size_t i = start; i < end; ++i) {
+            if (txs[i].second + nExpiryTimeout > nNow)
+                batch.push_back(txs[i].first);
+        }
+        expired += end - start - batch.size();
+
+        PreverifyMempoolScripts(pool, batch);
+        LOCK(cs_main);
+        for (size_t i = start; i < end; ++i) {
+            if (txs[i].second + nExpiryTimeout <= nNow)
+                continue;
+            CValidationState state;
+            std::vector<uint256> vHashTxToUncache;
+            if (AcceptToMemoryPoolWorker(pool, state, txs[i].first, false, NULL, true, false, vHashTxToUncache, txs[i].second)) {
+                ++count;
+            } else {
+                ++failed;
+                BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+                    pcoinsTip->Uncache(hashTx);
+            }
+        }
+    }
+    {
+        LOCK(cs_main);
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, nExpiryTimeout);
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired in %.2fms (%.2fms to read)\n",
+              count, failed, expired, 0.001 * (GetTimeMicros() - nStart), 0.001 * (nRead - nStart));
+    return true;
+}
+
+bool DumpMempool(CTxMemPool &pool)
+{
+    const int64_t nStart = GetTimeMicros();
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<CTxMemPool::txiter> entries;
+    std::vector<std::pair<CTransactionRef, int64_t> > txs;
+    {
+        LOCK(pool.cs);
+        mapDeltas = pool.mapDeltas;
+        entries.reserve(pool.mapTx.size());
+        for (CTxMemPool::txiter it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+            entries.push_back(it);
+        // parents before their children
+        std::sort(entries.begin(), entries.end(), [](CTxMemPool::txiter a, CTxMemPool::txiter b) {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        });
+        txs.reserve(entries.size());
+        BOOST_FOREACH(CTxMemPool::txiter it, entries)
+            txs.push_back(std::make_pair(it->GetSharedTx(), it->GetTime()));
+    }
+    const int64_t nCopied = GetTimeMicros();
+
+    try {
+        const boost::filesystem::path path = GetDataDir() / "mempool.dat";
+        FILE *filestr = fopen((path.string() + ".new").c_str(), "wb");
+        if (!filestr)
+            return false;
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << (uint64_t)txs.size();
+        for (size_t i = 0; i < txs.size(); ++i) {
+            file << txs[i].first;
+            file << txs[i].second;
+        }
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(path.string() + ".new", path);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    LogPrintf("Dumped mempool of %u transactions: %.2fms to copy, %.2fms to dump\n", txs.size(),
+              0.001 * (nCopied - nStart), 0.001 * (GetTimeMicros() - nCopied));
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1210,9 +1680,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-                if (tx.GetHash() == hash) {
-                    txOut = tx;
+            for (const auto &tx : block.vtx) {
+                if (tx->GetHash() == hash) {
+                    txOut = *tx;
                     hashBlock = pindexSlow->GetBlockHash();
                     return true;
                 }
@@ -1258,17 +1728,28 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(Blocks::openFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    Streaming::ConstBuffer data = Blocks::DB::instance()->loadBlock(pos);
+    if (data.isValid()) {
+        try {
+            CDataStream stream(data.begin(), data.end(), SER_DISK, CLIENT_VERSION);
+            stream >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(Blocks::openFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check the header
@@ -1519,12 +2000,21 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, txdata, blockValidation), &error)) {
         return false;
     }
     return true;
 }
 
+bool CScriptCheck::FailsMandatoryFlags() const
+{
+    if ((nFlags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) == 0)
+        return true;
+    CScriptCheck mandatory(*this);
+    mandatory.nFlags &= ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS;
+    return !mandatory();
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -1579,7 +2069,7 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks, const PrecomputedTransactionData *txdata)
 {
     if (!tx.IsCoinBase())
     {
@@ -1597,37 +2087,24 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // checks done inline can share data with each other, those for pvChecks need the callers'.
+            PrecomputedTransactionData localTxData;
+            if (!txdata && !pvChecks && tx.vin.size() > 1 && (flags & SCRIPT_ENABLE_SIGHASH_FORKID)) {
+                localTxData = PrecomputedTransactionData(tx);
+                txdata = &localTxData;
+            }
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
                 } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
-                        if (check2())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+                    return ScriptCheckFailed(check, state);
                 }
             }
         }
@@ -1754,19 +2231,23 @@ bool DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewC
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock(): no undo data available");
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock(): failure reading undo data");
+    std::shared_ptr<const CBlockUndo> cachedUndo = CBlockCache::instance()->undo(pindex->GetBlockHash());
+    CBlockUndo undoFromDisk;
+    if (!cachedUndo) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock(): no undo data available");
+        if (!UndoReadFromDisk(undoFromDisk, pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock(): failure reading undo data");
+    }
+    const CBlockUndo &blockUndo = cachedUndo ? *cachedUndo : undoFromDisk;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
@@ -1838,11 +2319,190 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+namespace {
+/// Height and coinbase-ness of an output spent by a block transaction, captured before it was spent.
+struct SpentOutputInfo {
+    SpentOutputInfo() : nHeight(0), fCoinBase(false) {}
+    int nHeight;
+    bool fCoinBase;
+};
 
-void ThreadScriptCheck() {
-    RenameThread("bitcoin-scriptch");
-    scriptcheckqueue.Thread();
+/// Outcome of a CTxInputsCheck, one per transaction in the block.
+struct TxInputsResult {
+    TxInputsResult() : fee(0), sigOps(0), failed(false) {}
+    CAmount fee;
+    unsigned int sigOps;
+    bool failed;
+    CValidationState state;
+    PrecomputedTransactionData txdata; // used by the script checks of this transaction
+};
+
+/**
+ * The context-dependent, but order-independent checks of a single transaction in a block.
+ *
+ * ConnectBlock does the ordered work (coin lookups and UpdateCoins) itself and hands
+ * each transaction to one of these, which then only reads the outputs saved in the undo
+ * data and the heights collected before they were spent. This allows the amount, maturity,
+ * sequence-lock and sigop checks to run on the txinputcheckqueue workers while the main
+ * thread continues with the next transaction.
+ * Script checks found here are handed to the script check queue, or run inline if there is none.
+ */
+class CTxInputsCheck
+{
+public:
+    CTxInputsCheck()
+        : ptx(0), pundo(0), pindex(0), nLockTimeFlags(0), nScriptFlags(0), fStrictPayToScriptHash(false),
+          fCheckInputs(false), fScriptChecks(false), fCacheResults(false), pscriptControl(0), presult(0) {}
+    CTxInputsCheck(const CTransaction &tx, const CTxUndo *undo, std::vector<SpentOutputInfo> &spent,
+                   const CBlockIndex *index, int lockTimeFlags, unsigned int scriptFlags, bool strictP2SH,
+                   bool checkInputs, bool scriptChecks, bool cacheResults,
+                   CCheckQueueControl<CScriptCheck> *scriptControl, TxInputsResult *result)
+        : ptx(&tx), pundo(undo), pindex(index), nLockTimeFlags(lockTimeFlags), nScriptFlags(scriptFlags),
+          fStrictPayToScriptHash(strictP2SH), fCheckInputs(checkInputs), fScriptChecks(scriptChecks),
+          fCacheResults(cacheResults), pscriptControl(scriptControl), presult(result)
+    {
+        vSpent.swap(spent);
+    }
+
+    bool operator()() {
+        assert(ptx);
+        assert(presult);
+        if (!check()) {
+            presult->failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    void swap(CTxInputsCheck &other) {
+        std::swap(ptx, other.ptx);
+        std::swap(pundo, other.pundo);
+        vSpent.swap(other.vSpent);
+        std::swap(pindex, other.pindex);
+        std::swap(nLockTimeFlags, other.nLockTimeFlags);
+        std::swap(nScriptFlags, other.nScriptFlags);
+        std::swap(fStrictPayToScriptHash, other.fStrictPayToScriptHash);
+        std::swap(fCheckInputs, other.fCheckInputs);
+        std::swap(fScriptChecks, other.fScriptChecks);
+        std::swap(fCacheResults, other.fCacheResults);
+        std::swap(pscriptControl, other.pscriptControl);
+        std::swap(presult, other.presult);
+    }
+
+private:
+    bool check() {
+        const CTransaction &tx = *ptx;
+        CValidationState &state = presult->state;
+
+        presult->sigOps = GetLegacySigOpCount(tx);
+        if (presult->sigOps > MAX_BLOCK_SIGOPS_PER_MB)
+            return state.DoS(100, error("ConnectBlock(): too many sigops in tx"),
+                             REJECT_INVALID, "bad-tx-sigops");
+        if (tx.IsCoinBase())
+            return true;
+
+        assert(pundo);
+        assert(pundo->vprevout.size() == tx.vin.size());
+        assert(vSpent.size() == tx.vin.size());
+
+        // Check that transaction is BIP68 final
+        // BIP68 lock checks (as opposed to nLockTime checks) must
+        // be in ConnectBlock because they require the UTXO set
+        std::vector<int> prevheights(tx.vin.size());
+        for (size_t i = 0; i < tx.vin.size(); ++i) {
+            prevheights[i] = vSpent[i].nHeight;
+        }
+        if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
+            return state.DoS(100, error("%s: contains a non-BIP68-final transaction", __func__),
+                             REJECT_INVALID, "bad-txns-nonfinal");
+        }
+
+        CAmount nValueIn = 0;
+        for (size_t i = 0; i < tx.vin.size(); ++i) {
+            const CTxOut &prevout = pundo->vprevout[i].txout;
+            if (fStrictPayToScriptHash && prevout.scriptPubKey.IsPayToScriptHash()) {
+                // Add in sigops done by pay-to-script-hash inputs;
+                // this is to prevent a "rogue miner" from creating
+                // an incredibly-expensive-to-validate block.
+                presult->sigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
+            }
+            if (fCheckInputs) {
+                // If prev is coinbase, check that it's matured
+                if (vSpent[i].fCoinBase && pindex->nHeight - vSpent[i].nHeight < COINBASE_MATURITY) {
+                    state.Invalid(false, REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
+                        strprintf("tried to spend coinbase at depth %d", pindex->nHeight - vSpent[i].nHeight));
+                    return error("ConnectBlock(): CheckInputs on %s failed with %s",
+                        tx.GetHash().ToString(), FormatStateMessage(state));
+                }
+                // Check for negative or overflow input values
+                if (!MoneyRange(prevout.nValue) || !MoneyRange(nValueIn + prevout.nValue)) {
+                    state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
+                    return error("ConnectBlock(): CheckInputs on %s failed with %s",
+                        tx.GetHash().ToString(), FormatStateMessage(state));
+                }
+            }
+            nValueIn += prevout.nValue;
+        }
+        const CAmount nValueOut = tx.GetValueOut();
+        presult->fee = nValueIn - nValueOut;
+        if (!fCheckInputs)
+            return true;
+
+        if (nValueIn < nValueOut) {
+            state.DoS(100, false, REJECT_INVALID, "bad-txns-in-belowout", false,
+                strprintf("value in (%s) < value out (%s)", FormatMoney(nValueIn), FormatMoney(nValueOut)));
+            return error("ConnectBlock(): CheckInputs on %s failed with %s",
+                tx.GetHash().ToString(), FormatStateMessage(state));
+        }
+        if (!MoneyRange(presult->fee)) {
+            state.DoS(100, false, REJECT_INVALID, "bad-txns-fee-outofrange");
+            return error("ConnectBlock(): CheckInputs on %s failed with %s",
+                tx.GetHash().ToString(), FormatStateMessage(state));
+        }
+
+        if (!fScriptChecks)
+            return true;
+        // the precomputed hashes are only used by SIGHASH_FORKID signatures
+        if (nScriptFlags & SCRIPT_ENABLE_SIGHASH_FORKID)
+            presult->txdata = PrecomputedTransactionData(tx);
+        std::vector<CScriptCheck> vChecks;
+        vChecks.reserve(tx.vin.size());
+        for (size_t i = 0; i < tx.vin.size(); ++i) {
+            CScriptCheck check(pundo->vprevout[i].txout, tx, i, nScriptFlags, fCacheResults, &presult->txdata, true);
+            if (pscriptControl) {
+                vChecks.push_back(CScriptCheck());
+                check.swap(vChecks.back());
+            } else if (!check()) {
+                ScriptCheckFailed(check, state);
+                return error("ConnectBlock(): CheckInputs on %s failed with %s",
+                    tx.GetHash().ToString(), FormatStateMessage(state));
+            }
+        }
+        if (pscriptControl)
+            pscriptControl->Add(vChecks);
+        return true;
+    }
+
+    const CTransaction *ptx;
+    const CTxUndo *pundo;
+    std::vector<SpentOutputInfo> vSpent;
+    const CBlockIndex *pindex;
+    int nLockTimeFlags;
+    unsigned int nScriptFlags;
+    bool fStrictPayToScriptHash;
+    bool fCheckInputs;
+    bool fScriptChecks;
+    bool fCacheResults;
+    CCheckQueueControl<CScriptCheck> *pscriptControl;
+    TxInputsResult *presult;
+};
+}
+
+static CCheckQueue<CTxInputsCheck> txinputcheckqueue(16);
+
+void ThreadTxInputsCheck() {
+    RenameThread("bitcoin-inputch");
+    txinputcheckqueue.Thread();
 }
 
 //
@@ -1957,6 +2617,9 @@ static int64_t nTimeCheck = 0;
 static int64_t nTimeForks = 0;
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
+static int64_t nTimePrefetch = 0;
+static int64_t nTimeInputChecks = 0;
+static int64_t nTimeScriptWait = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
@@ -2022,8 +2685,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     fEnforceBIP30 = fEnforceBIP30 && (!pindexBIP34height || !(pindexBIP34height->GetBlockHash() == chainparams.GetConsensus().BIP34Hash));
 
     if (fEnforceBIP30) {
-        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
+        for (const auto &tx : block.vtx) {
+            const CCoins* coins = view.AccessCoins(tx->GetHash());
             if (coins && !coins->IsPruned())
                 return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
                                  REJECT_INVALID, "bad-txns-BIP30");
@@ -2068,69 +2731,60 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
     CBlockUndo blockundo;
+    blockundo.vtxundo.reserve(block.vtx.size() - 1);
+    // one result per transaction, filled in by the CTxInputsCheck jobs.
+    std::vector<TxInputsResult> txResults(block.vtx.size());
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // The input checks need to finish before the script checks they add are waited on,
+    // so this control is declared second and thus destroyed first.
+    CCheckQueueControl<CTxInputsCheck> inputControl(nTxInputCheckThreads ? &txinputcheckqueue : NULL);
+
+    // Load all coins this block spends that are not in memory yet in one batch, the
+    // ordered pass below would otherwise do a database lookup per missing coin.
+    {
+        std::vector<uint256> prevouts;
+        for (const auto &tx : block.vtx) {
+            if (tx->IsCoinBase())
+                continue;
+            BOOST_FOREACH (const CTxIn &txin, tx->vin) {
+                prevouts.push_back(txin.prevout.hash);
+            }
+        }
+        view.PrefetchCoins(prevouts);
+    }
+    int64_t nTime2a = GetTimeMicros(); nTimePrefetch += nTime2a - nTime2;
+    LogPrint("bench", "      - Prefetch coins: %.2fms [%.2fs]\n", 0.001 * (nTime2a - nTime2), nTimePrefetch * 0.000001);
 
-    std::vector<int> prevheights;
-    CAmount nFees = 0;
     int nInputs = 0;
-    unsigned int nSigOps = 0;
-    const uint64_t maxSigOps = Policy::blockSigOpAcceptLimit(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
-    blockundo.vtxundo.reserve(block.vtx.size() - 1);
     int nChecked = 0;
     int nOrphansChecked = 0;
+    std::vector<CTxInputsCheck> vInputChecks(1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
 
         nInputs += tx.vin.size();
 
-        const uint32_t txSigOps = GetLegacySigOpCount(tx);
-        if (txSigOps > MAX_BLOCK_SIGOPS_PER_MB)
-            return state.DoS(100, error("ConnectBlock(): too many sigops in tx"),
-                             REJECT_INVALID, "bad-tx-sigops");
-        nSigOps += txSigOps;
-        if (nSigOps > maxSigOps)
-            return state.DoS(100, error("ConnectBlock(): too many sigops"),
-                             REJECT_INVALID, "bad-blk-sigops");
-
+        std::vector<SpentOutputInfo> spent;
+        bool fCheckInputs = false;
         if (!tx.IsCoinBase())
         {
             if (!view.HaveInputs(tx))
                 return state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
                                  REJECT_INVALID, "bad-txns-inputs-missingorspent");
 
-            // Check that transaction is BIP68 final
-            // BIP68 lock checks (as opposed to nLockTime checks) must
-            // be in ConnectBlock because they require the UTXO set
-            prevheights.resize(tx.vin.size());
+            // remember what we need from the coins before UpdateCoins spends them.
+            spent.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
-            }
-
-            if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
-                return state.DoS(100, error("%s: contains a non-BIP68-final transaction", __func__),
-                                 REJECT_INVALID, "bad-txns-nonfinal");
-            }
-
-            if (fStrictPayToScriptHash)
-            {
-                // Add in sigops done by pay-to-script-hash inputs;
-                // this is to prevent a "rogue miner" from creating
-                // an incredibly-expensive-to-validate block.
-                nSigOps += GetP2SHSigOpCount(tx, view);
-                if (nSigOps > maxSigOps)
-                    return state.DoS(100, error("ConnectBlock(): too many sigops"),
-                                     REJECT_INVALID, "bad-blk-sigops");
+                const CCoins *coins = view.AccessCoins(tx.vin[j].prevout.hash);
+                spent[j].nHeight = coins->nHeight;
+                spent[j].fCoinBase = coins->IsCoinBase();
             }
 
-            nFees += view.GetValueIn(tx)-tx.GetValueOut();
-
-            std::vector<CScriptCheck> vChecks;
-            bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
             // Only check inputs when the tx hash is not in the setPreVerifiedTxHash as would only
             // happen if this were a regular block or when a tx is found within the returning XThinblock.
             uint256 hash = tx.GetHash();
@@ -2139,16 +2793,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 nChecked++;
                 if (inOrphanCache)
                     nOrphansChecked++;
-                if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults,
-                            nScriptCheckThreads ? &vChecks : NULL))
-                    return error("ConnectBlock(): CheckInputs on %s failed with %s",
-                        tx.GetHash().ToString(), FormatStateMessage(state));
+                fCheckInputs = true;
             }
             else {
                 setPreVerifiedTxHash.erase(hash);
                 setUnVerifiedOrphanTxHash.erase(hash);
             }
-            control.Add(vChecks);
         }
 
         CTxUndo undoDummy;
@@ -2157,24 +2807,63 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
+        // The rest of the checks don't depend on the order of transactions, hand them to the workers.
+        bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
+        CTxInputsCheck check(tx, i == 0 ? NULL : &blockundo.vtxundo.back(), spent, pindex, nLockTimeFlags, flags,
+                             fStrictPayToScriptHash, fCheckInputs, fScriptChecks, fCacheResults,
+                             nScriptCheckThreads ? &control : NULL, &txResults[i]);
+        if (nTxInputCheckThreads) {
+            check.swap(vInputChecks[0]);
+            inputControl.Add(vInputChecks);
+        } else if (!check()) {
+            state = txResults[i].state;
+            return false;
+        }
+
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        pos.nTxOffset += tx.GetTxSize();
     }
     LogPrint("thin", "Number of CheckInputs() performed: %d  Orphan count: %d\n", nChecked, nOrphansChecked);
 
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
 
+    const bool inputsOk = inputControl.Wait();
+    int64_t nTime3a = GetTimeMicros(); nTimeInputChecks += nTime3a - nTime3;
+    LogPrint("bench", "      - Wait for input checks: %.2fms [%.2fs]\n", 0.001 * (nTime3a - nTime3), nTimeInputChecks * 0.000001);
+
+    if (!inputsOk) {
+        BOOST_FOREACH (const TxInputsResult &result, txResults) {
+            if (result.failed) {
+                state = result.state;
+                return false;
+            }
+        }
+        assert(false);
+    }
+
+    CAmount nFees = 0;
+    unsigned int nSigOps = 0;
+    const uint64_t maxSigOps = Policy::blockSigOpAcceptLimit(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_FOREACH (const TxInputsResult &result, txResults) {
+        nSigOps += result.sigOps;
+        if (nSigOps > maxSigOps)
+            return state.DoS(100, error("ConnectBlock(): too many sigops"),
+                             REJECT_INVALID, "bad-blk-sigops");
+        nFees += result.fee;
+    }
+
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
     if (!control.Wait())
         return state.DoS(100, false);
-    int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
+    int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2; nTimeScriptWait += nTime4 - nTime3a;
+    LogPrint("bench", "      - Wait for script checks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3a), nTimeScriptWait * 0.000001);
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
 
     if (fJustCheck)
@@ -2203,6 +2892,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!Blocks::DB::instance()->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
+    // A reorg or peers asking for this block will likely need it again soon.
+    // While catching up nobody will, and copying every block would only slow
+    // down the sync.
+    if (!fImporting && !IsInitialBlockDownload())
+        CBlockCache::instance()->add(block, blockundo);
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2212,7 +2907,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime6 = GetTimeMicros(); nTimeCallbacks += nTime6 - nTime5;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), nTimeCallbacks * 0.000001);
@@ -2312,9 +3007,6 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
@@ -2329,6 +3021,14 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // The coins may still be on their way to disk, validation can continue
+        // meanwhile. Only an explicit flush waits for them, and so does pruning:
+        // until the coins are on disk a restart may need the blocks we delete.
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinsdbview && !pcoinsdbview->WaitForFlush())
+            return AbortNode(state, "Failed to write to coin database");
+        // Finally remove any pruned files
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -2416,10 +3116,12 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete, consensusParams))
+    // Read block from disk, unless it was connected recently.
+    std::shared_ptr<const CBlock> cachedBlock = CBlockCache::instance()->block(pindexDelete->GetBlockHash());
+    CBlock blockFromDisk;
+    if (!cachedBlock && !ReadBlockFromDisk(blockFromDisk, pindexDelete, consensusParams))
         return AbortNode(state, "Failed to read block");
+    const CBlock &block = cachedBlock ? *cachedBlock : blockFromDisk;
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
     {
@@ -2435,14 +3137,14 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
         return false;
     // Resurrect mempool transactions from the disconnected block.
     std::vector<uint256> vHashUpdate;
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+    for (const auto &tx : block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
-            mempool.remove(tx, removed, true);
-        } else if (mempool.exists(tx.GetHash())) {
-            vHashUpdate.push_back(tx.GetHash());
+        if (tx->IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
+            mempool.remove(*tx, removed, true);
+        } else if (mempool.exists(tx->GetHash())) {
+            vHashUpdate.push_back(tx->GetHash());
         }
     }
     // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
@@ -2454,10 +3156,12 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
 
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    // getheaders fills it again when there is no new tip to announce
+    s_recentHeaders.clear();
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
+    for (const auto &tx : block.vtx) {
+        SyncWithWallets(*tx, NULL);
     }
     return true;
 }
@@ -2478,10 +3182,16 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    std::shared_ptr<const CBlock> cachedBlock;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
-            return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        cachedBlock = CBlockCache::instance()->block(pindexNew->GetBlockHash());
+        if (cachedBlock) {
+            pblock = cachedBlock.get();
+        } else {
+            if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
+                return AbortNode(state, "Failed to read block");
+            pblock = &block;
+        }
     }
 
     CBlockIndex *uahfForkBlock = Blocks::DB::instance()->uahfForkBlock();
@@ -2489,7 +3199,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         // The uahf fork-block has to be larger than 1MB.
         const uint32_t minBlockSize = Params().GenesisBlock().nTime == Application::uahfStartTime() // no bigger block in default regtest setup.
                 && Params().NetworkIDString() == CBaseChainParams::REGTEST ? 0 : MAX_BLOCK_SIZE + 1;
-        const std::uint32_t blockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        const std::uint32_t blockSize = ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
         if (blockSize < minBlockSize)
              return false;
     }
@@ -2531,8 +3241,8 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
+    for (const auto &tx : pblock->vtx) {
+        SyncWithWallets(*tx, pblock);
     }
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
@@ -3025,7 +3735,7 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, const std::vector<bool> *pTxChecked)
 {
     // These are checks that are independent of context.
 
@@ -3062,25 +3772,30 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // because we receive the wrong transactions for it.
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock(): first tx is not coinbase"),
                          REJECT_INVALID, "bad-cb-missing");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, error("CheckBlock(): more than one coinbase"),
                              REJECT_INVALID, "bad-cb-multiple");
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    assert(pTxChecked == NULL || pTxChecked->size() == block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); ++i) {
+        const CTransaction &tx = *block.vtx[i];
+        if (pTxChecked && pTxChecked->at(i))
+            continue;
         if (!CheckTransaction(tx, state))
             return error("CheckBlock(): CheckTransaction of %s failed with %s",
                 tx.GetHash().ToString(),
                 FormatStateMessage(state));
+    }
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    for (const auto &tx : block.vtx)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += GetLegacySigOpCount(*tx);
     }
     const std::uint32_t blockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
     if (nSigOps > Policy::blockSigOpAcceptLimit(blockSize))
@@ -3154,8 +3869,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
                               : block.GetBlockTime();
 
     // Check that all transactions are finalized
-    for (const CTransaction& tx : block.vtx) {
-        if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+    for (const auto &tx : block.vtx) {
+        if (!IsFinalTx(*tx, nHeight, nLockTimeCutoff)) {
             return state.DoS(10, error("%s: contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
         }
     }
@@ -3164,8 +3879,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     // if 750 of the last 1,000 blocks are version 2 or greater (51/100 if testnet):
     if (block.nVersion >= 2 && IsSuperMajority(2, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams)) {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s: block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }
@@ -3188,8 +3903,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
             }
 
             if (nHeight <= consensusParams.antiReplayOpReturnSunsetHeight) {
-                for (const CTransaction &tx : block.vtx) {
-                    for (const CTxOut &o : tx.vout) {
+                for (const auto &tx : block.vtx) {
+                    for (const CTxOut &o : tx->vout) {
                         if (o.scriptPubKey.isCommitment(consensusParams.antiReplayOpReturnCommitment)) {
                             logInfo(8002) << " + mined block includes the OP_RETURN forbidden string, rejecting";
                             return state.DoS(10, false, REJECT_INVALID, "bad-txn-replay",
@@ -3209,7 +3924,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3436,10 +4151,56 @@ void PruneOneBlockFile(const int fileNumber)
 }
 
 
+namespace {
+struct RawBlock {
+    uint256 hash;
+    int nFile;
+    Streaming::ConstBuffer data;
+    unsigned int nChecksum;
+};
+/** Blocks we served recently, most recent first. (protected by cs_main) */
+std::list<RawBlock> recentRawBlocks;
+
+/**
+ * Finds the serialized block and its message checksum, from the recently
+ * served blocks or from disk. A block that is requested by many peers
+ * right after it arrived is read and hashed only once.
+ */
+const RawBlock *FindRawBlock(const CBlockIndex *pindex)
+{
+    AssertLockHeld(cs_main);
+    for (std::list<RawBlock>::iterator it = recentRawBlocks.begin(); it != recentRawBlocks.end(); ++it) {
+        if (it->hash == pindex->GetBlockHash()) {
+            recentRawBlocks.splice(recentRawBlocks.begin(), recentRawBlocks, it);
+            return &recentRawBlocks.front();
+        }
+    }
+    RawBlock block;
+    block.hash = pindex->GetBlockHash();
+    block.nFile = pindex->nFile;
+    block.data = Blocks::DB::instance()->loadBlock(pindex->GetBlockPos());
+    if (!block.data.isValid() || Hash(block.data.begin(), block.data.begin() + 80) != block.hash)
+        return nullptr;
+    const uint256 hash = Hash(block.data.begin(), block.data.end());
+    memcpy(&block.nChecksum, &hash, sizeof(block.nChecksum));
+    recentRawBlocks.push_front(block);
+    if (recentRawBlocks.size() > MAX_RAW_BLOCKS_CACHED)
+        recentRawBlocks.pop_back();
+    return &recentRawBlocks.front();
+}
+}
+
 void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         boost::system::error_code ec;
+        for (std::list<RawBlock>::iterator iter = recentRawBlocks.begin(); iter != recentRawBlocks.end();) {
+            if (iter->nFile == *it)
+                iter = recentRawBlocks.erase(iter);
+            else
+                ++iter;
+        }
+        Blocks::DB::instance()->unmapFile(*it);
         boost::filesystem::remove(Blocks::getFilepathForIndex(*it, "blk"), ec);
         boost::filesystem::remove(Blocks::getFilepathForIndex(*it, "rev"), ec);
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4172,9 +4933,15 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    // A full block can be sent as stored, without parsing it first.
+                    const RawBlock *rawBlock = inv.type == MSG_BLOCK ? FindRawBlock(mi->second) : nullptr;
+                    std::shared_ptr<const CBlock> cachedBlock;
+                    if (!rawBlock)
+                        cachedBlock = CBlockCache::instance()->block(inv.hash);
+                    CBlock blockFromDisk;
+                    if (!rawBlock && !cachedBlock && !ReadBlockFromDisk(blockFromDisk, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
+                    const CBlock &block = cachedBlock ? *cachedBlock : blockFromDisk;
 
                     bool sendFullBlock = true;
 
@@ -4211,7 +4978,9 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             sendFullBlock = false;
                         }
                     }
-                    if (sendFullBlock) // if none of the other methods were actually executed;
+                    if (sendFullBlock && rawBlock)
+                        pfrom->PushRawMessage(NetMsgType::BLOCK, rawBlock->data, rawBlock->nChecksum);
+                    else if (sendFullBlock) // if none of the other methods were actually executed;
                          pfrom->PushMessage(NetMsgType::BLOCK, block);
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -4239,8 +5008,8 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
+                    CTransactionRef tx = mempool.get(inv.hash);
+                    if (tx) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
                         ss << tx;
@@ -4296,6 +5065,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->nVersion != 0)
         {
             pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 1);
             return false;
         }
@@ -4304,19 +5074,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CAddress addrMe;
         CAddress addrFrom;
         uint64_t nNonce = 1;
-        vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
+        int nVersion;
+        vRecv >> nVersion >> pfrom->nServices >> nTime >> addrMe;
+        pfrom->nVersion = nVersion;
 
-        if (pfrom->nVersion < MIN_PEER_PROTO_VERSION)
+        if (nVersion < MIN_PEER_PROTO_VERSION)
         {
             // disconnect from peers older than this proto version
-            LogPrintf("peer=%d using obsolete version %i; disconnecting\n", pfrom->id, pfrom->nVersion);
+            LogPrintf("peer=%d using obsolete version %i; disconnecting\n", pfrom->id, nVersion);
             pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE,
                                strprintf("Version must be %d or greater", MIN_PEER_PROTO_VERSION));
             pfrom->fDisconnect = true;
             return false;
         }
 
-        if (pfrom->nVersion == 10300)
+        if (nVersion == 10300)
             pfrom->nVersion = 300;
         if (!vRecv.empty())
             vRecv >> addrFrom >> nNonce;
@@ -4326,10 +5098,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         if (!vRecv.empty())
             vRecv >> pfrom->nStartingHeight;
+        bool fRelayTxes = true;
         if (!vRecv.empty())
-            vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
-        else
-            pfrom->fRelayTxes = true;
+            vRecv >> fRelayTxes; // set to true after we get the first filter* message
+        {
+            // RelayTransaction() reads it from other message handler threads
+            LOCK(pfrom->cs_filter);
+            pfrom->fRelayTxes = fRelayTxes;
+        }
 
         // Disconnect if we connected to ourself
         if (nNonce == nLocalHostNonce && nNonce > 1)
@@ -4352,11 +5128,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage(NetMsgType::VERACK);
-        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->ssSend.SetVersion(min(pfrom->nVersion.load(), PROTOCOL_VERSION));
 
         if (!pfrom->fInbound)
         {
@@ -4411,6 +5190,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (pfrom->nVersion == 0)
     {
         // Must have a version message before anything else
+        LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 1);
         return false;
     }
@@ -4418,7 +5198,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == NetMsgType::VERACK)
     {
-        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion.load(), PROTOCOL_VERSION));
 
         // Mark this node as currently connected, so we update its timestamp later.
         if (pfrom->fNetworkNode) {
@@ -4453,6 +5233,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         if (vAddr.size() > 1000)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message addr size() = %u", vAddr.size());
         }
@@ -4526,6 +5307,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message inv size() = %u", vInv.size());
         }
@@ -4536,16 +5318,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->fWhitelisted && GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))
             fBlocksOnly = false;
 
+        // Most transactions are announced by many peers and are in our mempool by the time
+        // the later announcements arrive, those don't need cs_main.
+        std::vector<CInv> vNewInv;
+        vNewInv.reserve(vInv.size());
+        BOOST_FOREACH (const CInv &inv, vInv) {
+            boost::this_thread::interruption_point();
+            pfrom->AddInventoryKnown(inv);
+            if (inv.type == MSG_TX && !fBlocksOnly
+                    && (mempool.exists(inv.hash) || CTxOrphanCache::contains(inv.hash))) {
+                logDebug(Log::Net) << "got inv:" << inv << "have" << "peer:" << pfrom->id;
+                // Track requests for our stuff
+                GetMainSignals().Inventory(inv.hash);
+                continue;
+            }
+            vNewInv.push_back(inv);
+        }
+        if (vNewInv.empty())
+            return true;
+
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
 
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
+        for (unsigned int nInv = 0; nInv < vNewInv.size(); nInv++)
         {
-            const CInv &inv = vInv[nInv];
+            const CInv &inv = vNewInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             logDebug(Log::Net) << "got inv:" << inv << (fAlreadyHave ? "have" : "new") << "peer:" << pfrom->id;
@@ -4574,9 +5374,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                                 if (pfrom->mapThinBlocksInFlight.size() < 1 && pfrom->ThinBlockCapable()) { // We can only send one thinblock per peer at a time
                                     pfrom->mapThinBlocksInFlight[inv2.hash] = GetTime();
                                     inv2.type = MSG_XTHINBLOCK;
-                                    CBloomFilter filterMemPool = createSeededBloomFilter(CTxOrphanCache::instance()->fetchTransactionIds());
                                     ss << inv2;
-                                    ss << filterMemPool;
+                                    CThinBlockFilter::instance()->serialize(ss);
                                     pfrom->PushMessage(NetMsgType::GET_XTHIN, ss);
                                     MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
                                     LogPrint("thin", "Requesting Thinblock %s from peer %s (%d)\n", inv2.hash.ToString(), pfrom->addrName.c_str(),pfrom->id);
@@ -4587,9 +5386,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                                 if (pfrom->mapThinBlocksInFlight.size() < 1 && pfrom->ThinBlockCapable()) { // We can only send one thinblock per peer at a time
                                     pfrom->mapThinBlocksInFlight[inv2.hash] = GetTime();
                                     inv2.type = MSG_XTHINBLOCK;
-                                    CBloomFilter filterMemPool = createSeededBloomFilter(CTxOrphanCache::instance()->fetchTransactionIds());
                                     ss << inv2;
-                                    ss << filterMemPool;
+                                    CThinBlockFilter::instance()->serialize(ss);
                                     pfrom->PushMessage(NetMsgType::GET_XTHIN, ss);
                                     LogPrint("thin", "Requesting Thinblock %s from peer %s (%d)\n", inv2.hash.ToString(), pfrom->addrName.c_str(),pfrom->id);
                                 }
@@ -4638,6 +5436,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message getdata size() = %u", vInv.size());
         }
@@ -4703,11 +5502,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
+        // Peers that are in sync with us ask for the last few blocks, which we have without cs_main.
+        vector<CBlock> vHeaders;
+        CBlockIndex *pindexLast = NULL;
+        if (!locator.IsNull() && s_recentHeaders.find(locator, hashStop, vHeaders, pindexLast)) {
+            LogPrint("net", "getheaders %u recent headers to %s from peer=%d\n", vHeaders.size(), hashStop.ToString(), pfrom->id);
+            pfrom->pindexHeaderSentUnlocked = pindexLast;
+            pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
+            return true;
+        }
+
         LOCK(cs_main);
-        if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
+        const bool fInitialDownload = IsInitialBlockDownload();
+        if (fInitialDownload && !pfrom->fWhitelisted) {
             logDebug(Log::Net) << "Ignoring getheaders from peer=" <<pfrom->id << "because node is in initial block download";
             return true;
         }
+        if (!fInitialDownload && s_recentHeaders.empty()) // no new tip since we started
+            s_recentHeaders.setTip(chainActive.Tip());
 
         CNodeState *nodestate = State(pfrom->GetId());
         CBlockIndex* pindex = NULL;
@@ -4728,7 +5540,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
         for (; pindex; pindex = chainActive.Next(pindex))
@@ -4742,6 +5553,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // headers message). In both cases it's safe to update
         // pindexBestHeaderSent to be our tip.
         nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+        pfrom->pindexHeaderSentUnlocked = NULL;
         pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
     }
 
@@ -4758,21 +5570,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        CTransactionRef ptx;
+        vRecv >> ptx;
+        const CTransaction &tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // The expensive script checks are done before we take cs_main, so that
+        // transactions from different peers can be verified at the same time.
+        CValidationState state;
+        const bool fScriptsValid = PreverifyMempoolTransaction(mempool, ptx, state);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
-        CValidationState state;
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (fScriptsValid && !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
@@ -4788,8 +5605,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             for (unsigned int i = 0; i < vWorkQueue.size(); i++)
             {
                 auto orphans = CTxOrphanCache::instance()->fetchTransactionsByPrev(vWorkQueue[i]);
+                if (orphans.size() > 1) {
+                    // the orphans likely came from different peers and don't depend on each other,
+                    // verify their scripts in parallel before accepting them one by one.
+                    std::vector<CTransactionRef> txs;
+                    txs.reserve(orphans.size());
+                    for (auto mi = orphans.begin(); mi != orphans.end(); ++mi) {
+                        if (!setMisbehaving.count(mi->fromPeer))
+                            txs.push_back(mi->tx);
+                    }
+                    PreverifyMempoolScripts(mempool, txs);
+                }
                 for (auto mi = orphans.begin(); mi != orphans.end(); ++mi) {
-                    const CTransaction& orphanTx = mi->tx;
+                    const CTransaction& orphanTx = *mi->tx;
                     const uint256 orphanHash = orphanTx.GetHash();
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
@@ -4799,7 +5627,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
                     if (setMisbehaving.count(mi->fromPeer))
                         continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                    if (AcceptToMemoryPool(mempool, stateDummy, mi->tx, true, &fMissingInputs2))
                     {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
                         RelayTransaction(orphanTx);
@@ -4834,7 +5662,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         {
             CTxOrphanCache *cache = CTxOrphanCache::instance();
             // DoS prevention: do not allow CTxOrphanCache to grow unbounded
-            cache->AddOrphanTx(tx, pfrom->GetId());
+            if (cache->AddOrphanTx(ptx, pfrom->GetId()) && IsThinBlocksEnabled())
+                CThinBlockFilter::instance()->addOrphan(ptx->GetHash());
             std::uint32_t nEvicted = cache->LimitOrphanTxSize();
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
@@ -4883,6 +5712,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
         unsigned int nCount = ReadCompactSize(vRecv);
         if (nCount > MAX_HEADERS_RESULTS) {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("headers message size = %u", nCount);
         }
@@ -5013,6 +5843,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CValidationState state;
         if (!CheckBlockHeader(thinBlock.header, state, true)) { // block header is bad
             LogPrint("thin", "Thinblock %s received with bad header from peer %s (%d)\n", thinBlock.header.GetHash().ToString(), pfrom->addrName.c_str(), pfrom->id);
+            LOCK(cs_main);
             Misbehaving(pfrom->id, 20);
             return false;
         }
@@ -5026,16 +5857,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 #endif
 
         bool fAlreadyHave = false;
-        // An expedited block or re-requested xthin can arrive and beat the original thin block request/response
-        if (!pfrom->mapThinBlocksInFlight.count(inv.hash)) {
-            LogPrint("thin", "Thinblock %s from peer %s (%d) received but we already have it\n", inv.hash.ToString(), pfrom->addrName.c_str(), pfrom->id);
+        {
             LOCK(cs_main);
-            fAlreadyHave = AlreadyHave(inv); // I'll still continue processing if we don't have an accepted block yet
+            // An expedited block or re-requested xthin can arrive and beat the original thin block request/response
+            if (!pfrom->mapThinBlocksInFlight.count(inv.hash)) {
+                LogPrint("thin", "Thinblock %s from peer %s (%d) received but we already have it\n", inv.hash.ToString(), pfrom->addrName.c_str(), pfrom->id);
+                fAlreadyHave = AlreadyHave(inv); // I'll still continue processing if we don't have an accepted block yet
+            }
         }
 
         if (!fAlreadyHave) {
            if (thinBlock.process(pfrom))
-                HandleBlockMessage(pfrom, strCommand, pfrom->thinBlock,  thinBlock.GetInv());  // clears the thin block
+                HandleCompletedThinBlock(pfrom, strCommand, thinBlock.GetInv());  // clears the thin block
         }
     }
 
@@ -5046,44 +5879,55 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             Misbehaving(pfrom->GetId(), 100);
             return false;
         }
-        if (pfrom->xThinBlockHashes.size() != pfrom->thinBlock.vtx.size()) { // crappy, but fast solution.
-            LogPrint("thin", "Inconsistent thin block data while processing xblock-tx\n");
-            return true;
-        }
-
         CXThinBlockTx thinBlockTx;
         vRecv >> thinBlockTx;
 
         CInv inv(MSG_XTHINBLOCK, thinBlockTx.blockhash);
         logDebug(Log::Net) << "received blocktxs for" << inv.hash << "peer" << pfrom->id;
-        if (!pfrom->mapThinBlocksInFlight.count(inv.hash)) {
-            LogPrint("thin", "ThinblockTx received but it was either not requested or it was beaten by another block %s  peer=%d\n", inv.hash.ToString(), pfrom->id);
-            return true;
-        }
 
-        // Create the mapMissingTx from all the supplied tx's in the xthinblock
-        std::map<uint64_t, CTransaction> mapMissingTx;
-        BOOST_FOREACH(CTransaction tx, thinBlockTx.vMissingTx) {
-            mapMissingTx[tx.GetHash().GetCheapHash()] = tx;
-        }
+        std::vector<uint256> orphans;
+        {
+            // The thin block state of a peer is cleared by whichever peer delivers the block first.
+            LOCK(cs_main);
+            if (pfrom->xThinBlockHashes.size() != pfrom->thinBlock.vtx.size()) { // crappy, but fast solution.
+                LogPrint("thin", "Inconsistent thin block data while processing xblock-tx\n");
+                return true;
+            }
+            if (!pfrom->mapThinBlocksInFlight.count(inv.hash)) {
+                LogPrint("thin", "ThinblockTx received but it was either not requested or it was beaten by another block %s  peer=%d\n", inv.hash.ToString(), pfrom->id);
+                return true;
+            }
+
+            // Create the mapMissingTx from all the supplied tx's in the xthinblock
+            std::map<uint64_t, CTransactionRef> mapMissingTx;
+            BOOST_FOREACH(const CTransactionRef &tx, thinBlockTx.vMissingTx) {
+                mapMissingTx[tx->GetHash().GetCheapHash()] = tx;
+            }
 
-        int count=0;
-        for (size_t i = 0; i < pfrom->thinBlock.vtx.size(); ++i) {
-            if (pfrom->thinBlock.vtx[i].IsNull()) {
-                auto val = mapMissingTx.find(pfrom->xThinBlockHashes[i]);
-                if (val != mapMissingTx.end()) {
-                    pfrom->thinBlock.vtx[i] = val->second;
-                    --pfrom->thinBlockWaitingForTxns;
+            int count=0;
+            std::vector<uint32_t> vReceivedPos;
+            for (size_t i = 0; i < pfrom->thinBlock.vtx.size(); ++i) {
+                if (!pfrom->thinBlock.vtx[i]) {
+                    auto val = mapMissingTx.find(pfrom->xThinBlockHashes[i]);
+                    if (val != mapMissingTx.end()) {
+                        pfrom->thinBlock.vtx[i] = val->second;
+                        vReceivedPos.push_back(i);
+                        --pfrom->thinBlockWaitingForTxns;
+                    }
+                    count++;
                 }
-                count++;
             }
-        }
-        LogPrint("thin", "Got %d Re-requested txs, needed %d of them\n", thinBlockTx.vMissingTx.size(), count);
+            LogPrint("thin", "Got %d Re-requested txs, needed %d of them\n", thinBlockTx.vMissingTx.size(), count);
 
-        if (pfrom->thinBlockWaitingForTxns == 0) {
+            if (pfrom->thinBlockWaitingForTxns != 0) {
+                LogPrint("thin", "Failed to retrieve all transactions for block\n");
+                return true;
+            }
             // We have all the transactions now that are in this block: try to reassemble and process.
             pfrom->thinBlockWaitingForTxns = -1;
             pfrom->AddInventoryKnown(inv);
+            // The rest of the block was validated while we waited for these.
+            FinishThinBlockValidation(pfrom, vReceivedPos);
 
 #ifdef LOG_XTHINBLOCKS
             // for compression statistics, we have to add up the size of xthinblock and the re-requested thinBlockTx.
@@ -5099,17 +5943,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 #endif
 
             // For correctness sake, assume all came from the orphans cache
-            std::vector<uint256> orphans;
             orphans.reserve(pfrom->thinBlock.vtx.size());
             for (unsigned int i = 0; i < pfrom->thinBlock.vtx.size(); i++) {
-                orphans.push_back(pfrom->thinBlock.vtx[i].GetHash());
+                orphans.push_back(pfrom->thinBlock.vtx[i]->GetHash());
             }
-            HandleBlockMessage(pfrom, strCommand, pfrom->thinBlock, inv);
-            CTxOrphanCache::instance()->EraseOrphans(orphans);
-        }
-        else {
-            LogPrint("thin", "Failed to retrieve all transactions for block\n");
         }
+        HandleCompletedThinBlock(pfrom, strCommand, inv);
+        CTxOrphanCache::instance()->EraseOrphans(orphans);
     }
 
     else if (strCommand == NetMsgType::GET_XBLOCKTX && !fImporting && !fReindex) // return Re-requested xthinblock transactions
@@ -5173,10 +6013,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return false;
         }
 
-        std::vector<CTransaction> vTx;
+        std::vector<CTransactionRef> vTx;
         int todo = thinRequestBlockTx.setCheapHashesToRequest.size();
         for (size_t i = 1; i < block.vtx.size(); i++) {
-            uint64_t cheapHash = block.vtx[i].GetHash().GetCheapHash();
+            uint64_t cheapHash = block.vtx[i]->GetHash().GetCheapHash();
             if (thinRequestBlockTx.setCheapHashesToRequest.count(cheapHash)) {
                 vTx.push_back(block.vtx[i]);
                 if (--todo == 0)
@@ -5216,7 +6056,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         std::vector<uint256> orphans;
         orphans.reserve(block.vtx.size());
         for (unsigned int i = 0; i < block.vtx.size(); i++) {
-            orphans.push_back(block.vtx[i].GetHash());
+            orphans.push_back(block.vtx[i]->GetHash());
         }
         CTxOrphanCache::instance()->EraseOrphans(orphans);
     }
@@ -5242,7 +6082,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5265,10 +6108,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         BOOST_FOREACH(uint256& hash, vtxid) {
             CInv inv(MSG_TX, hash);
             if (pfrom->pfilter) {
-                CTransaction tx;
-                bool fInMemPool = mempool.lookup(hash, tx);
-                if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-                if (!pfrom->pfilter->IsRelevantAndUpdate(tx)) continue;
+                CTransactionRef tx = mempool.get(hash);
+                if (!tx) continue; // another thread removed since queryHashes, maybe...
+                if (!pfrom->pfilter->IsRelevantAndUpdate(*tx)) continue;
             }
             vInv.push_back(inv);
             if (vInv.size() == MAX_INV_SZ) {
@@ -5381,8 +6223,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             delete pfrom->pfilter;
             pfrom->pfilter = new CBloomFilter(filter);
             pfrom->pfilter->UpdateEmptyFull();
+            pfrom->fRelayTxes = true;
         }
-        pfrom->fRelayTxes = true;
     }
 
 
@@ -5402,12 +6244,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
             return false;
-        } else {
+        }
+        bool fHaveFilter;
+        {
             LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
+            fHaveFilter = pfrom->pfilter != NULL;
+            if (fHaveFilter)
                 pfrom->pfilter->insert(vData);
-            else
-                Misbehaving(pfrom->GetId(), 100);
+        }
+        if (!fHaveFilter) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100);
         }
     }
 
@@ -5486,6 +6333,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
+// The handlers of these messages take cs_main for only part of their work, if at all.
+// Other messages are processed holding cs_main, so they still run one at a time. That
+// includes XTHINBLOCK and XPEDITEDBLK: their handlers share the thinblock state of the
+// node and the block download bookkeeping, and PreValidateThinBlock() relies on cs_main.
+static bool IsConcurrentMessage(const std::string &strCommand)
+{
+    return strCommand == NetMsgType::PING || strCommand == NetMsgType::ADDR
+            || strCommand == NetMsgType::INV || strCommand == NetMsgType::GETHEADERS
+            || strCommand == NetMsgType::TX;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -5583,9 +6441,15 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        const int64_t nStart = GetTimeMicros();
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsConcurrentMessage(strCommand)) {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                LOCK(cs_main);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -5615,6 +6479,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        // including the time waiting for cs_main
+        CNode::RecordMessageTime(strCommand, GetTimeMicros() - nStart);
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -5683,28 +6549,40 @@ bool SendMessages(CNode* pto)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrToSend;
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage(NetMsgType::ADDR, vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddrToSend.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+            }
+            vector<CAddress> vAddr;
+            BOOST_FOREACH(const CAddress& addr, vAddrToSend)
+            {
+                vAddr.push_back(addr);
+                // receiver rejects addr messages larger than 1000
+                if (vAddr.size() >= 1000)
+                {
+                    pto->PushMessage(NetMsgType::ADDR, vAddr);
+                    vAddr.clear();
+                }
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage(NetMsgType::ADDR, vAddr);
         }
 
         CNodeState &state = *State(pto->GetId());
+        if (pto->pindexHeaderSentUnlocked) {
+            state.pindexBestHeaderSent = pto->pindexHeaderSentUnlocked;
+            pto->pindexHeaderSentUnlocked = NULL;
+        }
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
                 LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
@@ -5954,9 +6832,8 @@ bool SendMessages(CNode* pto)
                         // Must download a block from a ThinBlock peer
                         if (pto->mapThinBlocksInFlight.size() < 1 && pto->ThinBlockCapable()) { // We can only send one thinblock per peer at a time
                             pto->mapThinBlocksInFlight[pindex->GetBlockHash()] = GetTime();
-                            CBloomFilter filterMemPool = createSeededBloomFilter(CTxOrphanCache::instance()->fetchTransactionIds());
                             ss << CInv(MSG_XTHINBLOCK, pindex->GetBlockHash());
-                            ss << filterMemPool;
+                            CThinBlockFilter::instance()->serialize(ss);
                             pto->PushMessage(NetMsgType::GET_XTHIN, ss);
                             MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                             LogPrint("thin", "Requesting thinblock %s (%d) from peer %s (%d)\n", pindex->GetBlockHash().ToString(),
@@ -5967,9 +6844,8 @@ bool SendMessages(CNode* pto)
                         // Try to download a thinblock if possible otherwise just download a regular block
                         if (pto->mapThinBlocksInFlight.size() < 1 && pto->ThinBlockCapable()) { // We can only send one thinblock per peer at a time
                             pto->mapThinBlocksInFlight[pindex->GetBlockHash()] = GetTime();
-                            CBloomFilter filterMemPool = createSeededBloomFilter(CTxOrphanCache::instance()->fetchTransactionIds());
                             ss << CInv(MSG_XTHINBLOCK, pindex->GetBlockHash());
-                            ss << filterMemPool;
+                            CThinBlockFilter::instance()->serialize(ss);
                             pto->PushMessage(NetMsgType::GET_XTHIN, ss);
                             LogPrint("thin", "Requesting Thinblock %s (%d) from peer %s (%d)\n", pindex->GetBlockHash().ToString(),
                                      pindex->nHeight, pto->addrName.c_str(), pto->id);
@@ -33,6 +33,7 @@
 class CBlockIndex;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewDB;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -41,6 +42,7 @@ class CValidationState;
 
 struct CNodeStateStats;
 struct LockPoints;
+struct PrecomputedTransactionData;
 
 /** Default for DEFAULT_WHITELISTRELAY. */
 static const bool DEFAULT_WHITELISTRELAY = true;
@@ -60,6 +62,8 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -67,10 +71,14 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 
-/** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of script-checking threads allowed, -par=0 picks the number of cores up to this */
+static const int MAX_SCRIPTCHECK_THREADS = 256;
+/** Transactions with at least this many inputs get their scripts verified in parallel when entering the mempool */
+static const unsigned int MEMPOOL_PARALLEL_SCRIPTCHECK_INPUTS = 8;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -parinputs default (number of threads checking the inputs of block transactions) */
+static const int DEFAULT_INPUTCHECK_THREADS = 2;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -115,6 +123,8 @@ static const bool DEFAULT_TESTSAFEMODE = false;
 
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Number of recently served blocks kept in serialized form for other peers asking for them. */
+static const unsigned int MAX_RAW_BLOCKS_CACHED = 8;
 
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
@@ -124,7 +134,10 @@ extern const std::string strMessageMagic;
 extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
 extern bool fImporting;
+/** Set once the mempool has been loaded from disk, so Shutdown() knows to write it back */
+extern bool fDumpMempoolLater;
 extern int nScriptCheckThreads;
+extern int nTxInputCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
@@ -212,6 +225,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block transaction-inputs checking thread */
+void ThreadTxInputsCheck();
+/** Run an instance of the mempool script preverification thread */
+void ThreadMempoolScriptCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -261,9 +278,31 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool, the mempool entry shares the transaction **/
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit=false, bool fRejectAbsurdFee=false);
+/** (try to) add a copy of the transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit=false, bool fRejectAbsurdFee=false);
+/**
+ * Verify the scripts of a batch of independent transactions on the mempool script check threads,
+ * the following AcceptToMemoryPool() calls for them then find the signatures in the cache.
+ * cs_main is only held to collect the spent outputs, not while the scripts are verified.
+ */
+void PreverifyMempoolScripts(CTxMemPool& pool, const std::vector<CTransactionRef> &txs);
+/**
+ * The first part of accepting a transaction to the memory pool, to be called without holding cs_main.
+ * It runs the cheap checks and policy checks and verifies the scripts against a copy of the spent
+ * outputs, taking cs_main and pool.cs only to make that copy. The AcceptToMemoryPool() call that
+ * follows finds the signatures in the cache and holds cs_main for a much shorter time.
+ * Returns false with state set when a script fails, the transaction need not be verified again.
+ */
+bool PreverifyMempoolTransaction(CTxMemPool& pool, const CTransactionRef &tx, CValidationState &state);
+
+/** Load the mempool from mempool.dat in the data directory, verifying the transactions again. */
+bool LoadMempool(CTxMemPool& pool);
+/** Write the transactions of the mempool and its fee deltas to mempool.dat in the data directory. */
+bool DumpMempool(CTxMemPool& pool);
 
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
@@ -324,10 +363,11 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. Those checks use txdata, which has to outlive them.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL,
+                 const PrecomputedTransactionData *txdata = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
@@ -388,13 +428,20 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    const PrecomputedTransactionData *txdata;
+    bool blockValidation;
 
 public:
-    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0), blockValidation(false) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn,
+                 const PrecomputedTransactionData *txdataIn = NULL, bool blockIn = false) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
         amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn), blockValidation(blockIn) { }
+    CScriptCheck(const CTxOut& txoutIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn,
+                 const PrecomputedTransactionData *txdataIn = NULL, bool blockIn = false) :
+        scriptPubKey(txoutIn.scriptPubKey), amount(txoutIn.nValue),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn), blockValidation(blockIn) { }
 
     bool operator()();
 
@@ -406,9 +453,14 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        std::swap(txdata, check.txdata);
+        std::swap(blockValidation, check.blockValidation);
     }
 
     ScriptError GetScriptError() const { return error; }
+
+    /** Runs a failed check again with only the mandatory flags, returns true if it fails those too. */
+    bool FailsMandatoryFlags() const;
 };
 
 
@@ -430,11 +482,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+/** pTxChecked marks the transactions that already passed CheckTransaction(), as for thin blocks. */
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true,
+                const std::vector<bool> *pTxChecked = NULL);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex *pindexPrev);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex *pindexPrev);
+/** Add the header to the block index if it is valid in its context, as a headers message does. Requires cs_main. */
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex = NULL);
 
 /// Debug-level method, lots of asserts to check internal state.
 void CheckBlockIndex();
@@ -520,6 +576,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** The coin database underneath pcoinsTip */
+extern CCoinsViewDB *pcoinsdbview;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -30,8 +30,9 @@
 #include "validationinterface.h"
 #include "utilstrencodings.h"
 
+#include <boost/bind.hpp>
 #include <boost/tuple/tuple.hpp>
-#include <queue>
+#include <limits>
 #include <script/standard.cpp>
 
 #ifdef ENABLE_WALLET
@@ -54,17 +55,408 @@
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
-class ScoreCompare
+// Space and sigops kept free for the coinbase transaction
+static const uint32_t COINBASE_RESERVE_SIZE = 1000;
+static const unsigned int COINBASE_RESERVE_SIGOPS = 100;
+// Beyond this many mempool additions between two templates we just start over
+static const size_t MAX_TEMPLATE_UPDATES = 100000;
+
+// Beyond this many packages that failed to fit, a nearly full block is done
+static const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+
+namespace {
+// A mempool entry whose ancestor state no longer counts the ancestors that
+// already made it into the block being assembled.
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+        : iter(entry),
+        nSizeWithAncestors(entry->GetSizeWithAncestors()),
+        nModFeesWithAncestors(entry->GetModFeesWithAncestors()),
+        nSigOpCountWithAncestors(entry->GetSigOpCountWithAncestors())
+    {
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry &entry) const {
+        return entry.iter;
+    }
+};
+
+// Same order as CompareTxMemPoolEntryByAncestorFee, using the modified state
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return a.iter->GetTx().GetHash() < b.iter->GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+// Parents have fewer in-mempool ancestors than their children
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+struct ancestor_score {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
 {
-public:
-    ScoreCompare() {}
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator() (CTxMemPoolModifiedEntry &e) {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
+
+    CTxMemPool::txiter iter;
+};
 
-    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
+/**
+ * Fills a block template from the mempool. First the high priority
+ * transactions, then packages of transactions in order of their feerate
+ * including all their unconfirmed ancestors. This way a high fee child pays
+ * for its low fee parent (CPFP).
+ * Requires cs_main and mempool.cs to be held.
+ */
+class BlockAssembler
+{
+public:
+    BlockAssembler(CBlockTemplate *pblocktemplate, int nHeight, int64_t nLockTimeCutoff,
+                   uint32_t nBlockMaxSize, uint32_t nBlockMinSize, uint32_t nBlockPrioritySize)
+        : pblocktemplate(pblocktemplate),
+        nHeight(nHeight),
+        nLockTimeCutoff(nLockTimeCutoff),
+        nBlockMaxSize(nBlockMaxSize),
+        nBlockMinSize(nBlockMinSize),
+        nBlockPrioritySize(nBlockPrioritySize),
+        fPrintPriority(GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY))
     {
-        return CompareTxMemPoolEntryByScore()(*b,*a); // Convert to less than
     }
+
+    void AddPriorityTxs();
+    void AddPackageTxs();
+
+    uint64_t nBlockSize = COINBASE_RESERVE_SIZE;
+    uint64_t nBlockTx = 0;
+    unsigned int nBlockSigOps = COINBASE_RESERVE_SIGOPS;
+    CAmount nFees = 0;
+    CFeeRate minFeeRate = CFeeRate(MAX_MONEY);
+    bool fFull = false;
+    bool fNonFinal = false;
+    /// true if the priority area ended on a transaction that did not fit.
+    bool fPriorityFull = false;
+    /// priority of that transaction.
+    double dPriorityCutoff = 0;
+
+private:
+    void AddToBlock(CTxMemPool::txiter iter);
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps) const;
+    bool TestPackageFinality(const CTxMemPool::setEntries &package);
+    void OnlyUnconfirmed(CTxMemPool::setEntries &testSet) const;
+    bool SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set &mapModifiedTx,
+                        const CTxMemPool::setEntries &failedTx) const;
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries &alreadyAdded,
+                                indexed_modified_transaction_set &mapModifiedTx);
+
+    CBlockTemplate *pblocktemplate;
+    const int nHeight;
+    const int64_t nLockTimeCutoff;
+    const uint32_t nBlockMaxSize;
+    const uint32_t nBlockMinSize;
+    const uint32_t nBlockPrioritySize;
+    const bool fPrintPriority;
+    CTxMemPool::setEntries inBlock;
 };
 
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
+{
+    // the block shares the transaction with the mempool
+    pblocktemplate->block.vtx.push_back(iter->GetSharedTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += iter->GetSigOpCount();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    if (fPrintPriority) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n", dPriority,
+                  CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
+                  iter->GetTx().GetHash().ToString());
+    }
+}
+
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps) const
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    const uint64_t maxSigOps = Policy::blockSigOpAcceptLimit(nBlockSize + packageSize - COINBASE_RESERVE_SIZE);
+    return nBlockSigOps + packageSigOps < maxSigOps;
+}
+
+bool BlockAssembler::TestPackageFinality(const CTxMemPool::setEntries &package)
+{
+    for (CTxMemPool::txiter it : package) {
+        if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff)) {
+            fNonFinal = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+void BlockAssembler::OnlyUnconfirmed(CTxMemPool::setEntries &testSet) const
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end();) {
+        if (inBlock.count(*iit))
+            testSet.erase(iit++);
+        else
+            ++iit;
+    }
+}
+
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set &mapModifiedTx,
+                                    const CTxMemPool::setEntries &failedTx) const
+{
+    // entries with an in-block ancestor are handled through mapModifiedTx
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries &alreadyAdded,
+                                            indexed_modified_transaction_set &mapModifiedTx)
+{
+    for (CTxMemPool::txiter it : alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        for (CTxMemPool::txiter desc : descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                update_for_parent_inclusion update(it);
+                update(modEntry);
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+void BlockAssembler::AddPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        const double actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        bool fOrphan = false;
+        BOOST_FOREACH(const CTxMemPoolEntry *parent, mempool.GetMemPoolParents(iter))
+        {
+            if (!inBlock.count(mempool.GetIter(parent))) {
+                fOrphan = true;
+                break;
+            }
+        }
+        if (fOrphan) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // Once we reach the priority size or run out of free transactions the
+        // rest of the block is filled by feerate.
+        const unsigned int nTxSize = iter->GetTxSize();
+        if (!AllowFree(actualPriority))
+            break;
+        if (nBlockSize + nTxSize >= nBlockPrioritySize) {
+            fPriorityFull = true;
+            dPriorityCutoff = actualPriority;
+            break;
+        }
+        if (!TestPackage(nTxSize, iter->GetSigOpCount()))
+            continue;
+        if (!IsFinalTx(iter->GetTx(), nHeight, nLockTimeCutoff)) {
+            fNonFinal = true;
+            continue;
+        }
+
+        AddToBlock(iter);
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH(const CTxMemPoolEntry *child, mempool.GetMemPoolChildren(iter))
+        {
+            waitPriIter wpiter = waitPriMap.find(mempool.GetIter(child));
+            if (wpiter != waitPriMap.end()) {
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, wpiter->first));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                waitPriMap.erase(wpiter);
+            }
+        }
+    }
+}
+
+void BlockAssembler::AddPackageTxs()
+{
+    // Entries whose ancestors partly made it into the block already, with
+    // their ancestor state reduced accordingly.
+    indexed_modified_transaction_set mapModifiedTx;
+    // Entries that failed to fit, so we don't look at them again
+    CTxMemPool::setEntries failedTx;
+
+    // The priority transactions are in the block already
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator mi = mempool.mapTx.get<4>().begin();
+    int64_t nConsecutiveFailed = 0;
+
+    while (mi != mempool.mapTx.get<4>().end() || !mapModifiedTx.empty())
+    {
+        // Skip mapTx entries that are in the block, failed before, or have an
+        // up to date version in mapModifiedTx.
+        if (mi != mempool.mapTx.get<4>().end()
+                && SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Take the best of the next mapTx entry and the best modified entry.
+        bool fUsingModified = false;
+        CTxMemPool::txiter iter;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<4>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end()
+                    && CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
+            }
+        }
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
+        }
+
+        // Everything after this pays less than the minimum relay fee
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+            break;
+
+        if (!TestPackage(packageSize, packageSigOps)) {
+            if (fUsingModified) {
+                // Remove it from mapModifiedTx so the next best entry gets
+                // its turn, and remember that it failed.
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            fFull = true;
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, std::numeric_limits<uint64_t>::max(),
+                std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                std::numeric_limits<uint64_t>::max(), dummy, false);
+        OnlyUnconfirmed(ancestors);
+        ancestors.insert(iter);
+
+        if (!TestPackageFinality(ancestors)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+        nConsecutiveFailed = 0;
+
+        // Parents go in before their children
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+        for (CTxMemPool::txiter entry : sortedEntries) {
+            AddToBlock(entry);
+            mapModifiedTx.erase(entry);
+        }
+        minFeeRate = std::min(minFeeRate, CFeeRate(packageFees, packageSize));
+
+        // The descendants of what we just added now have a smaller package
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
+}
+
 int64_t Mining::UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -93,8 +485,137 @@ void Mining::SetCoinbase(const CScript &coinbase)
 }
 
 
+bool Mining::UpdateSelection(int nHeight, int64_t nLockTimeCutoff) const
+{
+    AssertLockHeld(mempool.cs);
+    TemplateSelection &sel = m_selection;
+
+    // Forget the transactions that left the mempool, and the ones spending them.
+    std::set<uint256> dropped;
+    size_t nKept = 0;
+    for (size_t i = 0; i < sel.vtx.size(); ++i) {
+        const CTransaction &tx = *sel.vtx[i];
+        bool fDrop = mempool.mapTx.count(tx.GetHash()) == 0;
+        for (size_t j = 0; !fDrop && j < tx.vin.size(); ++j)
+            fDrop = dropped.count(tx.vin[j].prevout.hash) > 0;
+        if (fDrop) {
+            dropped.insert(tx.GetHash());
+            sel.txids.erase(tx.GetHash());
+            sel.nBlockSize -= tx.GetTxSize();
+            sel.nBlockSigOps -= sel.vTxSigOps[i];
+            sel.nFees -= sel.vTxFees[i];
+            continue;
+        }
+        if (nKept != i) {
+            sel.vtx[nKept] = std::move(sel.vtx[i]);
+            sel.vTxFees[nKept] = sel.vTxFees[i];
+            sel.vTxSigOps[nKept] = sel.vTxSigOps[i];
+        }
+        ++nKept;
+    }
+    sel.vtx.resize(nKept);
+    sel.vTxFees.resize(nKept);
+    sel.vTxSigOps.resize(nKept);
+    if (!dropped.empty() && (sel.fFull || sel.fPriorityFull))
+        return false; // there is room for transactions we left out before
+
+    // Append the new arrivals. The mempool adds parents before their children,
+    // so walking them in order keeps the block topologically sorted.
+    for (const uint256 &hash : m_addedTxs) {
+        if (sel.txids.count(hash))
+            continue;
+        CTxMemPool::txiter iter = mempool.mapTx.find(hash);
+        if (iter == mempool.mapTx.end())
+            continue;
+
+        // Ancestors that were left out would have to come along as a package.
+        CTxMemPool::setEntries ancestors;
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, std::numeric_limits<uint64_t>::max(),
+                std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                std::numeric_limits<uint64_t>::max(), dummy, false);
+        bool fPackage = false;
+        uint64_t packageSize = iter->GetTxSize();
+        CAmount packageFees = iter->GetModifiedFee();
+        for (CTxMemPool::txiter ancestor : ancestors) {
+            if (!sel.txids.count(ancestor->GetTx().GetHash())) {
+                fPackage = true;
+                packageSize += ancestor->GetTxSize();
+                packageFees += ancestor->GetModifiedFee();
+            }
+        }
+        if (fPackage) {
+            // the child may pay for its parents, a fresh template takes that into account
+            if (packageFees >= ::minRelayTxFee.GetFee(packageSize)
+                    && (!sel.fFull || sel.minFeeRate < CFeeRate(packageFees, packageSize)))
+                return false;
+            continue;
+        }
+
+        const CTransaction &tx = iter->GetTx();
+        const unsigned int nTxSize = iter->GetTxSize();
+        if (sel.nBlockPrioritySize > 0) {
+            // AddPriorityTxs() takes transactions in priority order, so one that
+            // would have come up before the priority area closed changes it.
+            double dPriority = iter->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(hash, dPriority, dummy);
+            if (AllowFree(dPriority) && (!sel.fPriorityFull || dPriority >= sel.dPriorityCutoff))
+                return false;
+        }
+        if (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(nTxSize) && sel.nBlockSize >= sel.nBlockMinSize)
+            continue;
+        if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+            sel.fNonFinal = true;
+            continue;
+        }
+
+        const CFeeRate feeRate(iter->GetModifiedFee(), nTxSize);
+        const uint64_t maxSigOps = Policy::blockSigOpAcceptLimit(sel.nBlockSize + nTxSize - COINBASE_RESERVE_SIZE);
+        const unsigned int nTxSigOps = iter->GetSigOpCount();
+        if (sel.nBlockSize + nTxSize >= sel.nBlockMaxSize || sel.nBlockSigOps + nTxSigOps >= maxSigOps) {
+            if (sel.minFeeRate < feeRate)
+                return false; // a fresh template would pick this one over what we have
+            sel.fFull = true;
+            continue;
+        }
+
+        sel.vtx.push_back(iter->GetSharedTx());
+        sel.vTxFees.push_back(iter->GetFee());
+        sel.vTxSigOps.push_back(nTxSigOps);
+        sel.txids.insert(hash);
+        sel.nBlockSize += nTxSize;
+        sel.nBlockSigOps += nTxSigOps;
+        sel.nFees += iter->GetFee();
+        sel.minFeeRate = std::min(sel.minFeeRate, feeRate);
+    }
+    return true;
+}
+
+void Mining::MempoolEntryAdded(const CTransactionRef &tx)
+{
+    // called by the mempool with mempool.cs held
+    if (!m_selection.fValid)
+        return;
+    if (m_addedTxs.size() >= MAX_TEMPLATE_UPDATES) {
+        m_selection.fValid = false;
+        m_addedTxs.clear();
+        return;
+    }
+    m_addedTxs.push_back(tx->GetHash());
+}
+
+void Mining::MempoolEntryPrioritised(const uint256 &txid)
+{
+    // called by the mempool with mempool.cs held.
+    // The delta changes where the transaction and its relatives rank, start over.
+    m_selection.fValid = false;
+    m_addedTxs.clear();
+}
+
 CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
 {
+    const int64_t nTimeStart = GetTimeMicros();
     // Create new block
     std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
     if(!pblocktemplate.get())
@@ -115,7 +636,7 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
     }
 
     // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
+    pblock->vtx.push_back(CTransactionRef());
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
@@ -130,26 +651,12 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
     // until there are no more or the block reaches this size:
     uint32_t nBlockMinSize = std::min<uint32_t>(GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE), nBlockMaxSize);
 
-    // Collect memory pool transactions into the block
-    CTxMemPool::setEntries inBlock;
-    CTxMemPool::setEntries waitSet;
-
-    // This vector will be sorted into a priority queue:
-    std::vector<TxCoinAgePriority> vecPriority;
-    TxCoinAgePriorityCompare pricomparer;
-    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
-    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
-    double actualPriority = -1;
-
-    std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
-    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
-    const uint32_t nCoinbaseReserveSize = 1000;
-    uint64_t nBlockSize = nCoinbaseReserveSize;
+    uint64_t nBlockSize = COINBASE_RESERVE_SIZE;
     uint64_t nBlockTx = 0;
-    unsigned int nBlockSigOps = 100;
-    int lastFewTxs = 0;
+    unsigned int nBlockSigOps = COINBASE_RESERVE_SIGOPS;
     CAmount nFees = 0;
     bool fCreatedValidBlock = false;
+    bool fUpdated = false;
 
     {
         LOCK2(cs_main, mempool.cs);
@@ -175,136 +682,59 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
                                 ? nMedianTimePast
                                 : pblock->GetBlockTime();
 
-        bool fPriorityBlock = nBlockPrioritySize > 0;
-        if (fPriorityBlock) {
-            vecPriority.reserve(mempool.mapTx.size());
-            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-                 mi != mempool.mapTx.end(); ++mi)
-            {
-                double dPriority = mi->GetPriority(nHeight);
-                CAmount dummy;
-                mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
-                vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
-            }
-            std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-        }
-
-        CTxMemPool::indexed_transaction_set::nth_index<3>::type::iterator mi = mempool.mapTx.get<3>().begin();
-        CTxMemPool::txiter iter;
-
-        while (mi != mempool.mapTx.get<3>().end() || !clearedTxs.empty())
-        {
-            bool priorityTx = false;
-            if (fPriorityBlock && !vecPriority.empty()) { // add a tx from priority queue to fill the blockprioritysize
-                priorityTx = true;
-                iter = vecPriority.front().second;
-                actualPriority = vecPriority.front().first;
-                std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                vecPriority.pop_back();
-            }
-            else if (clearedTxs.empty()) { // add tx with next highest score
-                iter = mempool.mapTx.project<0>(mi);
-                mi++;
-            }
-            else {  // try to add a previously postponed child tx
-                iter = clearedTxs.top();
-                clearedTxs.pop();
-            }
-
-            if (inBlock.count(iter))
-                continue; // could have been added to the priorityBlock
-
-            const CTransaction& tx = iter->GetTx();
-
-            bool fOrphan = false;
-            BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
-            {
-                if (!inBlock.count(parent)) {
-                    fOrphan = true;
-                    break;
-                }
-            }
-            if (fOrphan) {
-                if (priorityTx)
-                    waitPriMap.insert(std::make_pair(iter,actualPriority));
-                else
-                    waitSet.insert(iter);
-                continue;
-            }
-
-            unsigned int nTxSize = iter->GetTxSize();
-            if (fPriorityBlock &&
-                (nBlockSize + nTxSize >= nBlockPrioritySize || !AllowFree(actualPriority))) {
-                fPriorityBlock = false;
-                waitPriMap.clear();
-            }
-            if (!priorityTx &&
-                (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(nTxSize) && nBlockSize >= nBlockMinSize)) {
-                break;
-            }
-            if (nBlockSize + nTxSize >= nBlockMaxSize) {
-                if (nBlockSize >  nBlockMaxSize - 100 || lastFewTxs > 50) {
-                    break;
-                }
-                // Once we're within 1000 bytes of a full block, only look at 50 more txs
-                // to try to fill the remaining space.
-                if (nBlockSize > nBlockMaxSize - 1000) {
-                    lastFewTxs++;
-                }
-                continue;
-            }
-
-            if (!IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                continue;
-
-            const uint64_t maxSigOps = Policy::blockSigOpAcceptLimit(nBlockSize + nTxSize - nCoinbaseReserveSize);
-            unsigned int nTxSigOps = iter->GetSigOpCount();
-            if (nBlockSigOps + nTxSigOps >= maxSigOps) {
-                if (nBlockSigOps > maxSigOps - 2) {
-                    break;
-                }
-                continue;
-            }
-
-            CAmount nTxFees = iter->GetFee();
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                double dPriority = iter->GetPriority(nHeight);
-                CAmount dummy;
-                mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                          dPriority , CFeeRate(iter->GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
-            }
-
-            inBlock.insert(iter);
-
-            // Add transactions that depend on this one to the priority queue
-            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
-            {
-                if (fPriorityBlock) {
-                    waitPriIter wpiter = waitPriMap.find(child);
-                    if (wpiter != waitPriMap.end()) {
-                        vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
-                        std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                        waitPriMap.erase(wpiter);
-                    }
-                }
-                else {
-                    if (waitSet.count(child)) {
-                        clearedTxs.push(child);
-                        waitSet.erase(child);
-                    }
-                }
-            }
+        // Start from the previous selection if it was made for the same tip and settings.
+        const uint256 hashPrevBlock = pindexPrev->GetBlockHash();
+        TemplateSelection &sel = m_selection;
+        // A later cutoff can make transactions final that were left out before,
+        // an earlier one can make selected transactions non-final again.
+        const bool fSameCutoff = sel.nLockTimeCutoff == nLockTimeCutoff
+                || (sel.nLockTimeCutoff < nLockTimeCutoff && !sel.fNonFinal);
+        fUpdated = sel.fValid && sel.hashPrevBlock == hashPrevBlock && sel.nHeight == nHeight
+                && sel.nMedianTimePast == nMedianTimePast && sel.nBlockMaxSize == nBlockMaxSize
+                && sel.nBlockMinSize == nBlockMinSize && sel.nBlockPrioritySize == nBlockPrioritySize
+                && fSameCutoff && UpdateSelection(nHeight, nLockTimeCutoff);
+        m_addedTxs.clear();
+        if (fUpdated) {
+            sel.nLockTimeCutoff = nLockTimeCutoff;
+            pblock->vtx.insert(pblock->vtx.end(), sel.vtx.begin(), sel.vtx.end());
+            pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), sel.vTxFees.begin(), sel.vTxFees.end());
+            pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), sel.vTxSigOps.begin(), sel.vTxSigOps.end());
+            nBlockSize = sel.nBlockSize;
+            nBlockTx = sel.vtx.size();
+            nBlockSigOps = sel.nBlockSigOps;
+            nFees = sel.nFees;
+        } else {
+            BlockAssembler assembler(pblocktemplate.get(), nHeight, nLockTimeCutoff,
+                                     nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+            assembler.AddPriorityTxs();
+            assembler.AddPackageTxs();
+            nBlockSize = assembler.nBlockSize;
+            nBlockTx = assembler.nBlockTx;
+            nBlockSigOps = assembler.nBlockSigOps;
+            nFees = assembler.nFees;
+
+            sel = TemplateSelection();
+            sel.hashPrevBlock = hashPrevBlock;
+            sel.nHeight = nHeight;
+            sel.nMedianTimePast = nMedianTimePast;
+            sel.nLockTimeCutoff = nLockTimeCutoff;
+            sel.nBlockMaxSize = nBlockMaxSize;
+            sel.nBlockMinSize = nBlockMinSize;
+            sel.nBlockPrioritySize = nBlockPrioritySize;
+            sel.vtx.assign(pblock->vtx.begin() + 1, pblock->vtx.end());
+            sel.vTxFees.assign(pblocktemplate->vTxFees.begin() + 1, pblocktemplate->vTxFees.end());
+            sel.vTxSigOps.assign(pblocktemplate->vTxSigOps.begin() + 1, pblocktemplate->vTxSigOps.end());
+            for (const auto &tx : sel.vtx)
+                sel.txids.insert(tx->GetHash());
+            sel.nBlockSize = nBlockSize;
+            sel.nBlockSigOps = nBlockSigOps;
+            sel.nFees = nFees;
+            sel.minFeeRate = assembler.minFeeRate;
+            sel.fFull = assembler.fFull;
+            sel.fNonFinal = assembler.fNonFinal;
+            sel.fPriorityFull = assembler.fPriorityFull;
+            sel.dPriorityCutoff = assembler.dPriorityCutoff;
+            sel.fValid = true;
         }
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -315,7 +745,7 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
             txNew.nVersion = 4;
         txNew.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
         txNew.vin[0].scriptSig = CScript() << nHeight << OP_0 << m_coinbaseComment;
-        pblock->vtx[0] = txNew;
+        pblock->vtx[0] = MakeTransactionRef(std::move(txNew));
         pblocktemplate->vTxFees[0] = -nFees;
 
         // Fill in header
@@ -323,11 +753,15 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
         UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
         pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
         pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(*pblock->vtx[0]);
 
         CValidationState state;
-        fCreatedValidBlock = TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false);
+        if (GetBoolArg("-blocktemplatecheck", DEFAULT_CHECK_BLOCK_TEMPLATE))
+            fCreatedValidBlock = TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false);
+        else // the block gets fully validated when it is submitted
+            fCreatedValidBlock = true;
         if (!fCreatedValidBlock) {
+            sel.fValid = false;
             if (pblock->vtx.size() <= 1) {
                 // This should REALLY never happen! Empty block that is invalid.
                 throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", 
@@ -340,8 +774,8 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
             LogPrintf("%s: TestBlockValidity failed: %s, retrying with smaller mempool",
                       __func__, FormatStateMessage(state));
             std::list<CTransaction> unused;
-            BOOST_REVERSE_FOREACH(const CTransaction& tx, pblock->vtx) {
-                mempool.remove(tx, unused, true);
+            BOOST_REVERSE_FOREACH(const CTransactionRef& tx, pblock->vtx) {
+                mempool.remove(*tx, unused, true);
             }
         }
     }
@@ -350,6 +784,8 @@ CBlockTemplate* Mining::CreateNewBlock(const CChainParams& chainparams) const
         pblocktemplate.reset();
         return CreateNewBlock(chainparams); // recurse with smaller mempool
     }
+    LogPrint("bench", "CreateNewBlock(): %s template in %.2fms\n", fUpdated ? "updated" : "new",
+             (GetTimeMicros() - nTimeStart) * 0.001);
 
     return pblocktemplate.release();
 }
@@ -364,11 +800,11 @@ void Mining::IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev,
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) << m_coinbaseComment;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
@@ -413,7 +849,7 @@ bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phas
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     // Found a solution
     {
@@ -631,6 +1067,9 @@ Mining::~Mining()
 Mining::Mining()
     : m_minerThreads(0)
 {
+    m_mempoolConnection = mempool.NotifyEntryAdded.connect(boost::bind(&Mining::MempoolEntryAdded, this, _1));
+    m_prioritiseConnection = mempool.NotifyEntryPrioritised.connect(boost::bind(&Mining::MempoolEntryPrioritised, this, _1));
+
     // read args to create m_coinbaseComment
     std::int32_t sizeLimit = Policy::blockSizeAcceptLimit();
 
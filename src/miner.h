@@ -11,7 +11,9 @@
 
 #include <stdint.h>
 #include <mutex>
+#include <set>
 
+#include <boost/signals2/connection.hpp>
 #include <boost/thread.hpp>
 
 class CBlockIndex;
@@ -25,6 +27,8 @@ static const bool DEFAULT_GENERATE = false;
 static const int DEFAULT_GENERATE_THREADS = 1;
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Run TestBlockValidity on every block template we create */
+static const bool DEFAULT_CHECK_BLOCK_TEMPLATE = true;
 
 struct CBlockTemplate
 {
@@ -61,6 +65,53 @@ public:
     void SetCoinbase(const CScript &coinbase);
 
 private:
+    /**
+     * The mempool transactions picked for the previous template.
+     * As long as the tip and the block creation settings stay the same, the
+     * next template starts from this selection and only looks at the
+     * transactions that entered or left the mempool since.
+     * Guarded by mempool.cs
+     */
+    struct TemplateSelection {
+        uint256 hashPrevBlock;
+        int nHeight = -1;
+        int64_t nMedianTimePast = 0;
+        int64_t nLockTimeCutoff = 0;
+        uint32_t nBlockMaxSize = 0;
+        uint32_t nBlockMinSize = 0;
+        uint32_t nBlockPrioritySize = 0;
+
+        std::vector<CTransactionRef> vtx;
+        std::vector<CAmount> vTxFees;
+        std::vector<int64_t> vTxSigOps;
+        std::set<uint256> txids;
+        uint64_t nBlockSize = 0;
+        unsigned int nBlockSigOps = 0;
+        CAmount nFees = 0;
+        /// lowest fee rate of the transactions picked on fee, not priority.
+        CFeeRate minFeeRate;
+        /// true if a transaction was left out because the block was full.
+        bool fFull = false;
+        /// true if a transaction was left out because it was not final yet.
+        bool fNonFinal = false;
+        /// true if the priority area ended on a transaction that did not fit.
+        bool fPriorityFull = false;
+        /// priority of that transaction, arrivals below it stay out of the priority area.
+        double dPriorityCutoff = 0;
+        bool fValid = false;
+    };
+
+    /// Update m_selection for the new mempool state, returns false if a full rebuild is needed.
+    bool UpdateSelection(int nHeight, int64_t nLockTimeCutoff) const;
+    void MempoolEntryAdded(const CTransactionRef &tx);
+    void MempoolEntryPrioritised(const uint256 &txid);
+
+    mutable TemplateSelection m_selection;
+    /// txids added to the mempool since m_selection was made. Guarded by mempool.cs
+    mutable std::vector<uint256> m_addedTxs;
+    boost::signals2::scoped_connection m_mempoolConnection;
+    boost::signals2::scoped_connection m_prioritiseConnection;
+
     boost::thread_group* m_minerThreads;
     static Mining *s_instance;
     mutable std::mutex m_lock;
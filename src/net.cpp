@@ -29,6 +29,9 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 #endif
 
 #ifdef USE_UPNP
@@ -41,6 +44,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
 #include <math.h>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -86,6 +90,36 @@ static bool vfLimited[CNetAddr::NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+/** The sockets the socket handler waits for, NULL if it uses select() */
+static CEpollSet *epollSet = NULL;
+#endif
+
+// select() can only wait for sockets below FD_SETSIZE, epoll has no such limit.
+static bool CanWaitForSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (epollSet)
+        return true;
+#endif
+    return IsSelectableSocket(hSocket);
+}
+
+// Adds a new node's socket to the epoll set, if we use one.
+static void WatchSocket(CNode *pnode)
+{
+#ifdef USE_EPOLL
+    if (!epollSet)
+        return;
+    LOCK2(pnode->cs_vSend, pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    pnode->fWantWrite = !pnode->vSendMsg.empty();
+    if (!epollSet->add(pnode->hSocket, pnode, true, pnode->fWantWrite))
+        pnode->fDisconnect = true;
+#endif
+}
+
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
@@ -331,6 +365,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_messageTimes;
+std::map<std::string, CMessageTimeHistogram> CNode::mapMessageTimes;
 
 uint64_t CNode::nMaxOutboundLimit = 0;
 uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
@@ -399,7 +435,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!CanWaitForSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -418,6 +454,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WatchSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
 
@@ -434,10 +471,19 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
-    if (hSocket != INVALID_SOCKET)
     {
-        logDebug(Log::Net) << "disconnecting peer" << id;
-        CloseSocket(hSocket);
+        // SocketSendData() checks the socket under this lock before it changes what we wait
+        // for in the epoll set, so it never touches a socket number that got reused.
+        LOCK(cs_hSocket);
+        if (hSocket != INVALID_SOCKET)
+        {
+            logDebug(Log::Net) << "disconnecting peer" << id;
+#ifdef USE_EPOLL
+            if (epollSet)
+                epollSet->remove(hSocket);
+#endif
+            CloseSocket(hSocket);
+        }
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
@@ -622,7 +668,10 @@ void CNode::copyStats(CNodeStats &stats)
 {
     stats.nodeid = this->GetId();
     X(nServices);
-    X(fRelayTxes);
+    {
+        LOCK(cs_filter);
+        X(fRelayTxes);
+    }
     X(nLastSend);
     X(nLastRecv);
     X(nTimeConnected);
@@ -689,7 +738,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            messageHandlerCondition.notify_all();
         }
     }
 
@@ -754,20 +803,21 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<Streaming::ConstBuffer>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        const Streaming::ConstBuffer &data = *it;
+        const size_t dataSize = data.size();
+        assert(dataSize > pnode->nSendOffset);
+        int nBytes = send(pnode->hSocket, data.begin() + pnode->nSendOffset, dataSize - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
             pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            if (pnode->nSendOffset == dataSize) {
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= dataSize;
                 it++;
             } else {
                 // could not send full message; stop sending more
@@ -793,6 +843,18 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+#ifdef USE_EPOLL
+    // Only wait for the socket to become writable while we have something to write.
+    const bool fWantWrite = !pnode->vSendMsg.empty();
+    if (epollSet && fWantWrite != pnode->fWantWrite) {
+        LOCK(pnode->cs_hSocket);
+        if (pnode->hSocket != INVALID_SOCKET) {
+            pnode->fWantWrite = fWantWrite;
+            epollSet->setWantWrite(pnode->hSocket, pnode, fWantWrite);
+        }
+    }
+#endif
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -979,7 +1041,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!CanWaitForSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1022,85 +1084,167 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    WatchSocket(pnode);
 }
 
-void ThreadSocketHandler()
+// Removes nodes marked for disconnection from vNodes and deletes them once no thread uses them.
+static void DisconnectNodes(unsigned int &nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-
-                    if (pnode->nVersion != 0) {
-                        bool xthinCapable = pnode->nServices & NODE_XTHIN;
-                        bool cashCapable = pnode->nServices & NODE_BITCOIN_CASH;
-                        CAddrInfo *info = addrman.Find(pnode->addr);
-                        if (info) {
-                            info->setKnowsXThin(xthinCapable);
-                            info->setKnowsCash(cashCapable);
-                        }
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+
+                if (pnode->nVersion != 0) {
+                    bool xthinCapable = pnode->nServices & NODE_XTHIN;
+                    bool cashCapable = pnode->nServices & NODE_BITCOIN_CASH;
+                    CAddrInfo *info = addrman.Find(pnode->addr);
+                    if (info) {
+                        info->setKnowsXThin(xthinCapable);
+                        info->setKnowsCash(cashCapable);
                     }
                 }
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// If there is no (complete) message in the receive buffer, or there is space left in
+// it, we read from the socket. Otherwise the message handler has work to do first.
+// Requires cs_vRecvMsg.
+static bool WantsToReceive(CNode *pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+        pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+// Does one recv() on the node's socket. Returns the number of bytes read, 0 when the
+// socket got closed and -1 when there was nothing to read or an error disconnected us.
+// Requires cs_vRecvMsg.
+static int ReceiveSocketData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes;
+    do {
+        nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    } while (nBytes < 0 && WSAGetLastError() == WSAEINTR);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            logDebug(Log::Net) << "socket closed";
+        pnode->CloseSocketDisconnect();
+    }
+    else
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+        nBytes = -1;
+    }
+    return nBytes;
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
+
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -1158,9 +1302,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && WantsToReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -1218,39 +1360,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                logDebug(Log::Net) << "socket closed";
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    ReceiveSocketData(pnode);
             }
 
             //
@@ -1265,41 +1375,205 @@ void ThreadSocketHandler()
                     SocketSendData(pnode);
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
+            InactivityCheck(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+CEpollSet::CEpollSet()
+    : m_fd(epoll_create1(EPOLL_CLOEXEC))
+{
+    if (m_fd == -1)
+        LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(errno));
+}
+
+CEpollSet::~CEpollSet()
+{
+    if (m_fd != -1)
+        close(m_fd);
+}
+
+static uint32_t EpollEvents(bool edgeTriggered, bool wantWrite)
+{
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (edgeTriggered)
+        events |= EPOLLET;
+    if (wantWrite)
+        events |= EPOLLOUT;
+    return events;
+}
+
+bool CEpollSet::add(SOCKET socket, void *context, bool edgeTriggered, bool wantWrite)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EpollEvents(edgeTriggered, wantWrite);
+    event.data.ptr = context;
+    if (epoll_ctl(m_fd, EPOLL_CTL_ADD, socket, &event) != 0) {
+        LogPrintf("epoll_ctl add failed: %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    return true;
+}
+
+void CEpollSet::remove(SOCKET socket)
+{
+    // closing the socket would remove it as well, unless another descriptor refers to it.
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(m_fd, EPOLL_CTL_DEL, socket, &event);
+}
+
+void CEpollSet::setWantWrite(SOCKET socket, void *context, bool wantWrite)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EpollEvents(true, wantWrite);
+    event.data.ptr = context;
+    if (epoll_ctl(m_fd, EPOLL_CTL_MOD, socket, &event) != 0)
+        LogPrint("net", "epoll_ctl mod failed: %s\n", NetworkErrorString(errno));
+}
+
+int CEpollSet::wait(struct epoll_event *events, int maxEvents, int nTimeout)
+{
+    int rc;
+    do {
+        rc = epoll_wait(m_fd, events, maxEvents, nTimeout);
+    } while (rc == -1 && errno == EINTR);
+    return rc;
+}
+
+/*
+ * The epoll based socket handler.
+ * Each node is in the epoll set for the lifetime of its socket, edge triggered. An event
+ * sets fSocketReadable/fSocketWritable and puts the node on the pending list, where it
+ * stays until reading and writing both would block, or there is nothing left to write.
+ * The same rules as in the select() loop apply: a node that has data to send doesn't get
+ * read from and a node with a full receive buffer waits for the message handler.
+ */
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    std::vector<CNode*> vPending;
+    const int MaxEvents = 256;
+    struct epoll_event events[MaxEvents];
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        const int nEvents = epollSet->wait(events, MaxEvents, 50);
+        boost::this_thread::interruption_point();
+        if (nEvents == -1) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            MilliSleep(50);
+        }
+
+        bool fAccept = false;
+        {
+            LOCK(cs_vNodes);
+            for (int i = 0; i < nEvents; ++i) {
+                CNode *pnode = static_cast<CNode*>(events[i].data.ptr);
+                if (pnode == NULL) { // a listen socket
+                    fAccept = true;
+                    continue;
                 }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+                if (!pnode->fSocketPending) {
+                    pnode->fSocketPending = true;
+                    pnode->AddRef();
+                    vPending.push_back(pnode);
                 }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+            }
+        }
+
+        if (fAccept) {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+            }
+        }
+
+        std::vector<CNode*> vDone;
+        for (size_t i = 0; i < vPending.size();) {
+            boost::this_thread::interruption_point();
+            CNode *pnode = vPending[i];
+            if (pnode->hSocket == INVALID_SOCKET) {
+                pnode->fSocketReadable = pnode->fSocketWritable = false;
+            } else {
+                // drain the write buffer before we read more, like the select() loop does.
+                bool fSending = true;
                 {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        if (pnode->fSocketWritable) {
+                            SocketSendData(pnode);
+                            // What is left didn't fit in the socket buffer, wait for the next EPOLLOUT edge.
+                            pnode->fSocketWritable = false;
+                        }
+                        fSending = !pnode->vSendMsg.empty();
+                    }
                 }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                if (pnode->fSocketReadable && !fSending) {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv) {
+                        while (WantsToReceive(pnode)) {
+                            if (ReceiveSocketData(pnode) <= 0) {
+                                // the next data to arrive generates a new event
+                                pnode->fSocketReadable = false;
+                                break;
+                            }
+                        }
+                    }
                 }
             }
+            if (pnode->fSocketReadable || pnode->fSocketWritable) {
+                ++i;
+            } else {
+                vDone.push_back(pnode);
+                vPending[i] = vPending.back();
+                vPending.pop_back();
+            }
         }
-        {
+        if (!vDone.empty()) {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            BOOST_FOREACH(CNode* pnode, vDone) {
+                pnode->fSocketPending = false;
                 pnode->Release();
+            }
+        }
+
+        // the timeouts are in seconds, no need to walk all nodes on every event
+        const int64_t nNow = GetTimeMillis();
+        if (nNow - nLastInactivityCheck >= 1000) {
+            nLastInactivityCheck = nNow;
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
         }
     }
 }
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (epollSet) {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
 
 
 
@@ -1784,11 +2058,51 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+bool ProcessNodeMessages(CNode *pnode)
+{
+    // A node is handled by one thread at a time, another thread may be busy with it.
+    TRY_LOCK(pnode->cs_messageHandler, lockHandler);
+    if (!lockHandler)
+        return false;
+
+    bool fMore = false;
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                {
+                    fMore = true;
+                }
+            }
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(pnode);
+    }
+    return fMore;
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
 
+    // Several of these threads run, each starts its round at a different node.
+    static std::atomic<int> s_nextWorker(0);
+    const int nWorker = s_nextWorker++;
+
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
@@ -1813,36 +2127,14 @@ void ThreadMessageHandler()
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        for (size_t i = 0; i < vNodesCopy.size(); ++i)
         {
+            CNode *pnode = vNodesCopy[(i + nWorker) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
-
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode);
-            }
+            if (ProcessNodeMessages(pnode))
+                fSleep = false;
             boost::this_thread::interruption_point();
         }
 
@@ -2063,6 +2355,23 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef USE_EPOLL
+    if (epollSet == NULL) {
+        epollSet = new CEpollSet();
+        bool ok = epollSet->isValid();
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            // level triggered, we accept one connection at a time
+            if (ok && hListenSocket.socket != INVALID_SOCKET)
+                ok = epollSet->add(hListenSocket.socket, NULL, false);
+        }
+        if (!ok) {
+            LogPrintf("Can't use epoll, falling back to select()\n");
+            delete epollSet;
+            epollSet = NULL;
+        }
+    }
+#endif
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -2073,7 +2382,13 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    // -msghandthreads=0 means autodetect
+    int nMessageHandlers = GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    if (nMessageHandlers <= 0)
+        nMessageHandlers += GetNumCores();
+    nMessageHandlers = std::max(1, std::min(nMessageHandlers, MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlers; ++i)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2120,6 +2435,10 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        delete epollSet;
+        epollSet = NULL;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2166,9 +2485,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        if(!pnode->fRelayTxes)
-            continue;
         LOCK(pnode->cs_filter);
+        if (!pnode->fRelayTxes)
+            continue;
         if (pnode->pfilter)
         {
             if (pnode->pfilter->IsRelevantAndUpdate(tx))
@@ -2278,6 +2597,38 @@ uint64_t CNode::GetOutboundTargetBytesLeft()
     return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
+CMessageTimeHistogram::CMessageTimeHistogram()
+    : nCount(0),
+    nTotalMicros(0)
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void CMessageTimeHistogram::add(int64_t nMicros)
+{
+    int bucket = 0;
+    while (bucket < Buckets - 1 && nMicros >= (int64_t(1) << bucket))
+        ++bucket;
+    ++buckets[bucket];
+    ++nCount;
+    nTotalMicros += std::max<int64_t>(nMicros, 0);
+}
+
+void CNode::RecordMessageTime(const std::string &strCommand, int64_t nMicros)
+{
+    // peers can send anything as command, only known ones get their own histogram.
+    const std::vector<std::string> &types = getAllNetMessageTypes();
+    const bool known = std::find(types.begin(), types.end(), strCommand) != types.end();
+    LOCK(cs_messageTimes);
+    mapMessageTimes[known ? strCommand : std::string("other")].add(nMicros);
+}
+
+std::map<std::string, CMessageTimeHistogram> CNode::GetMessageTimes()
+{
+    LOCK(cs_messageTimes);
+    return mapMessageTimes;
+}
+
 uint64_t CNode::GetTotalBytesRecv()
 {
     LOCK(cs_totalBytesRecv);
@@ -2454,6 +2805,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    fWantWrite = false;
+    fSocketReadable = false;
+    fSocketWritable = false;
+    fSocketPending = false;
     nTimeConnected = GetTime();
     nTimeOffset = 0;
     addr = addrIn;
@@ -2478,6 +2833,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nNextLocalAddrSend = 0;
     nNextAddrSend = 0;
     nNextInvSend = 0;
+    pindexHeaderSentUnlocked = NULL;
     fRelayTxes = false;
     fSentAddr = false;
     pfilter = new CBloomFilter();
@@ -2556,6 +2912,18 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+namespace {
+/// Move the message out of stream into a buffer for vSendMsg.
+Streaming::ConstBuffer TakeMessage(CDataStream &stream)
+{
+    std::shared_ptr<CSerializeData> message = std::make_shared<CSerializeData>();
+    stream.GetAndClear(*message);
+    assert(!message->empty());
+    std::shared_ptr<char> data(message, &(*message)[0]);
+    return Streaming::ConstBuffer(data, data.get(), data.get() + message->size());
+}
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2605,17 +2973,39 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     logDebug(Log::Net).nospace() << "(" << nSize << " bytes) peer=" << id;
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    const bool fQueueEmpty = vSendMsg.empty();
+    vSendMsg.push_back(TakeMessage(ssSend));
+    nSendSize += vSendMsg.back().size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (fQueueEmpty)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushRawMessage(const char *pszCommand, const Streaming::ConstBuffer &payload, unsigned int nChecksum)
+{
+    assert(payload.isValid());
+    LOCK(cs_vSend);
+    assert(ssSend.size() == 0);
+    ssSend << CMessageHeader(magic(), pszCommand, payload.size());
+    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    logDebug(Log::Net) << "sending:" << SanitizeString(pszCommand);
+    logDebug(Log::Net).nospace() << "(" << payload.size() << " bytes) peer=" << id;
+
+    const bool fQueueEmpty = vSendMsg.empty();
+    vSendMsg.push_back(TakeMessage(ssSend));
+    nSendSize += vSendMsg.back().size();
+    if (payload.size() > 0) {
+        vSendMsg.push_back(payload);
+        nSendSize += payload.size();
+    }
+
+    if (fQueueEmpty)
+        SocketSendData(this);
+}
+
 //
 // CBanDB
 //
@@ -15,10 +15,13 @@
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
+#include "streaming/ConstBuffer.h"
 #include "sync.h"
 #include "uint256.h"
 
+#include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -35,6 +38,8 @@
 class CAddrMan;
 class CScheduler;
 class CNode;
+class CBlockIndex;
+class IncompleteMerkleTree;
 
 namespace boost {
     class thread_group;
@@ -64,6 +69,9 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** The number of threads processing messages from peers, -msghandthreads. 0 = one per core */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 0;
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 /** Default for blocks only*/
@@ -99,6 +107,44 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/**
+ * Processes the received messages of the node and sends what is queued for it, unless another
+ * message handler thread is busy with it.
+ * Returns true if the node has more messages waiting.
+ */
+bool ProcessNodeMessages(CNode *pnode);
+
+#ifdef USE_EPOLL
+struct epoll_event;
+
+/**
+ * The sockets the socket handler waits for, in an epoll instance.
+ * Sockets are added once instead of for every wait like with select(). They
+ * are normally edge triggered: an event says the socket became readable or
+ * writable since the last one, so the reader has to drain it until it would block.
+ */
+class CEpollSet
+{
+public:
+    CEpollSet();
+    ~CEpollSet();
+
+    /// False if the kernel didn't give us an epoll instance.
+    bool isValid() const { return m_fd != -1; }
+
+    /// Start waiting for the socket, its events carry context.
+    bool add(SOCKET socket, void *context, bool edgeTriggered = true, bool wantWrite = false);
+    void remove(SOCKET socket);
+    /// Start or stop waiting for an added socket to become writable.
+    void setWantWrite(SOCKET socket, void *context, bool wantWrite);
+
+    /// Waits at most nTimeout milliseconds, returns the number of events or -1 on error.
+    int wait(struct epoll_event *events, int maxEvents, int nTimeout);
+
+private:
+    int m_fd;
+};
+#endif
 
 typedef int NodeId;
 
@@ -172,6 +218,7 @@ extern CCriticalSection cs_vNodes;
 extern std::map<CInv, CDataStream> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
+/** Guarded by cs_main, CNode::AskFor() is called from several message handler threads */
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -212,6 +259,24 @@ public:
     std::string addrLocal;
 };
 
+/**
+ * The time spent on processing one type of message.
+ * Bucket i counts the messages that took less than 2^i microseconds (and at least 2^(i-1)),
+ * the last bucket also counts everything slower.
+ */
+class CMessageTimeHistogram
+{
+public:
+    static const int Buckets = 24; // the last one starts at 4.2 seconds
+
+    CMessageTimeHistogram();
+    void add(int64_t nMicros);
+
+    uint64_t nCount;
+    uint64_t nTotalMicros;
+    uint64_t buckets[Buckets];
+};
+
 
 
 
@@ -326,12 +391,24 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<Streaming::ConstBuffer> vSendMsg;
     CCriticalSection cs_vSend;
+    bool fWantWrite; // we wait for the socket to become writable, guarded by cs_vSend
+    // Guards closing hSocket against changes to its epoll registration. No other lock is taken
+    // while holding it, so it can be taken under cs_vNodes as well as under cs_vSend.
+    CCriticalSection cs_hSocket;
+
+    // What epoll told the socket handler about the socket and it didn't act on yet.
+    // Only used by the socket handler thread.
+    bool fSocketReadable;
+    bool fSocketWritable;
+    bool fSocketPending; // in the socket handler's list of sockets to get back to
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread working on this node, so messages are processed in order.
+    CCriticalSection cs_messageHandler;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -342,7 +419,7 @@ public:
     CAddress addr;
     std::string addrName;
     CService addrLocal;
-    int nVersion;
+    std::atomic<int> nVersion; // written by the version message, read by other peers' addr relay
     // strSubVer is whatever byte array we read from the wire. However, this field is intended
     // to be printed out, displayed to humans in various forms and so on. So we sanitize it and
     // store the sanitized version in cleanSubVer. The original should be used when dealing with
@@ -360,6 +437,7 @@ public:
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
     //    unless it loads a bloom filter.
+    // Guarded by cs_filter
     bool fRelayTxes;
     bool fSentAddr;
     CSemaphoreGrant grantOutbound;
@@ -370,12 +448,14 @@ public:
     NodeId id;
 
     // Xtreme Thinblocks: begin section
+    // The thin block members are guarded by cs_main, the peer that delivers a block first clears them on all nodes.
     CBlock thinBlock;
     std::vector<uint64_t> xThinBlockHashes;
 #ifdef LOG_XTHINBLOCKS
     int nSizeThinBlock;   // Original on-wire size of the block. Just used for reporting
 #endif
     int thinBlockWaitingForTxns;   // if -1 then not currently waiting
+    std::shared_ptr<IncompleteMerkleTree> thinBlockMerkleTree; // the merkle tree hashed while waiting for transactions
     std::map<uint256, uint64_t> mapThinBlocksInFlight; // map of the hashes of thin blocks in flight with the time they were requested.
     double nGetXBlockTxCount; // Count how many get_xblocktx requests are made
     uint64_t nGetXBlockTxLastTime;  // The last time a get_xblocktx request was made
@@ -406,6 +486,7 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend; // guards vAddrToSend and addrKnown, other peers' addr messages push to us
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -421,6 +502,9 @@ public:
     // Used for headers announcements - unfiltered blocks to relay
     // Also protected by cs_inventory
     std::vector<uint256> vBlockHashesToAnnounce;
+    // The last header sent in reply to getheaders without holding cs_main,
+    // SendMessages() moves it to the node state.
+    CBlockIndex *pindexHeaderSentUnlocked;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -447,6 +531,10 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Message processing times, by command
+    static CCriticalSection cs_messageTimes;
+    static std::map<std::string, CMessageTimeHistogram> mapMessageTimes;
+
     // outbound limit & stats
     static uint64_t nMaxOutboundTotalBytesSentInCycle;
     static uint64_t nMaxOutboundCycleStartTime;
@@ -507,11 +595,13 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -562,6 +652,13 @@ public:
 
     void PushVersion();
 
+    /**
+     * Send a message with an already serialized payload. The payload is queued
+     * as is, so peers sending the same data share one buffer.
+     * @param nChecksum the message checksum, the first 4 bytes of Hash(payload).
+     */
+    void PushRawMessage(const char* pszCommand, const Streaming::ConstBuffer &payload, unsigned int nChecksum);
+
     const CMessageHeader::MessageStartChars &magic() const;
 
     void PushMessage(const char* pszCommand)
@@ -767,6 +864,10 @@ public:
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 
+    /// Adds how long the message handler took for a message, unknown commands are counted as "other".
+    static void RecordMessageTime(const std::string &strCommand, int64_t nMicros);
+    static std::map<std::string, CMessageTimeHistogram> GetMessageTimes();
+
     //!set the max outbound target in bytes
     static void SetMaxOutboundTarget(uint64_t limit);
     static uint64_t GetMaxOutboundTarget();
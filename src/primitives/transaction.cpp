@@ -90,10 +90,17 @@ void CTransaction::UpdateHash()
     }
 }
 
-CTransaction::CTransaction() : nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) { }
+CTransaction::CTransaction() : nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) {
+    ResetCaches();
+}
 
 CTransaction::CTransaction(const CMutableTransaction &tx) : nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime) {
     UpdateHash();
+    ResetCaches();
+}
+
+CTransaction::CTransaction(const CTransaction &tx) : hash(tx.hash), txData(tx.txData), nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime) {
+    CopyCaches(tx);
 }
 
 CTransaction& CTransaction::operator=(const CTransaction &tx) {
@@ -103,9 +110,54 @@ CTransaction& CTransaction::operator=(const CTransaction &tx) {
     *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
     hash = tx.hash;
     txData = tx.txData;
+    CopyCaches(tx);
     return *this;
 }
 
+void CTransaction::ResetCaches()
+{
+    nTxSizeCache.store(0, std::memory_order_relaxed);
+    nLegacySigOpsCache.store(-1, std::memory_order_relaxed);
+    nP2SHSigOpsCache.store(-1, std::memory_order_relaxed);
+}
+
+void CTransaction::CopyCaches(const CTransaction &tx)
+{
+    nTxSizeCache.store(tx.nTxSizeCache.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    nLegacySigOpsCache.store(tx.nLegacySigOpsCache.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    nP2SHSigOpsCache.store(tx.nP2SHSigOpsCache.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+unsigned int CTransaction::GetTxSize() const
+{
+    unsigned int size = nTxSizeCache.load(std::memory_order_relaxed);
+    if (size == 0) {
+        CSizeComputer s(SER_NETWORK, 0);
+        Serialize<CSizeComputer>(s, SER_NETWORK, 0);
+        size = s.size();
+        // the v4 serialization changes with flexTransActive, don't remember it
+        if (nVersion != 4)
+            nTxSizeCache.store(size, std::memory_order_relaxed);
+    }
+    return size;
+}
+
+unsigned int CTransaction::GetLegacySigOpCount() const
+{
+    int nSigOps = nLegacySigOpsCache.load(std::memory_order_relaxed);
+    if (nSigOps < 0) {
+        nSigOps = 0;
+        for (const CTxIn &txin : vin) {
+            nSigOps += txin.scriptSig.GetSigOpCount(false);
+        }
+        for (const CTxOut &txout : vout) {
+            nSigOps += txout.scriptPubKey.GetSigOpCount(false);
+        }
+        nLegacySigOpsCache.store(nSigOps, std::memory_order_relaxed);
+    }
+    return nSigOps;
+}
+
 uint256 CTransaction::CalculateSignaturesHash() const
 {
     CHashWriter ss(0, 0);
@@ -14,6 +14,9 @@
 
 #include "../consensus/transactionv4.h"
 
+#include <atomic>
+#include <memory>
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
@@ -325,6 +328,18 @@ private:
     void UpdateHash();
     std::vector<char> txData;
 
+    /**
+     * Memory only, filled on first use and carried along with copies.
+     * The serialized size and the sigop counts are asked for at several stages of
+     * validation, mempool acceptance and mining, so we avoid walking the scripts each time.
+     * Racing threads compute the same value, so relaxed atomics are enough.
+     */
+    mutable std::atomic<uint32_t> nTxSizeCache;      // 0 until computed
+    mutable std::atomic<int32_t> nLegacySigOpsCache; // -1 until computed
+    mutable std::atomic<int32_t> nP2SHSigOpsCache;   // -1 until computed
+    void ResetCaches();
+    void CopyCaches(const CTransaction &tx);
+
 public:
     // Default transaction version.
     static const int32_t CURRENT_VERSION=1;
@@ -351,12 +366,15 @@ public:
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
 
+    CTransaction(const CTransaction &tx);
     CTransaction& operator=(const CTransaction& tx);
 
-    size_t GetSerializeSize(int nType, int nVersion) const {
-        CSizeComputer s(nType, nVersion);
-        Serialize(s, nType, nVersion);
-        return s.size();
+    size_t GetSerializeSize(int, int) const {
+        return GetTxSize();
+    }
+    /// The serialization does not depend on type or version, so size computations use the cached size.
+    void Serialize(CSizeComputer& s, int, int) const {
+        s.write(NULL, GetTxSize());
     }
     template<typename Stream>
     void Serialize(Stream& s, int nType, int version) const {
@@ -375,6 +393,7 @@ public:
     void Unserialize(Stream& s, int nType, int version) {
         txData = UnSerializeTransaction(*const_cast<CTransaction*>(this), s, nType, version);
         UpdateHash();
+        ResetCaches();
     }
 
     bool IsNull() const {
@@ -388,6 +407,24 @@ public:
     /// for transactions that separate their signatures (like v4) calculate the hash of this data.
     uint256 CalculateSignaturesHash() const;
 
+    /// The serialized size in bytes, computed once.
+    unsigned int GetTxSize() const;
+
+    /// The legacy sigop count of the scriptSigs and scriptPubKeys, computed once.
+    unsigned int GetLegacySigOpCount() const;
+
+    /**
+     * The P2SH sigops depend on the outputs this transaction spends, so they are
+     * counted by GetP2SHSigOpCount() in main.cpp which stores the result here.
+     * Returns -1 if not known yet.
+     */
+    int GetCachedP2SHSigOpCount() const {
+        return nP2SHSigOpsCache.load(std::memory_order_relaxed);
+    }
+    void SetCachedP2SHSigOpCount(unsigned int count) const {
+        nP2SHSigOpsCache.store(count, std::memory_order_relaxed);
+    }
+
     // Return sum of txouts.
     CAmount GetValueOut() const;
     // GetValueIn() is a method on CCoinsViewCache, because
@@ -417,6 +454,15 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * A shared reference to an immutable transaction.
+ * Blocks, the mempool, the orphan cache and thin block reconstruction hold the
+ * transaction by this type so they can share one instance instead of copying it.
+ */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 /** A mutable version of CTransaction. */
 struct CMutableTransaction
 {
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -13,11 +14,13 @@
 #include "policy/policy.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
 #include "BlocksDB.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "primitives/block.h"
@@ -101,16 +104,16 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+    for (const auto &tx : block.vtx)
     {
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
-            TxToJSON(tx, uint256(), objTx);
+            TxToJSON(*tx, uint256(), objTx);
             txs.push_back(objTx);
         }
         else
-            txs.push_back(tx.GetHash().GetHex());
+            txs.push_back(tx->GetHash().GetHex());
     }
     result.push_back(Pair("tx", txs));
     result.push_back(Pair("time", block.GetBlockTime()));
@@ -637,6 +640,32 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"pruneheight\": xxxxxx,    (numeric) heighest block available\n"
+            "  \"coinsflush\": {           (object) writes of the coin cache to the database\n"
+            "     \"count\": xx,              (numeric) number of completed writes\n"
+            "     \"last_duration_ms\": xx,   (numeric) duration of the last write\n"
+            "     \"total_duration_ms\": xx,  (numeric) duration of all writes together\n"
+            "     \"last_stall_ms\": xx,      (numeric) time block processing waited for the previous write, last flush\n"
+            "     \"total_stall_ms\": xx,     (numeric) time block processing waited for writes, all flushes\n"
+            "     \"pending\": xx             (boolean) if a write is in progress\n"
+            "  },\n"
+            "  \"blockcache\": {           (object) recently connected blocks kept in memory\n"
+            "     \"blocks\": xx,             (numeric) number of blocks in the cache\n"
+            "     \"usage\": xx,              (numeric) estimated memory usage in bytes\n"
+            "     \"maxusage\": xx,           (numeric) maximum memory usage in bytes (-blockcachesize)\n"
+            "     \"block_hits\": xx,         (numeric) blocks served from the cache\n"
+            "     \"block_misses\": xx,       (numeric) blocks that had to be read from disk\n"
+            "     \"undo_hits\": xx,          (numeric) undo data served from the cache\n"
+            "     \"undo_misses\": xx         (numeric) undo data that had to be read from disk\n"
+            "  },\n"
+            "  \"sigcache\": {             (object) signatures known to be valid\n"
+            "     \"entries\": xx,            (numeric) number of signatures in the cache\n"
+            "     \"maxentries\": xx,         (numeric) number of signatures the cache can hold (-maxsigcachesize)\n"
+            "     \"usage\": xx,              (numeric) memory used by the cache in bytes\n"
+            "     \"block_hits\": xx,         (numeric) signatures in blocks found in the cache\n"
+            "     \"block_misses\": xx,       (numeric) signatures in blocks that had to be verified\n"
+            "     \"mempool_hits\": xx,       (numeric) signatures of new transactions found in the cache\n"
+            "     \"mempool_misses\": xx      (numeric) signatures of new transactions that had to be verified\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -694,6 +723,40 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
 
         obj.push_back(Pair("pruneheight",        block->nHeight));
     }
+
+    if (pcoinsdbview) {
+        const CCoinsFlushStats flushStats = pcoinsdbview->GetFlushStats();
+        UniValue coinsflush(UniValue::VOBJ);
+        coinsflush.push_back(Pair("count",             (uint64_t)flushStats.nFlushes));
+        coinsflush.push_back(Pair("last_duration_ms",  flushStats.nLastDuration / 1000));
+        coinsflush.push_back(Pair("total_duration_ms", flushStats.nTotalDuration / 1000));
+        coinsflush.push_back(Pair("last_stall_ms",     flushStats.nLastStall / 1000));
+        coinsflush.push_back(Pair("total_stall_ms",    flushStats.nTotalStall / 1000));
+        coinsflush.push_back(Pair("pending",           flushStats.fPending));
+        obj.push_back(Pair("coinsflush", coinsflush));
+    }
+
+    const CBlockCache::Stats cacheStats = CBlockCache::instance()->stats();
+    UniValue blockcache(UniValue::VOBJ);
+    blockcache.push_back(Pair("blocks",       (uint64_t)cacheStats.nBlocks));
+    blockcache.push_back(Pair("usage",        (uint64_t)cacheStats.nUsage));
+    blockcache.push_back(Pair("maxusage",     (uint64_t)cacheStats.nMaxUsage));
+    blockcache.push_back(Pair("block_hits",   cacheStats.nBlockHits));
+    blockcache.push_back(Pair("block_misses", cacheStats.nBlockMisses));
+    blockcache.push_back(Pair("undo_hits",    cacheStats.nUndoHits));
+    blockcache.push_back(Pair("undo_misses",  cacheStats.nUndoMisses));
+    obj.push_back(Pair("blockcache", blockcache));
+
+    const SignatureCacheStats sigStats = GetSignatureCacheStats();
+    UniValue sigcache(UniValue::VOBJ);
+    sigcache.push_back(Pair("entries",        (uint64_t)sigStats.nEntries));
+    sigcache.push_back(Pair("maxentries",     (uint64_t)sigStats.nMaxEntries));
+    sigcache.push_back(Pair("usage",          (uint64_t)sigStats.nUsage));
+    sigcache.push_back(Pair("block_hits",     sigStats.nBlockHits));
+    sigcache.push_back(Pair("block_misses",   sigStats.nBlockMisses));
+    sigcache.push_back(Pair("mempool_hits",   sigStats.nMempoolHits));
+    sigcache.push_back(Pair("mempool_misses", sigStats.nMempoolMisses));
+    obj.push_back(Pair("sigcache", sigcache));
     return obj;
 }
 
@@ -401,6 +401,47 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getmessagetimings(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getmessagetimings\n"
+            "\nReturns how long processing the messages received from peers took, per message type.\n"
+            "The time includes waiting for locks held by other threads.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"msg\": {                (json object) The message type, \"other\" for unknown ones\n"
+            "    \"count\": n,            (numeric) Number of messages processed\n"
+            "    \"totalmillis\": n,      (numeric) Total processing time in milliseconds\n"
+            "    \"histogram\": [n,...]   (array) Number of messages that took less than 2^i microseconds\n"
+            "                             (and at least 2^(i-1)) at index i, the last one includes all slower ones\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagetimings", "")
+            + HelpExampleRpc("getmessagetimings", "")
+       );
+
+    UniValue obj(UniValue::VOBJ);
+    const std::map<std::string, CMessageTimeHistogram> times = CNode::GetMessageTimes();
+    for (auto iter = times.begin(); iter != times.end(); ++iter) {
+        const CMessageTimeHistogram &messageTimes = iter->second;
+        // leave off the empty buckets at the end
+        int nBuckets = CMessageTimeHistogram::Buckets;
+        while (nBuckets > 0 && messageTimes.buckets[nBuckets - 1] == 0)
+            --nBuckets;
+        UniValue histogram(UniValue::VARR);
+        for (int i = 0; i < nBuckets; ++i)
+            histogram.push_back(messageTimes.buckets[i]);
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("count", messageTimes.nCount));
+        entry.push_back(Pair("totalmillis", messageTimes.nTotalMicros / 1000));
+        entry.push_back(Pair("histogram", histogram));
+        obj.push_back(Pair(iter->first, entry));
+    }
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
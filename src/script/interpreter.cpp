@@ -1197,10 +1197,17 @@ uint256 GetOutputsHash(const CTransaction &txTo)
 
 } // anon namespace
 
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+    : hashPrevouts(GetPrevoutHash(txTo)),
+    hashSequence(GetSequenceHash(txTo)),
+    hashOutputs(GetOutputsHash(txTo))
+{
+}
+
 // Signature hash returns a hash of a certain subset of the transaction's content
 // allowing the private-key owner to sign that and proof he owns the public key and
 // at the same time lock in all the content he signs.
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, CAmount amount, int nHashType, uint32_t flags)
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, CAmount amount, int nHashType, uint32_t flags, const PrecomputedTransactionData* cache)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1253,18 +1260,18 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         uint256 hashOutputs;
 
         if (!(nHashType & SIGHASH_ANYONECANPAY)) {
-            hashPrevouts = GetPrevoutHash(txTo);
+            hashPrevouts = cache ? cache->hashPrevouts : GetPrevoutHash(txTo);
         }
 
         if (!(nHashType & SIGHASH_ANYONECANPAY) &&
             (nHashType & 0x1f) != SIGHASH_SINGLE &&
             (nHashType & 0x1f) != SIGHASH_NONE) {
-            hashSequence = GetSequenceHash(txTo);
+            hashSequence = cache ? cache->hashSequence : GetSequenceHash(txTo);
         }
 
         if ((nHashType & 0x1f) != SIGHASH_SINGLE &&
             (nHashType & 0x1f) != SIGHASH_NONE) {
-            hashOutputs = GetOutputsHash(txTo);
+            hashOutputs = cache ? cache->hashOutputs : GetOutputsHash(txTo);
         } else if ((nHashType & 0x1f) == SIGHASH_SINGLE &&
                    nIn < txTo.vout.size()) {
             CHashWriter ss(SER_GETHASH, 0);
@@ -1323,7 +1330,7 @@ bool TransactionSignatureChecker::CheckSig(const std::vector<unsigned char>& vch
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, amount, nHashType, flags);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, amount, nHashType, flags, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -5,48 +5,114 @@
 
 #include "sigcache.h"
 
-#include "memusage.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/unordered_set.hpp>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <string.h>
 
 namespace {
 
-/**
- * We're hashing a nonce into the entries themselves, so we don't need extra
- * blinding in the set hash computation.
- */
-class CSignatureCacheHasher
-{
-public:
-    size_t operator()(const uint256& key) const {
-        return key.GetCheapHash();
-    }
-};
+std::atomic<uint64_t> nBlockHits(0);
+std::atomic<uint64_t> nBlockMisses(0);
+std::atomic<uint64_t> nMempoolHits(0);
+std::atomic<uint64_t> nMempoolMisses(0);
 
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * The cache is a fixed size table of buckets holding WAYS entries each. Lookups
+ * take no lock at all, every bucket has a sequence number that is odd while the
+ * bucket is being changed, and a reader that sees it change retries.
+ * Writers only lock the bucket they change.
+ *
+ * Entries are stamped with the generation they were stored in, the generation
+ * moves on every time an eighth of the capacity has been inserted. A full bucket
+ * makes room by replacing its oldest entry.
  */
 class CSignatureCache
 {
 private:
-     //! Entries are SHA256(nonce || signature hash || public key || signature):
+    static const int WAYS = 8;
+    static const int READ_ATTEMPTS = 4;
+
+    struct Bucket {
+        std::atomic<uint32_t> seq;
+        std::atomic<uint8_t> gen[WAYS]; // 0 means the slot is empty
+        std::atomic<uint64_t> key[WAYS][4];
+    };
+
+    //! Entries are SHA256(nonce || signature hash || public key || signature):
     uint256 nonce;
-    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
-    map_type setValid;
-    boost::shared_mutex cs_sigcache;
+    std::unique_ptr<Bucket[]> buckets;
+    size_t nBuckets; // zero when the cache is disabled
+    std::atomic<uint8_t> nGeneration;
+    std::atomic<uint32_t> nInserts;
+    std::atomic<int64_t> nEntries;
+
+    /// Maps the top 32 bits of the entry onto [0, nBuckets) with a multiply and a
+    /// shift, so the bucket count does not have to be a power of two.
+    inline Bucket &bucketFor(const uint256 &entry) const {
+        return buckets[((entry.GetCheapHash() >> 32) * nBuckets) >> 32];
+    }
+
+    static inline void toWords(const uint256 &entry, uint64_t words[4]) {
+        memcpy(words, entry.begin(), 32);
+    }
+
+    static inline bool equals(const Bucket &bucket, int way, const uint64_t words[4]) {
+        for (int i = 0; i < 4; ++i) {
+            if (bucket.key[way][i].load(std::memory_order_relaxed) != words[i])
+                return false;
+        }
+        return true;
+    }
+
+    /// Returns the slot holding entry, or -1. Bucket must be locked by the caller.
+    static int find(const Bucket &bucket, const uint64_t words[4]) {
+        for (int way = 0; way < WAYS; ++way) {
+            if (bucket.gen[way].load(std::memory_order_relaxed) != 0 && equals(bucket, way, words))
+                return way;
+        }
+        return -1;
+    }
 
+    static void lock(Bucket &bucket) {
+        while (true) {
+            uint32_t seq = bucket.seq.load(std::memory_order_relaxed);
+            if ((seq & 1) == 0 && bucket.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire))
+                break;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    static void unlock(Bucket &bucket) {
+        bucket.seq.fetch_add(1, std::memory_order_release);
+    }
 
 public:
     CSignatureCache()
+        : nBuckets(0), nGeneration(1), nInserts(0), nEntries(0)
     {
         GetRandBytes(nonce.begin(), 32);
+        const int64_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((int64_t) 1 << 20);
+        if (nMaxCacheSize < (int64_t) sizeof(Bucket))
+            return;
+        nBuckets = std::min<uint64_t>(nMaxCacheSize / sizeof(Bucket), std::numeric_limits<uint32_t>::max());
+        buckets.reset(new Bucket[nBuckets]);
+        for (size_t i = 0; i < nBuckets; ++i) {
+            buckets[i].seq = 0;
+            for (int way = 0; way < WAYS; ++way)
+                buckets[i].gen[way] = 0;
+        }
+        LogPrintf("Using %uMiB of the %uMiB requested for the signature cache, able to store %u elements\n",
+                  memoryUsage() >> 20, (size_t) (nMaxCacheSize >> 20), capacity());
     }
 
     void
@@ -58,56 +124,130 @@ public:
     bool
     Get(const uint256& entry)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.count(entry);
+        if (nBuckets == 0)
+            return false;
+        const Bucket &bucket = bucketFor(entry);
+        uint64_t words[4];
+        toWords(entry, words);
+        for (int attempt = 0; attempt < READ_ATTEMPTS; ++attempt) {
+            const uint32_t seq = bucket.seq.load(std::memory_order_acquire);
+            if (seq & 1)
+                continue;
+            const bool found = find(bucket, words) >= 0;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (bucket.seq.load(std::memory_order_relaxed) == seq)
+                return found;
+        }
+        // a busy bucket is treated as a miss, the caller just verifies the signature
+        return false;
     }
 
     void Erase(const uint256& entry)
     {
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        setValid.erase(entry);
+        if (nBuckets == 0)
+            return;
+        Bucket &bucket = bucketFor(entry);
+        uint64_t words[4];
+        toWords(entry, words);
+        lock(bucket);
+        const int way = find(bucket, words);
+        if (way >= 0) {
+            bucket.gen[way].store(0, std::memory_order_relaxed);
+            --nEntries;
+        }
+        unlock(bucket);
     }
 
     void Set(const uint256& entry)
     {
-        size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
-        {
-            map_type::size_type s = GetRand(setValid.bucket_count());
-            map_type::local_iterator it = setValid.begin(s);
-            if (it != setValid.end(s)) {
-                setValid.erase(*it);
+        if (nBuckets == 0)
+            return;
+        const uint8_t generation = nGeneration;
+        Bucket &bucket = bucketFor(entry);
+        uint64_t words[4];
+        toWords(entry, words);
+        lock(bucket);
+        if (find(bucket, words) < 0) {
+            // take an empty slot, or else the one with the oldest generation
+            int victim = 0;
+            int oldestAge = -1;
+            for (int way = 0; way < WAYS; ++way) {
+                const uint8_t gen = bucket.gen[way].load(std::memory_order_relaxed);
+                const int age = gen == 0 ? 255 : (generation - gen + 255) % 255;
+                if (age > oldestAge) {
+                    oldestAge = age;
+                    victim = way;
+                }
             }
+            if (bucket.gen[victim].load(std::memory_order_relaxed) == 0)
+                ++nEntries;
+            for (int i = 0; i < 4; ++i)
+                bucket.key[victim][i].store(words[i], std::memory_order_relaxed);
+            bucket.gen[victim].store(generation, std::memory_order_relaxed);
+        }
+        unlock(bucket);
+
+        if (++nInserts % std::max<size_t>(1, nBuckets * WAYS / 8) == 0) {
+            // generations run from 1 to 255
+            uint8_t expected = generation;
+            nGeneration.compare_exchange_strong(expected, generation % 255 + 1);
         }
+    }
 
-        setValid.insert(entry);
+    size_t size() const {
+        return std::max<int64_t>(0, nEntries.load());
+    }
+    size_t capacity() const {
+        return nBuckets * WAYS;
+    }
+    size_t memoryUsage() const {
+        return nBuckets * sizeof(Bucket);
     }
 };
 
+CSignatureCache &signatureCache()
+{
+    static CSignatureCache cache;
+    return cache;
+}
+
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache &cache = signatureCache();
 
     uint256 entry;
-    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    cache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(entry)) {
+    if (cache.Get(entry)) {
+        ++(block ? nBlockHits : nMempoolHits);
         if (!store) {
-            signatureCache.Erase(entry);
+            cache.Erase(entry);
         }
         return true;
     }
+    ++(block ? nBlockMisses : nMempoolMisses);
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store) {
-        signatureCache.Set(entry);
+        cache.Set(entry);
     }
     return true;
 }
+
+SignatureCacheStats GetSignatureCacheStats()
+{
+    const CSignatureCache &cache = signatureCache();
+    SignatureCacheStats stats;
+    stats.nEntries = cache.size();
+    stats.nMaxEntries = cache.capacity();
+    stats.nUsage = cache.memoryUsage();
+    stats.nBlockHits = nBlockHits;
+    stats.nBlockMisses = nBlockMisses;
+    stats.nMempoolHits = nMempoolHits;
+    stats.nMempoolMisses = nMempoolMisses;
+    return stats;
+}
@@ -8,6 +8,7 @@
 
 #include "script/interpreter.h"
 
+#include <stdint.h>
 #include <vector>
 
 // DoS prevention: limit cache size to less than 40MB (over 500000
@@ -16,13 +17,30 @@ static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
 
 class CPubKey;
 
+/**
+ * Counters of the signature cache, split by whether the lookup was made while
+ * validating a block or while accepting a transaction into the mempool.
+ */
+struct SignatureCacheStats {
+    size_t nEntries;
+    size_t nMaxEntries;
+    size_t nUsage;
+    uint64_t nBlockHits;
+    uint64_t nBlockMisses;
+    uint64_t nMempoolHits;
+    uint64_t nMempoolMisses;
+};
+
+SignatureCacheStats GetSignatureCacheStats();
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
+    bool block; // only used for the statistics
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn, amount), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn=true, const PrecomputedTransactionData* txdataIn = NULL, bool blockIn = false) : TransactionSignatureChecker(txToIn, nInIn, amount, txdataIn), store(storeIn), block(blockIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
@@ -40,6 +40,9 @@ public:
     std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev() {
         return m_mapOrphanTransactionsByPrev;
     }
+    size_t shortIdCount() const {
+        return m_shortIds.size();
+    }
 
    void LimitOrphanTxSizePublic(unsigned int max) {
        LimitOrphanTxSize(max);
@@ -50,7 +53,7 @@ public:
         auto it = m_mapOrphanTransactions.lower_bound(GetRandHash());
         if (it == m_mapOrphanTransactions.end())
             it = m_mapOrphanTransactions.begin();
-        return it->second.tx;
+        return *it->second.tx;
     }
 };
 
@@ -140,7 +143,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout.resize(1);
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
-        cache.AddOrphanTx(tx, i);
+        cache.AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -157,7 +160,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        cache.AddOrphanTx(tx, i);
+        cache.AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // This really-big orphan should be ignored:
@@ -182,12 +185,13 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
         if (i == 0) {
-            BOOST_CHECK(cache.AddOrphanTx(tx, i));  // we keep orphans up to the configured memory limit to help xthin compression so this should succeed whereas it fails in other clients
+            BOOST_CHECK(cache.AddOrphanTx(MakeTransactionRef(tx), i));  // we keep orphans up to the configured memory limit to help xthin compression so this should succeed whereas it fails in other clients
         }
     }
 
     // Test LimitOrphanTxSize() function:
     {
+        BOOST_CHECK_EQUAL(cache.shortIdCount(), cache.mapOrphanTransactions().size());
         cache.LimitOrphanTxSizePublic(40);
         BOOST_CHECK(cache.mapOrphanTransactions().size() <= 40);
         cache.LimitOrphanTxSizePublic(10);
@@ -195,6 +199,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         cache.LimitOrphanTxSizePublic(0);
         BOOST_CHECK(cache.mapOrphanTransactions().empty());
         BOOST_CHECK(cache.mapOrphanTransactionsByPrev().empty());
+        BOOST_CHECK_EQUAL(cache.shortIdCount(), 0);
     }
 
     // Test EraseOrphansByTime():
@@ -212,7 +217,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
             tx.vout[0].nValue = 1*CENT;
             tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-            cache.AddOrphanTx(tx, i);
+            cache.AddOrphanTx(MakeTransactionRef(tx), i);
         }
         BOOST_CHECK(cache.mapOrphanTransactions().size() == 50);
         cache.EraseOrphansByTime();
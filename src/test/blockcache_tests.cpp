@@ -0,0 +1,102 @@
+// Copyright (c) 2017 The Bitcoin Classic developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+#include "primitives/block.h"
+#include "undo.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+static CBlock MakeBlock(int nonce, int txCount)
+{
+    CBlock block;
+    block.nNonce = nonce;
+    for (int i = 0; i < txCount; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << nonce << i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(100, i);
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    return block;
+}
+
+static CBlockUndo MakeUndo(int txCount)
+{
+    CBlockUndo undo;
+    undo.vtxundo.resize(txCount);
+    for (int i = 0; i < txCount; ++i) {
+        undo.vtxundo[i].vprevout.push_back(CTxInUndo(CTxOut(i, CScript() << i)));
+    }
+    return undo;
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_basics)
+{
+    CBlockCache cache;
+    const CBlock block = MakeBlock(1, 10);
+    CBlockUndo undo = MakeUndo(9);
+    cache.add(block, undo);
+    BOOST_CHECK(undo.vtxundo.empty()); // taken over by the cache
+
+    std::shared_ptr<const CBlock> cached = cache.block(block.GetHash());
+    BOOST_REQUIRE(cached);
+    BOOST_CHECK(cached->GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cached->vtx.size(), 10);
+    std::shared_ptr<const CBlockUndo> cachedUndo = cache.undo(block.GetHash());
+    BOOST_REQUIRE(cachedUndo);
+    BOOST_CHECK_EQUAL(cachedUndo->vtxundo.size(), 9);
+
+    BOOST_CHECK(!cache.block(uint256()));
+    BOOST_CHECK(!cache.undo(uint256()));
+
+    CBlockCache::Stats stats = cache.stats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 1);
+    BOOST_CHECK(stats.nUsage > 0);
+    BOOST_CHECK_EQUAL(stats.nBlockHits, 1);
+    BOOST_CHECK_EQUAL(stats.nBlockMisses, 1);
+    BOOST_CHECK_EQUAL(stats.nUndoHits, 1);
+    BOOST_CHECK_EQUAL(stats.nUndoMisses, 1);
+
+    // a block handed out stays valid after it is dropped
+    cache.clear();
+    BOOST_CHECK(!cache.block(block.GetHash()));
+    BOOST_CHECK(cached->GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_limit)
+{
+    CBlockCache cache;
+    std::vector<CBlock> blocks;
+    for (int i = 0; i < 10; ++i) {
+        blocks.push_back(MakeBlock(i, 20));
+        CBlockUndo undo = MakeUndo(19);
+        cache.add(blocks.back(), undo);
+    }
+    const size_t usagePerBlock = cache.stats().nUsage / 10;
+
+    // use the oldest, that makes the second one the least recently used.
+    BOOST_CHECK(cache.block(blocks[0].GetHash()));
+    cache.setMaxUsage(usagePerBlock * 5);
+    CBlockCache::Stats stats = cache.stats();
+    BOOST_CHECK(stats.nBlocks <= 5);
+    BOOST_CHECK(stats.nUsage <= usagePerBlock * 5);
+    BOOST_CHECK(cache.block(blocks[0].GetHash()));
+    BOOST_CHECK(cache.block(blocks[9].GetHash()));
+    BOOST_CHECK(!cache.block(blocks[1].GetHash()));
+
+    // zero disables the cache
+    cache.setMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.stats().nBlocks, 0);
+    CBlockUndo undo = MakeUndo(19);
+    cache.add(blocks[0], undo);
+    BOOST_CHECK_EQUAL(cache.stats().nBlocks, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -20,6 +20,10 @@
 
 #include <BlocksDB.h>
 #include <chain.h>
+#include <chainparams.h>
+#include <hash.h>
+#include <main.h>
+#include <streams.h>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(blocksdb, TestingSetup)
@@ -236,4 +240,37 @@ BOOST_AUTO_TEST_CASE(headersChain2)
     }
 }
 
+BOOST_AUTO_TEST_CASE(mappedBlocks)
+{
+    const CChainParams &params = Params();
+    Blocks::DB *db = Blocks::DB::instance();
+    const CBlockIndex *genesis = chainActive.Genesis();
+    BOOST_REQUIRE(genesis);
+    const CDiskBlockPos genesisPos = genesis->GetBlockPos();
+
+    Streaming::ConstBuffer data = db->loadBlock(genesisPos);
+    BOOST_REQUIRE(data.isValid());
+    BOOST_CHECK_EQUAL(data.size(), ::GetSerializeSize(params.GenesisBlock(), SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(Hash(data.begin(), data.begin() + 80) == genesis->GetBlockHash());
+
+    // append a block to the already mapped file.
+    CBlock block(params.GenesisBlock());
+    block.nNonce++;
+    CDiskBlockPos pos(genesisPos.nFile, genesisPos.nPos + data.size());
+    BOOST_CHECK(WriteBlockToDisk(block, pos, params.MessageStart()));
+    Streaming::ConstBuffer data2 = db->loadBlock(pos);
+    BOOST_REQUIRE(data2.isValid());
+    BOOST_CHECK(Hash(data2.begin(), data2.begin() + 80) == block.GetHash());
+
+    // buffers handed out stay usable after the file is unmapped.
+    db->unmapFile(genesisPos.nFile);
+    CDataStream stream(data2.begin(), data2.end(), SER_DISK, CLIENT_VERSION);
+    CBlock copy;
+    stream >> copy;
+    BOOST_CHECK(copy.GetHash() == block.GetHash());
+
+    BOOST_CHECK(!db->loadBlock(CDiskBlockPos(genesisPos.nFile, pos.nPos + data2.size() + 8)).isValid());
+    BOOST_CHECK(!db->loadBlock(CDiskBlockPos()).isValid());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,220 @@
+// Copyright (c) 2017 The Bitcoin Classic developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace {
+std::atomic<int> nChecksRun;
+
+struct CountingCheck {
+    bool fOk;
+    CountingCheck(bool ok = true) : fOk(ok) {}
+    bool operator()() {
+        ++nChecksRun;
+        return fOk;
+    }
+    void swap(CountingCheck &other) {
+        std::swap(fOk, other.fOk);
+    }
+};
+
+template <typename T>
+void AddChecks(CCheckQueue<T> *queue, int nBatches, int nPerBatch)
+{
+    for (int i = 0; i < nBatches; ++i) {
+        std::vector<T> vChecks(nPerBatch);
+        queue->Add(vChecks);
+    }
+}
+
+/** Starts nThreads - 1 workers, the thread calling Wait() is the last one. */
+template <typename T>
+void StartWorkers(CCheckQueue<T> &queue, boost::thread_group &threads, int nThreads)
+{
+    for (int i = 0; i < nThreads - 1; ++i)
+        threads.create_thread(boost::bind(&CCheckQueue<T>::Thread, &queue));
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    const int threadCounts[] = {1, 2, 4, 16};
+    for (int nThreads : threadCounts) {
+        CCheckQueue<CountingCheck> queue(128);
+        boost::thread_group threads;
+        StartWorkers(queue, threads, nThreads);
+        for (int round = 0; round < 10; ++round) {
+            nChecksRun = 0;
+            CCheckQueueControl<CountingCheck> control(&queue);
+            for (int i = 1; i < 200; i += 20) {
+                std::vector<CountingCheck> vChecks(i);
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+            BOOST_CHECK_EQUAL(nChecksRun, 910);
+            BOOST_CHECK(queue.IsIdle());
+        }
+        threads.interrupt_all();
+        threads.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CountingCheck> queue(16);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 4);
+    for (int round = 0; round < 20; ++round) {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks(1000);
+        if (round % 2)
+            vChecks[round * 37].fOk = false;
+        control.Add(vChecks);
+        BOOST_CHECK_EQUAL(control.Wait(), round % 2 == 0);
+        // the failure is not remembered for the next user
+        BOOST_CHECK(queue.IsIdle());
+    }
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure_stops_workers)
+{
+    // Once a check failed, the checks still queued are dropped instead of run.
+    CCheckQueue<CountingCheck> queue(16);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 4);
+    nChecksRun = 0;
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks(1, CountingCheck(false));
+        control.Add(vChecks);
+        // give the worker that ran it the moment to record the failure
+        while (nChecksRun == 0)
+            boost::this_thread::yield();
+        MilliSleep(50);
+        vChecks.assign(1000, CountingCheck());
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    BOOST_CHECK_EQUAL(nChecksRun, 1);
+    BOOST_CHECK(queue.IsIdle());
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_concurrent_add)
+{
+    // Like the input checks in ConnectBlock, several threads add to the queue at the same time.
+    CCheckQueue<CountingCheck> queue(16);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 8);
+    nChecksRun = 0;
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        boost::thread_group adders;
+        for (int i = 0; i < 4; ++i)
+            adders.create_thread(boost::bind(&AddChecks<CountingCheck>, &queue, 500, 3));
+        adders.join_all();
+        BOOST_CHECK(control.Wait());
+    }
+    BOOST_CHECK_EQUAL(nChecksRun, 4 * 500 * 3);
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+// Signed pay-to-pubkey-hash spends for the script check tests.
+static std::vector<CTransaction> SignedSpends(const CTxOut &prevOut, const CKey &key, int nSpends)
+{
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    std::vector<CTransaction> txs;
+    txs.reserve(nSpends);
+    for (int i = 0; i < nSpends; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 40000;
+        tx.vout[0].scriptPubKey = prevOut.scriptPubKey;
+        BOOST_CHECK(SignSignature(keystore, prevOut.scriptPubKey, tx, 0, prevOut.nValue, SIGHASH_ALL | SIGHASH_FORKID));
+        txs.push_back(tx);
+    }
+    return txs;
+}
+
+static bool VerifySpends(CCheckQueue<CScriptCheck> &queue, const CTxOut &prevOut, const std::vector<CTransaction> &txs)
+{
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_ENABLE_SIGHASH_FORKID;
+    CCheckQueueControl<CScriptCheck> control(&queue);
+    for (size_t i = 0; i < txs.size(); ++i) {
+        std::vector<CScriptCheck> vChecks;
+        vChecks.push_back(CScriptCheck(prevOut, txs[i], 0, flags, false));
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_scriptcheck)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const CTxOut prevOut(50000, GetScriptForDestination(key.GetPubKey().GetID()));
+    std::vector<CTransaction> txs = SignedSpends(prevOut, key, 50);
+
+    CCheckQueue<CScriptCheck> queue(8);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 4);
+    BOOST_CHECK(VerifySpends(queue, prevOut, txs));
+
+    // one spend with a different amount fails the batch
+    CMutableTransaction bad(txs[25]);
+    bad.vout[0].nValue = 30000;
+    txs[25] = CTransaction(bad);
+    BOOST_CHECK(!VerifySpends(queue, prevOut, txs));
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_scriptcheck_scaling)
+{
+    // Time for the same script checks with 1 to 64 worker threads.
+    if (!TimingTestsEnabled())
+        return;
+    CKey key;
+    key.MakeNewKey(true);
+    const CTxOut prevOut(50000, GetScriptForDestination(key.GetPubKey().GetID()));
+    const std::vector<CTransaction> txs = SignedSpends(prevOut, key, 1000);
+
+    const int threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+    for (int nThreads : threadCounts) {
+        CCheckQueue<CScriptCheck> queue(128);
+        boost::thread_group threads;
+        StartWorkers(queue, threads, nThreads);
+        const int64_t nStart = GetTimeMicros();
+        BOOST_CHECK(VerifySpends(queue, prevOut, txs));
+        const int64_t nTime = GetTimeMicros() - nStart;
+        BOOST_TEST_MESSAGE(txs.size() << " script checks on " << nThreads << " threads: "
+                           << nTime / 1000.0 << "ms (" << nTime / (int64_t)txs.size() << "us/check)");
+        threads.interrupt_all();
+        threads.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #include "uint256.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
 #include <vector>
@@ -347,4 +348,120 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+BOOST_AUTO_TEST_CASE(coins_prefetch)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<uint256, CCoins> expected;
+    std::vector<uint256> txids;
+    {
+        CCoinsViewCache writer(&db);
+        for (int i = 0; i < 200; ++i) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vout.resize(2);
+            tx.vout[0].nValue = i;
+            tx.vout[1].nValue = 1000 + i;
+            tx.vout[1].scriptPubKey = CScript() << i << OP_DROP;
+            const uint256 txid = tx.GetHash();
+            writer.ModifyNewCoins(txid)->FromTx(tx, i);
+            expected[txid].FromTx(tx, i);
+            txids.push_back(txid);
+        }
+        writer.SetBestBlock(GetRandHash());
+        BOOST_CHECK(writer.Flush());
+    }
+
+    // ask for all of them, some twice and some that don't exist.
+    std::vector<uint256> request(txids.begin(), txids.begin() + 150);
+    request.push_back(txids[3]);
+    for (int i = 0; i < 20; ++i)
+        request.push_back(GetRandHash());
+
+    std::vector<std::pair<uint256, CCoins> > found;
+    db.BatchGetCoins(request, found);
+    BOOST_CHECK_EQUAL(found.size(), 150);
+    for (size_t i = 0; i < found.size(); ++i) {
+        BOOST_CHECK(found[i].second == expected[found[i].first]);
+    }
+
+    CCoinsViewCacheTest cache(&db);
+    BOOST_CHECK(cache.AccessCoins(txids[10]));
+    BOOST_CHECK_EQUAL(cache.PrefetchCoins(request), 149);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 150);
+    BOOST_CHECK_EQUAL(cache.PrefetchCoins(request), 0);
+    cache.SelfTest();
+
+    // a cache on top of a cache fills both.
+    CCoinsViewCacheTest cache2(&cache);
+    BOOST_CHECK_EQUAL(cache2.PrefetchCoins(txids), 200);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 200);
+    BOOST_FOREACH (const uint256 &txid, txids) {
+        BOOST_CHECK(cache2.HaveCoinsInCache(txid));
+        CCoins coins;
+        BOOST_CHECK(cache2.GetCoins(txid, coins));
+        BOOST_CHECK(coins == expected[txid]);
+    }
+    cache2.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_background_flush)
+{
+    CCoinsViewDB db(1 << 20, true);
+    db.SetBackgroundFlush(true);
+    std::vector<uint256> txids;
+    const uint256 block1 = GetRandHash();
+    {
+        CCoinsViewCache writer(&db);
+        for (int i = 0; i < 100; ++i) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = i;
+            writer.ModifyNewCoins(tx.GetHash())->FromTx(tx, i);
+            txids.push_back(tx.GetHash());
+        }
+        writer.SetBestBlock(block1);
+        BOOST_CHECK(writer.Flush());
+        BOOST_CHECK_EQUAL(writer.GetCacheSize(), 0);
+    }
+    // whether or not the write finished, the view already reflects it.
+    BOOST_CHECK(db.GetBestBlock() == block1);
+    BOOST_CHECK(db.HaveCoins(txids[0]));
+    std::vector<std::pair<uint256, CCoins> > found;
+    db.BatchGetCoins(txids, found);
+    BOOST_CHECK_EQUAL(found.size(), txids.size());
+
+    // spend half of them in the next write.
+    const uint256 block2 = GetRandHash();
+    {
+        CCoinsViewCache writer(&db);
+        for (int i = 0; i < 50; ++i) {
+            CCoinsModifier coins = writer.ModifyCoins(txids[i]);
+            coins->Spend(0);
+        }
+        // clean entries in the cache are not part of the write
+        for (int i = 50; i < 100; ++i)
+            BOOST_CHECK(writer.AccessCoins(txids[i]) != NULL);
+        writer.SetBestBlock(block2);
+        BOOST_CHECK(writer.Flush());
+    }
+    BOOST_CHECK(db.GetBestBlock() == block2);
+    for (int i = 0; i < 100; ++i) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(txids[i], coins), i >= 50);
+    }
+
+    BOOST_CHECK(db.WaitForFlush());
+    CCoinsFlushStats stats = db.GetFlushStats();
+    BOOST_CHECK_EQUAL(stats.nFlushes, 2);
+    BOOST_CHECK(!stats.fPending);
+
+    // and after switching back the database holds the same state.
+    db.SetBackgroundFlush(false);
+    BOOST_CHECK(db.GetBestBlock() == block2);
+    found.clear();
+    db.BatchGetCoins(txids, found);
+    BOOST_CHECK_EQUAL(found.size(), 50);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
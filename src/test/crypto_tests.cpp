@@ -11,6 +11,7 @@
 #include "crypto/hmac_sha512.h"
 #include "random.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "test/test_bitcoin.h"
 
 #include <vector>
@@ -255,6 +256,56 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    for (int blocks = 0; blocks <= 33; ++blocks) {
+        std::vector<unsigned char> in(64 * blocks), out1(32 * blocks), out2(32 * blocks);
+        for (size_t i = 0; i < in.size(); ++i)
+            in[i] = insecure_rand() & 0xff;
+        for (int i = 0; i < blocks; ++i) {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write(&in[64 * i], 64).Finalize(hash);
+            CSHA256().Write(hash, sizeof(hash)).Finalize(&out1[32 * i]);
+        }
+        if (blocks > 0)
+            SHA256D64(&out2[0], &in[0], blocks);
+        BOOST_CHECK(out1 == out2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64_timing)
+{
+    // Speed of the selected implementation against double hashing every input on its own.
+    if (!TimingTestsEnabled())
+        return;
+    const std::string implementation = SHA256AutoDetect();
+    const int nBlocks = 1024;
+    const int nRounds = 200;
+    std::vector<unsigned char> in(64 * nBlocks), out(32 * nBlocks), outBatched(32 * nBlocks);
+    for (size_t i = 0; i < in.size(); ++i)
+        in[i] = insecure_rand() & 0xff;
+
+    int64_t nStart = GetTimeMicros();
+    for (int round = 0; round < nRounds; ++round) {
+        for (int i = 0; i < nBlocks; ++i) {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write(&in[64 * i], 64).Finalize(hash);
+            CSHA256().Write(hash, sizeof(hash)).Finalize(&out[32 * i]);
+        }
+    }
+    const int64_t nSingle = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int round = 0; round < nRounds; ++round)
+        SHA256D64(&outBatched[0], &in[0], nBlocks);
+    const int64_t nBatched = GetTimeMicros() - nStart;
+    BOOST_CHECK(out == outBatched);
+
+    BOOST_TEST_MESSAGE("SHA256 implementation '" << implementation << "', double SHA256 of 64 bytes: "
+                       << nSingle * 1000.0 / (nBlocks * nRounds) << "ns one by one, "
+                       << nBatched * 1000.0 / (nBlocks * nRounds) << "ns batched");
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
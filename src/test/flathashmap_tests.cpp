@@ -0,0 +1,210 @@
+// Copyright (c) 2017 The Bitcoin Classic developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "flathashmap.h"
+#include "random.h"
+#include "uint256.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <set>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
+
+typedef FlatHashMap<uint256, int, Blocks::BlockHashShortener> TestMap;
+
+BOOST_FIXTURE_TEST_SUITE(flathashmap_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(flathashmap_basics)
+{
+    TestMap map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    const uint256 a = GetRandHash();
+    const uint256 b = GetRandHash();
+    BOOST_CHECK(map.find(a) == map.end());
+
+    std::pair<TestMap::iterator, bool> ret = map.insert(std::make_pair(a, 1));
+    BOOST_CHECK(ret.second);
+    BOOST_CHECK(ret.first->first == a);
+    BOOST_CHECK_EQUAL(ret.first->second, 1);
+    ret = map.insert(std::make_pair(a, 2));
+    BOOST_CHECK(!ret.second);
+    BOOST_CHECK_EQUAL(ret.first->second, 1);
+
+    map[b] = 5;
+    BOOST_CHECK_EQUAL(map.size(), 2);
+    BOOST_CHECK_EQUAL(map.find(b)->second, 5);
+    BOOST_CHECK_EQUAL(map.count(a), 1);
+
+    map.erase(map.find(a));
+    BOOST_CHECK_EQUAL(map.size(), 1);
+    BOOST_CHECK(map.find(a) == map.end());
+    BOOST_CHECK_EQUAL(map.erase(a), 0);
+    BOOST_CHECK_EQUAL(map.erase(b), 1);
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+
+    map[a] = 3;
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_random)
+{
+    TestMap map;
+    std::map<uint256, int> real;
+    std::vector<uint256> keys;
+    for (int i = 0; i < 1000; ++i)
+        keys.push_back(GetRandHash());
+
+    std::map<uint256, const int*> pointers;
+    for (int i = 0; i < 40000; ++i) {
+        const uint256 &key = keys[insecure_rand() % keys.size()];
+        const int action = insecure_rand() % 3;
+        if (action == 0) {
+            std::pair<TestMap::iterator, bool> ret = map.insert(std::make_pair(key, i));
+            BOOST_CHECK_EQUAL(ret.second, real.insert(std::make_pair(key, i)).second);
+            if (ret.second)
+                pointers[key] = &ret.first->second;
+        } else if (action == 1) {
+            BOOST_CHECK_EQUAL(map.erase(key), real.erase(key));
+            pointers.erase(key);
+        } else {
+            TestMap::const_iterator it = map.find(key);
+            std::map<uint256, int>::const_iterator realIt = real.find(key);
+            BOOST_CHECK_EQUAL(it == map.end(), realIt == real.end());
+            if (realIt != real.end()) {
+                BOOST_CHECK_EQUAL(it->second, realIt->second);
+                // entries never move
+                BOOST_CHECK_EQUAL(&it->second, pointers[key]);
+            }
+        }
+        BOOST_CHECK_EQUAL(map.size(), real.size());
+    }
+
+    size_t count = 0;
+    for (TestMap::iterator it = map.begin(); it != map.end(); ++it) {
+        BOOST_CHECK_EQUAL(real[it->first], it->second);
+        ++count;
+    }
+    BOOST_CHECK_EQUAL(count, real.size());
+
+    // erase while iterating, like CCoinsViewDB::BatchWrite does.
+    for (TestMap::iterator it = map.begin(); it != map.end();) {
+        TestMap::iterator itOld = it++;
+        map.erase(itOld);
+    }
+    BOOST_CHECK(map.empty());
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_reuse_erased)
+{
+    // Erased entries leave their arena slot on the free list, a map that keeps
+    // replacing its entries does not grow.
+    TestMap map;
+    std::vector<uint256> keys;
+    for (int i = 0; i < 1000; ++i) {
+        keys.push_back(GetRandHash());
+        map.insert(std::make_pair(keys.back(), i));
+    }
+    BOOST_CHECK_EQUAL(map.erase(keys[0]), 1);
+    map.insert(std::make_pair(keys[0], 0));
+    const size_t usage = map.DynamicMemoryUsage();
+    for (int round = 0; round < 10; ++round) {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            BOOST_CHECK_EQUAL(map.erase(keys[i]), 1);
+            keys[i] = GetRandHash();
+            map.insert(std::make_pair(keys[i], round));
+        }
+    }
+    BOOST_CHECK_EQUAL(map.size(), keys.size());
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), usage);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        BOOST_CHECK_EQUAL(map.find(keys[i])->second, 9);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_memory)
+{
+    // The same coins cache entries take less memory than in a node based map.
+    CCoinsMap flat;
+    boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> nodes;
+    for (int i = 0; i < 10000; ++i) {
+        const uint256 key = GetRandHash();
+        flat.insert(std::make_pair(key, CCoinsCacheEntry()));
+        nodes.insert(std::make_pair(key, CCoinsCacheEntry()));
+    }
+    BOOST_CHECK(memusage::DynamicUsage(flat) < memusage::DynamicUsage(nodes));
+}
+
+// Looks every key up in map and returns the microseconds it took.
+template <typename Map>
+static int64_t TimeLookups(const Map &map, const std::vector<uint256> &keys, size_t *found)
+{
+    const int64_t nStart = GetTimeMicros();
+    for (size_t i = 0; i < keys.size(); ++i)
+        *found += map.count(keys[i]);
+    return GetTimeMicros() - nStart;
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_measure)
+{
+    // Coins cache entries per MiB and lookup latency of a million entry cache,
+    // against the node based map it replaced.
+    if (!TimingTestsEnabled())
+        return;
+    const int nEntries = 1000000;
+    std::vector<uint256> keys;
+    keys.reserve(nEntries);
+    CCoinsMap flat;
+    boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> nodes;
+    for (int i = 0; i < nEntries; ++i) {
+        keys.push_back(GetRandHash());
+        flat.insert(std::make_pair(keys.back(), CCoinsCacheEntry()));
+        nodes.insert(std::make_pair(keys.back(), CCoinsCacheEntry()));
+    }
+    // half hits, in a different order than inserted, and half misses
+    std::vector<uint256> lookups;
+    lookups.reserve(nEntries);
+    for (int i = 0; i < nEntries / 2; ++i) {
+        lookups.push_back(keys[insecure_rand() % keys.size()]);
+        lookups.push_back(GetRandHash());
+    }
+
+    size_t nFlatFound = 0, nNodesFound = 0;
+    const int64_t nFlat = TimeLookups(flat, lookups, &nFlatFound);
+    const int64_t nNodes = TimeLookups(nodes, lookups, &nNodesFound);
+    BOOST_CHECK_EQUAL(nFlatFound, nNodesFound);
+    BOOST_CHECK_EQUAL(nFlatFound, lookups.size() / 2);
+
+    const double mib = 1024.0 * 1024.0;
+    BOOST_TEST_MESSAGE("Coins cache of " << nEntries << " entries: FlatHashMap "
+                       << (int64_t)(nEntries * mib / memusage::DynamicUsage(flat)) << " entries/MiB, "
+                       << nFlat * 1000.0 / lookups.size() << "ns per lookup; boost::unordered_map "
+                       << (int64_t)(nEntries * mib / memusage::DynamicUsage(nodes)) << " entries/MiB, "
+                       << nNodes * 1000.0 / lookups.size() << "ns per lookup");
+}
+
+BOOST_AUTO_TEST_CASE(salted_txid_hasher)
+{
+    // Ids that agree in the bits the unsalted shortener uses still spread over the buckets.
+    SaltedTxidHasher hasher;
+    std::set<size_t> buckets;
+    for (int i = 0; i < 1000; ++i) {
+        uint256 txid = GetRandHash();
+        memset(txid.begin(), 0, 8);
+        BOOST_CHECK_EQUAL(Blocks::BlockHashShortener()(txid), 0);
+        BOOST_CHECK_EQUAL(SaltedTxidHasher()(txid), hasher(txid));
+        buckets.insert(hasher(txid) & 0xFFFF);
+    }
+    BOOST_CHECK(buckets.size() > 900);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
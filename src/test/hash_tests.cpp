@@ -47,4 +47,26 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // the reference vectors with key 00 01 .. 0f and message 00 01 .. of the given length
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1, 2, 3, 4, 5, 6, 7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+
+    // the specialized versions hash the same as the generic one
+    const uint256 val = uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    CSipHasher words(1, 2);
+    words.Write(val.GetUint64(0)).Write(val.GetUint64(1)).Write(val.GetUint64(2)).Write(val.GetUint64(3));
+    BOOST_CHECK_EQUAL(SipHashUint256(1, 2, val), words.Finalize());
+    static const unsigned char extra[4] = {0x78, 0x56, 0x34, 0x12};
+    words.Write(extra, 4);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(1, 2, val, 0x12345678), words.Finalize());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
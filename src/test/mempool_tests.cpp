@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -9,6 +10,7 @@
 
 #include <boost/test/unit_test.hpp>
 #include <list>
+#include <set>
 #include <vector>
 
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
@@ -102,6 +104,173 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // A chain of three transactions, each spending the previous one
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0)
+            tx[i].vin[0].prevout = COutPoint(tx[i - 1].GetHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = (10 - i) * COIN;
+        pool.addUnchecked(tx[i].GetHash(), entry.Fee(1000 * (i + 1)).FromTx(tx[i]));
+    }
+    const uint64_t txSize = ::GetSerializeSize(tx[2], SER_NETWORK, PROTOCOL_VERSION);
+
+    CTxMemPool::txiter it = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), 3 * txSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 6000);
+    BOOST_CHECK_EQUAL(it->GetSigOpCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetCountWithAncestors(), 1);
+
+    // Fee deltas count for every descendant
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0, 500);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[1].GetHash())->GetModFeesWithAncestors(), 3500);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[2].GetHash())->GetModFeesWithAncestors(), 6500);
+
+    // The highest ancestor feerate comes first
+    BOOST_CHECK(pool.mapTx.get<4>().begin()->GetTx().GetHash() == tx[2].GetHash());
+
+    // Confirming the first one leaves its descendants with one ancestor less
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx[0]));
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    it = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), 2 * txSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 5000);
+    BOOST_CHECK_EQUAL(it->GetSigOpCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[1].GetHash())->GetCountWithAncestors(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLinksTest)
+{
+    // A parent with three children, more than fit in the inline links
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(4);
+    for (int i = 0; i < 4; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    CMutableTransaction txChild[3];
+    for (int i = 0; i < 3; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+        pool.addUnchecked(txChild[i].GetHash(), entry.FromTx(txChild[i]));
+    }
+
+    CTxMemPool::txiter parentIt = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(parentIt).size(), 0);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(parentIt).size(), 3);
+    for (int i = 0; i < 3; i++) {
+        CTxMemPool::txiter childIt = pool.mapTx.find(txChild[i].GetHash());
+        BOOST_CHECK_EQUAL(pool.GetMemPoolParents(childIt).size(), 1);
+        BOOST_CHECK(pool.GetIter(pool.GetMemPoolParents(childIt)[0]) == parentIt);
+        BOOST_CHECK_EQUAL(pool.mapNextTx.count(COutPoint(txParent.GetHash(), i)), 1);
+    }
+    BOOST_CHECK_EQUAL(pool.mapNextTx.count(COutPoint(txParent.GetHash(), 3)), 0);
+
+    // The outputs spent in the mempool are pruned from the coins
+    CCoins coins(txParent, 1);
+    pool.pruneSpent(txParent.GetHash(), coins);
+    BOOST_CHECK(!coins.IsAvailable(0));
+    BOOST_CHECK(!coins.IsAvailable(2));
+    BOOST_CHECK(coins.IsAvailable(3));
+
+    // Removing a child unlinks it from its parent
+    std::list<CTransaction> removed;
+    pool.remove(txChild[1], removed, false);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(parentIt).size(), 2);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.count(COutPoint(txParent.GetHash(), 1)), 0);
+
+    // and confirming the parent unlinks the remaining children
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(txParent));
+    pool.removeForBlock(vtx, 1, removed);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(pool.mapTx.find(txChild[0].GetHash())).size(), 0);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(pool.mapTx.find(txChild[2].GetHash())).size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolMemoryUsage)
+{
+    // Adds chains of transactions and removes them again for a block. With
+    // TEST_BITCOIN_TIMING set it does so on a large pool and reports the memory
+    // used per transaction and the time taken.
+    const uint32_t nChains = TimingTestsEnabled() ? 20000 : 200;
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    std::vector<CTransactionRef> vtx;
+    const uint256 funding = GetRandHash();
+    int64_t nStart = GetTimeMicros();
+    for (uint32_t i = 0; i < nChains; ++i) {
+        // chains of five transactions
+        uint256 prevHash = funding;
+        uint32_t prevN = i;
+        for (int j = 0; j < 5; ++j) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(prevHash, prevN);
+            tx.vin[0].scriptSig = CScript() << OP_11;
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[0].nValue = 11000LL;
+            pool.addUnchecked(tx.GetHash(), entry.Fee(1000).FromTx(tx));
+            vtx.push_back(MakeTransactionRef(tx));
+            prevHash = tx.GetHash();
+            prevN = 0;
+        }
+    }
+    const int64_t nAdd = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(pool.size(), nChains * 5);
+    const size_t nUsage = pool.DynamicMemoryUsage();
+
+    nStart = GetTimeMicros();
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    const int64_t nRemove = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 0);
+    if (TimingTestsEnabled())
+        BOOST_TEST_MESSAGE("Mempool of " << nChains * 5 << " transactions: " << nUsage / (nChains * 5) << " bytes per transaction, "
+                           << nAdd / 1000.0 << "ms to add, " << nRemove / 1000.0 << "ms to remove for a block");
+}
+
+BOOST_AUTO_TEST_CASE(MempoolOutpointHasher)
+{
+    // The outputs of one transaction spread over the buckets, and every
+    // hasher is keyed on its own.
+    SaltedOutpointHasher hasher, other;
+    const uint256 txid = GetRandHash();
+    std::set<size_t> buckets;
+    int nSame = 0;
+    for (uint32_t n = 0; n < 1000; ++n) {
+        const COutPoint out(txid, n);
+        BOOST_CHECK_EQUAL(hasher(out), hasher(out));
+        buckets.insert(hasher(out) & 0xFFFF);
+        nSame += hasher(out) == other(out);
+    }
+    BOOST_CHECK(buckets.size() > 900);
+    BOOST_CHECK(nSame < 10);
+}
+
 template<int index>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
 {
@@ -434,7 +603,9 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
         pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    // should maximize mempool size by only removing 5/7. Only the entries halve,
+    // the bucket arrays of mapNextTx and the short id index keep their size.
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 6 / 10);
     BOOST_CHECK(pool.exists(tx4.GetHash()));
     BOOST_CHECK(!pool.exists(tx5.GetHash()));
     BOOST_CHECK(pool.exists(tx6.GetHash()));
@@ -443,7 +614,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
     std::list<CTransaction> conflicts;
     SetMockTime(42);
     SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
@@ -473,4 +644,36 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolTrimNoSpendsRemaining)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+
+    // two transactions spending different outputs of the same confirmed transaction
+    const uint256 confirmed = GetRandHash();
+    CMutableTransaction cheap;
+    cheap.vin.resize(1);
+    cheap.vin[0].prevout = COutPoint(confirmed, 0);
+    cheap.vin[0].scriptSig = CScript() << OP_1;
+    cheap.vout.resize(1);
+    cheap.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    cheap.vout[0].nValue = COIN;
+    CMutableTransaction paying = cheap;
+    paying.vin[0].prevout = COutPoint(confirmed, 1);
+    pool.addUnchecked(cheap.GetHash(), entry.Fee(1000LL).FromTx(cheap, &pool));
+    pool.addUnchecked(paying.GetHash(), entry.Fee(50000LL).FromTx(paying, &pool));
+
+    // the other output of the confirmed transaction is still spent, so its coins stay cached
+    std::vector<uint256> vNoSpendsRemaining;
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, &vNoSpendsRemaining);
+    BOOST_CHECK(!pool.exists(cheap.GetHash()));
+    BOOST_CHECK(pool.exists(paying.GetHash()));
+    BOOST_CHECK(vNoSpendsRemaining.empty());
+
+    pool.TrimToSize(0, &vNoSpendsRemaining);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(vNoSpendsRemaining.size(), 1);
+    BOOST_CHECK(vNoSpendsRemaining[0] == confirmed);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
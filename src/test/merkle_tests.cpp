@@ -5,6 +5,7 @@
 #include "consensus/merkle.h"
 #include "test/test_bitcoin.h"
 #include "random.h"
+#include "utiltime.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -15,8 +16,8 @@ static uint256 BlockBuildMerkleTree(const CBlock& block, bool* fMutated, std::ve
 {
     vMerkleTree.clear();
     vMerkleTree.reserve(block.vtx.size() * 2 + 16); // Safe upper bound for the number of total nodes.
-    for (std::vector<CTransaction>::const_iterator it(block.vtx.begin()); it != block.vtx.end(); ++it)
-        vMerkleTree.push_back(it->GetHash());
+    for (std::vector<CTransactionRef>::const_iterator it(block.vtx.begin()); it != block.vtx.end(); ++it)
+        vMerkleTree.push_back((*it)->GetHash());
     int j = 0;
     bool mutated = false;
     for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
@@ -86,7 +87,7 @@ BOOST_AUTO_TEST_CASE(merkle_test)
             for (int j = 0; j < ntx; j++) {
                 CMutableTransaction mtx;
                 mtx.nLockTime = j;
-                block.vtx[j] = mtx;
+                block.vtx[j] = MakeTransactionRef(std::move(mtx));
             }
             // Compute the root of the block before mutating it.
             bool unmutatedMutated = false;
@@ -115,6 +116,22 @@ BOOST_AUTO_TEST_CASE(merkle_test)
             BOOST_CHECK((newRoot == uint256()) == (ntx == 0));
             BOOST_CHECK(oldMutated == newMutated);
             BOOST_CHECK(newMutated == !!mutate);
+            // Compute it again with a third of the leaves missing at first.
+            std::vector<uint256> leaves(block.vtx.size());
+            std::vector<uint32_t> missing;
+            for (size_t j = 0; j < block.vtx.size(); j++) {
+                if (insecure_rand() % 3 == 0)
+                    missing.push_back(j);
+                else
+                    leaves[j] = block.vtx[j]->GetHash();
+            }
+            IncompleteMerkleTree incompleteTree(leaves);
+            BOOST_FOREACH (uint32_t pos, missing) {
+                incompleteTree.setLeaf(pos, block.vtx[pos]->GetHash());
+            }
+            bool incompleteMutated = false;
+            BOOST_CHECK(incompleteTree.root(&incompleteMutated) == newRoot);
+            BOOST_CHECK(incompleteMutated == newMutated);
             // If no mutation was done (once for every ntx value), try up to 16 branches.
             if (mutate == 0) {
                 for (int loop = 0; loop < std::min(ntx, 16); loop++) {
@@ -126,11 +143,66 @@ BOOST_AUTO_TEST_CASE(merkle_test)
                     std::vector<uint256> newBranch = BlockMerkleBranch(block, mtx);
                     std::vector<uint256> oldBranch = BlockGetMerkleBranch(block, merkleTree, mtx);
                     BOOST_CHECK(oldBranch == newBranch);
-                    BOOST_CHECK(ComputeMerkleRootFromBranch(block.vtx[mtx].GetHash(), newBranch, mtx) == oldRoot);
+                    BOOST_CHECK(ComputeMerkleRootFromBranch(block.vtx[mtx]->GetHash(), newBranch, mtx) == oldRoot);
                 }
             }
         }
     }
 }
 
+// The merkle root computed one node pair at a time.
+static uint256 PairwiseMerkleRoot(std::vector<uint256> level)
+{
+    while (level.size() > 1) {
+        if (level.size() & 1)
+            level.push_back(level.back());
+        for (size_t i = 0; i < level.size() / 2; ++i)
+            CHash256().Write(level[2 * i].begin(), 32).Write(level[2 * i + 1].begin(), 32).Finalize(level[i].begin());
+        level.resize(level.size() / 2);
+    }
+    return level[0];
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_batched)
+{
+    // Levels of odd and even length, wider than the batches the hashing works in.
+    const int leafCounts[] = {1000, 1001, 4097};
+    for (int nLeaves : leafCounts) {
+        std::vector<uint256> leaves(nLeaves);
+        for (int i = 0; i < nLeaves; ++i)
+            leaves[i] = GetRandHash();
+        bool mutated;
+        BOOST_CHECK(ComputeMerkleRoot(leaves, &mutated) == PairwiseMerkleRoot(leaves));
+        BOOST_CHECK(!mutated);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_timing)
+{
+    // Merkle roots of large trees, batched against one node pair at a time.
+    if (!TimingTestsEnabled())
+        return;
+    const int leafCounts[] = {100000, 1000000};
+    for (int nLeaves : leafCounts) {
+        std::vector<uint256> leaves(nLeaves);
+        for (int i = 0; i < nLeaves; ++i)
+            leaves[i] = GetRandHash();
+
+        int64_t nStart = GetTimeMicros();
+        const uint256 pairwise = PairwiseMerkleRoot(leaves);
+        const int64_t nPairwise = GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        std::vector<uint256> hashes;
+        hashes.reserve(nLeaves + 1);
+        hashes.assign(leaves.begin(), leaves.end());
+        const uint256 root = ComputeMerkleRoot(std::move(hashes));
+        const int64_t nBatched = GetTimeMicros() - nStart;
+
+        BOOST_CHECK(root == pairwise);
+        BOOST_TEST_MESSAGE("Merkle root of " << nLeaves << " leaves: " << nPairwise / 1000.0
+                           << "ms pairwise, " << nBatched / 1000.0 << "ms batched");
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
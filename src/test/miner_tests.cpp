@@ -7,9 +7,11 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "script/interpreter.h"
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
@@ -102,17 +104,17 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         CBlock *pblock = &pblocktemplate->block; // pointer for convenience
         pblock->nVersion = 1;
         pblock->nTime = chainActive.Tip()->GetMedianTimePast()+1;
-        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        CMutableTransaction txCoinbase(*pblock->vtx[0]);
         txCoinbase.nVersion = 1;
         txCoinbase.vin[0].scriptSig = CScript();
         txCoinbase.vin[0].scriptSig.push_back(blockinfo[i].extranonce);
         txCoinbase.vin[0].scriptSig.push_back(chainActive.Height());
         txCoinbase.vout[0].scriptPubKey = CScript();
-        pblock->vtx[0] = CTransaction(txCoinbase);
+        pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
         if (txFirst.size() == 0)
             baseheight = chainActive.Height();
         if (txFirst.size() < 4)
-            txFirst.push_back(new CTransaction(pblock->vtx[0]));
+            txFirst.push_back(new CTransaction(*pblock->vtx[0]));
         pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
         pblock->nNonce = blockinfo[i].nonce;
         CValidationState state;
@@ -387,6 +389,12 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 
     BOOST_CHECK(pblocktemplate = miner.CreateNewBlock(chainparams));
     BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 5);
+    // the template refers to the mempool's transactions instead of copying them
+    for (size_t i = 1; i < pblocktemplate->block.vtx.size(); ++i) {
+        const CTransactionRef &ptx = pblocktemplate->block.vtx[i];
+        BOOST_CHECK(ptx == mempool.get(ptx->GetHash()));
+        BOOST_CHECK(ptx.use_count() > 1);
+    }
     delete pblocktemplate;
 
     chainActive.Tip()->nHeight--;
@@ -399,4 +407,271 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+static CMutableTransaction SpendFirstOutput(const CTransaction &prev, const CKey &key)
+{
+    const CTxOut &prevOut = prev.vout[0];
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = prevOut.nValue - CENT;
+    tx.vout[0].scriptPubKey = prevOut.scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(prevOut.scriptPubKey, tx, 0, prevOut.nValue, SIGHASH_ALL | SIGHASH_FORKID, SCRIPT_ENABLE_SIGHASH_FORKID);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL + SIGHASH_FORKID);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+static bool ToMemPool(const CMutableTransaction &tx)
+{
+    CValidationState state;
+    return AcceptToMemoryPool(mempool, state, tx, false, NULL, true, false);
+}
+
+static std::set<uint256> TemplateTxids(const CBlockTemplate &blocktemplate)
+{
+    std::set<uint256> txids;
+    for (size_t i = 1; i < blocktemplate.block.vtx.size(); ++i)
+        txids.insert(blocktemplate.block.vtx[i]->GetHash());
+    return txids;
+}
+
+static CMutableTransaction FakeSpend(const uint256 &prevHash, uint32_t n = 0)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prevHash, n);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_incremental, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey); // mature the second coinbase
+    // Parts of this test turn the template check off, the caller's setting is put back after each.
+    const bool fTemplateCheckSet = mapArgs.count("-blocktemplatecheck") > 0;
+    const std::string strTemplateCheck = GetArg("-blocktemplatecheck", "");
+    auto restoreTemplateCheck = [&]() {
+        if (fTemplateCheckSet)
+            mapArgs["-blocktemplatecheck"] = strTemplateCheck;
+        else
+            mapArgs.erase("-blocktemplatecheck");
+    };
+    LOCK(cs_main);
+
+    Mining miner;
+    miner.SetCoinbase(scriptPubKey);
+    std::unique_ptr<CBlockTemplate> pblocktemplate(miner.CreateNewBlock(chainparams));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+
+    // transactions entering the mempool after the previous template get added to it
+    const CMutableTransaction parent = SpendFirstOutput(coinbaseTxns[0], coinbaseKey);
+    const CMutableTransaction other = SpendFirstOutput(coinbaseTxns[1], coinbaseKey);
+    const CMutableTransaction child = SpendFirstOutput(parent, coinbaseKey);
+    BOOST_CHECK(ToMemPool(parent));
+    BOOST_CHECK(ToMemPool(other));
+    BOOST_CHECK(ToMemPool(child));
+    pblocktemplate.reset(miner.CreateNewBlock(chainparams));
+    const std::vector<CTransactionRef> &vtx = pblocktemplate->block.vtx;
+    BOOST_CHECK_EQUAL(vtx.size(), 4);
+    const auto parentPos = std::find_if(vtx.begin(), vtx.end(), [&](const CTransactionRef &tx) { return tx->GetHash() == parent.GetHash(); });
+    const auto childPos = std::find_if(vtx.begin(), vtx.end(), [&](const CTransactionRef &tx) { return tx->GetHash() == child.GetHash(); });
+    BOOST_CHECK(parentPos < childPos);
+    BOOST_CHECK(childPos != vtx.end());
+
+    // which is what a template built from scratch contains too
+    Mining fresh;
+    fresh.SetCoinbase(scriptPubKey);
+    std::unique_ptr<CBlockTemplate> freshTemplate(fresh.CreateNewBlock(chainparams));
+    BOOST_CHECK(TemplateTxids(*pblocktemplate) == TemplateTxids(*freshTemplate));
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], freshTemplate->vTxFees[0]);
+
+    // a free transaction with enough priority goes into the priority area of both
+    // The transaction spends an output that does not exist, so TestBlockValidity() would
+    // reject both templates. Only the selection is compared here.
+    mapArgs["-blocktemplatecheck"] = "0";
+    CMutableTransaction highPriority = FakeSpend(GetRandHash());
+    TestMemPoolEntryHelper entry;
+    mempool.addUnchecked(highPriority.GetHash(), entry.Fee(0).Priority(1e12).FromTx(highPriority));
+    pblocktemplate.reset(miner.CreateNewBlock(chainparams));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 5);
+    Mining freshPriority;
+    freshPriority.SetCoinbase(scriptPubKey);
+    freshTemplate.reset(freshPriority.CreateNewBlock(chainparams));
+    BOOST_CHECK(TemplateTxids(*pblocktemplate) == TemplateTxids(*freshTemplate));
+    BOOST_CHECK(freshTemplate->block.vtx[1]->GetHash() == highPriority.GetHash());
+    std::list<CTransaction> removed;
+    mempool.remove(highPriority, removed, true);
+    restoreTemplateCheck();
+
+    // transactions leaving the mempool leave the template, children included
+    removed.clear();
+    mempool.remove(parent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    pblocktemplate.reset(miner.CreateNewBlock(chainparams));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == other.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -CENT);
+
+    // the validity check of the template can be skipped
+    mapArgs["-blocktemplatecheck"] = "0";
+    BOOST_CHECK(ToMemPool(parent));
+    pblocktemplate.reset(miner.CreateNewBlock(chainparams));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    restoreTemplateCheck();
+
+    // a new tip means a new template
+    std::vector<CMutableTransaction> blockTxns;
+    blockTxns.push_back(other);
+    blockTxns.push_back(parent);
+    const CBlock block = CreateAndProcessBlock(blockTxns, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    pblocktemplate.reset(miner.CreateNewBlock(chainparams));
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == block.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_packages)
+{
+    // The inputs are made up, so skip validating the templates
+    mapArgs["-blocktemplatecheck"] = "0";
+    mapArgs["-blockprioritysize"] = "0";
+    TestMemPoolEntryHelper entry;
+
+    // a parent paying nothing only gets in when its child pays for it
+    CMutableTransaction parent = FakeSpend(GetRandHash());
+    CMutableTransaction other = FakeSpend(GetRandHash());
+    mempool.addUnchecked(parent.GetHash(), entry.Fee(0).FromTx(parent));
+    mempool.addUnchecked(other.GetHash(), entry.Fee(5000).FromTx(other));
+
+    Mining miner;
+    miner.SetCoinbase(CScript() << OP_TRUE);
+    std::unique_ptr<CBlockTemplate> pblocktemplate(miner.CreateNewBlock(Params()));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == other.GetHash());
+
+    // the package feerate of parent and child beats the other transaction
+    CMutableTransaction child = FakeSpend(parent.GetHash());
+    mempool.addUnchecked(child.GetHash(), entry.Fee(20000).FromTx(child));
+    pblocktemplate.reset(miner.CreateNewBlock(Params()));
+    const std::vector<CTransactionRef> &vtx = pblocktemplate->block.vtx;
+    BOOST_CHECK_EQUAL(vtx.size(), 4);
+    BOOST_CHECK(vtx[1]->GetHash() == parent.GetHash());
+    BOOST_CHECK(vtx[2]->GetHash() == child.GetHash());
+    BOOST_CHECK(vtx[3]->GetHash() == other.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -25000);
+
+    mempool.clear();
+    mapArgs.erase("-blocktemplatecheck");
+    mapArgs.erase("-blockprioritysize");
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_prioritise)
+{
+    mapArgs["-blocktemplatecheck"] = "0";
+    mapArgs["-blockprioritysize"] = "0";
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction free = FakeSpend(GetRandHash());
+    CMutableTransaction other = FakeSpend(GetRandHash());
+    mempool.addUnchecked(free.GetHash(), entry.Fee(0).FromTx(free));
+    mempool.addUnchecked(other.GetHash(), entry.Fee(5000).FromTx(other));
+
+    Mining miner;
+    miner.SetCoinbase(CScript() << OP_TRUE);
+    std::unique_ptr<CBlockTemplate> pblocktemplate(miner.CreateNewBlock(Params()));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    // a fee delta on a transaction already in the pool changes the next template
+    mempool.PrioritiseTransaction(free.GetHash(), free.GetHash().ToString(), 0, 10000);
+    pblocktemplate.reset(miner.CreateNewBlock(Params()));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == free.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -5000);
+
+    mempool.PrioritiseTransaction(other.GetHash(), other.GetHash().ToString(), 0, -5000);
+    pblocktemplate.reset(miner.CreateNewBlock(Params()));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == free.GetHash());
+
+    mempool.ClearPrioritisation(free.GetHash());
+    mempool.ClearPrioritisation(other.GetHash());
+    mempool.clear();
+    mapArgs.erase("-blocktemplatecheck");
+    mapArgs.erase("-blockprioritysize");
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_package_timing)
+{
+    // Fills the mempool with 100000 transactions, half of them parents that only
+    // their children pay for, and compares the time and fees of package selection
+    // against selecting on each transaction's own feerate.
+    if (!TimingTestsEnabled())
+        return;
+    mapArgs["-blocktemplatecheck"] = "0";
+    mapArgs["-blockprioritysize"] = "0";
+    mapArgs["-blockmaxsize"] = "1000000";
+    TestMemPoolEntryHelper entry;
+    const uint256 funding = GetRandHash();
+    for (int64_t i = 0; i < 25000; ++i) {
+        CMutableTransaction parent = FakeSpend(funding, 3 * i);
+        CMutableTransaction child = FakeSpend(parent.GetHash());
+        CMutableTransaction other = FakeSpend(funding, 3 * i + 1);
+        CMutableTransaction lone = FakeSpend(funding, 3 * i + 2);
+        mempool.addUnchecked(parent.GetHash(), entry.Fee(0).FromTx(parent));
+        mempool.addUnchecked(child.GetHash(), entry.Fee(1000 + (i * 7919) % 20000).FromTx(child));
+        mempool.addUnchecked(other.GetHash(), entry.Fee(1000 + (i * 104729) % 10000).FromTx(other));
+        mempool.addUnchecked(lone.GetHash(), entry.Fee(1000 + (i * 1299709) % 5000).FromTx(lone));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 100000);
+
+    int64_t nStart = GetTimeMicros();
+    CAmount nScoreFees = 0;
+    {
+        // what a selection on the transactions' own feerate ends up with
+        LOCK(mempool.cs);
+        CTxMemPool::setEntries inBlock;
+        uint64_t nBlockSize = 1000;
+        for (auto mi = mempool.mapTx.get<3>().begin(); mi != mempool.mapTx.get<3>().end(); ++mi) {
+            CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+            if (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(iter->GetTxSize()))
+                break;
+            bool fOrphan = false;
+            BOOST_FOREACH(const CTxMemPoolEntry *parent, mempool.GetMemPoolParents(iter))
+                fOrphan |= !inBlock.count(mempool.GetIter(parent));
+            if (fOrphan || nBlockSize + iter->GetTxSize() >= 1000000)
+                continue;
+            inBlock.insert(iter);
+            nBlockSize += iter->GetTxSize();
+            nScoreFees += iter->GetFee();
+        }
+    }
+    const int64_t nScore = GetTimeMicros() - nStart;
+
+    Mining miner;
+    miner.SetCoinbase(CScript() << OP_TRUE);
+    nStart = GetTimeMicros();
+    std::unique_ptr<CBlockTemplate> pblocktemplate(miner.CreateNewBlock(Params()));
+    const int64_t nPackage = GetTimeMicros() - nStart;
+    const CAmount nPackageFees = -pblocktemplate->vTxFees[0];
+
+    BOOST_CHECK(nPackageFees > nScoreFees);
+    BOOST_TEST_MESSAGE("Block template from " << mempool.size() << " transactions: "
+                       << nScore / 1000.0 << "ms for " << nScoreFees << " fees by own feerate, "
+                       << nPackage / 1000.0 << "ms for " << nPackageFees << " fees by package");
+
+    mempool.clear();
+    mapArgs.erase("-blocktemplatecheck");
+    mapArgs.erase("-blockprioritysize");
+    mapArgs.erase("-blockmaxsize");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,358 @@
+// Copyright (c) 2017 The Bitcoin Classic developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "netbase.h"
+#include "protocol.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <future>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+static std::string QueuedBytes(const CNode &node)
+{
+    std::string answer;
+    for (size_t i = 0; i < node.vSendMsg.size(); ++i) {
+        answer.append(node.vSendMsg[i].begin(), node.vSendMsg[i].end());
+    }
+    return answer;
+}
+
+// Queues a message that is never sent on the invalid socket, the messages after it stay queued.
+static void HoldSendQueue(CNode &node)
+{
+    node.PushMessage(NetMsgType::VERACK);
+    node.fDisconnect = false;
+}
+
+// The payloads of the queued messages with this command.
+static std::vector<CDataStream> QueuedMessages(const CNode &node, const std::string &command)
+{
+    std::vector<CDataStream> answer;
+    const std::string bytes = QueuedBytes(node);
+    CDataStream stream(bytes.data(), bytes.data() + bytes.size(), SER_NETWORK, PROTOCOL_VERSION);
+    while (!stream.empty()) {
+        CMessageHeader hdr(Params().MessageStart());
+        stream >> hdr;
+        if (hdr.GetCommand() == command)
+            answer.push_back(CDataStream(stream.begin(), stream.begin() + hdr.nMessageSize, SER_NETWORK, PROTOCOL_VERSION));
+        stream.ignore(hdr.nMessageSize);
+    }
+    return answer;
+}
+
+static void ReceiveMessage(CNode &node, const char *command, const CDataStream &payload)
+{
+    CMessageHeader hdr(Params().MessageStart(), command, payload.size());
+    const uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream message(SER_NETWORK, PROTOCOL_VERSION);
+    message << hdr;
+    message += payload;
+    LOCK(node.cs_vRecvMsg);
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&message[0], message.size()));
+}
+
+BOOST_AUTO_TEST_CASE(push_raw_message)
+{
+    std::vector<unsigned char> payload(5000);
+    GetRandBytes(&payload[0], payload.size());
+
+    // the socket is invalid, so everything stays in the send queue.
+    CAddress addr(CService("10.0.0.1", 8333));
+    CNode serialized(INVALID_SOCKET, addr, "", true);
+    serialized.PushMessage(NetMsgType::BLOCK, CFlatData(payload));
+
+    std::shared_ptr<char> shared(new char[payload.size()], std::default_delete<char[]>());
+    memcpy(shared.get(), &payload[0], payload.size());
+    Streaming::ConstBuffer buffer(shared, shared.get(), shared.get() + payload.size());
+    const uint256 hash = Hash(payload.begin(), payload.end());
+    unsigned int checksum;
+    memcpy(&checksum, &hash, sizeof(checksum));
+
+    CNode raw(INVALID_SOCKET, addr, "", true);
+    raw.PushRawMessage(NetMsgType::BLOCK, buffer, checksum);
+    BOOST_CHECK_EQUAL(raw.nSendSize, serialized.nSendSize);
+    BOOST_CHECK(QueuedBytes(raw) == QueuedBytes(serialized));
+    // the payload was not copied
+    BOOST_CHECK(raw.vSendMsg.back().begin() == shared.get());
+}
+
+BOOST_AUTO_TEST_CASE(message_time_histogram)
+{
+    CMessageTimeHistogram histogram;
+    histogram.add(0);
+    histogram.add(1);
+    histogram.add(3);
+    histogram.add(4);
+    histogram.add(int64_t(1) << 40);
+    BOOST_CHECK_EQUAL(histogram.nCount, 5);
+    BOOST_CHECK_EQUAL(histogram.buckets[0], 1); // < 1us
+    BOOST_CHECK_EQUAL(histogram.buckets[1], 1); // < 2us
+    BOOST_CHECK_EQUAL(histogram.buckets[2], 1); // < 4us
+    BOOST_CHECK_EQUAL(histogram.buckets[3], 1); // < 8us
+    BOOST_CHECK_EQUAL(histogram.buckets[CMessageTimeHistogram::Buckets - 1], 1);
+
+    // commands peers made up share one histogram
+    CNode::RecordMessageTime(NetMsgType::PING, 10);
+    CNode::RecordMessageTime("madeup", 10);
+    CNode::RecordMessageTime("madeup2", 10);
+    const std::map<std::string, CMessageTimeHistogram> times = CNode::GetMessageTimes();
+    BOOST_CHECK(times.count("madeup") == 0);
+    BOOST_CHECK(times.at("other").nCount >= 2);
+    BOOST_CHECK(times.at(NetMsgType::PING).buckets[4] >= 1);
+}
+
+static void HandleMessages(CNode *node, int nRounds)
+{
+    for (int i = 0; i < nRounds; ++i)
+        ProcessNodeMessages(node);
+}
+
+BOOST_FIXTURE_TEST_CASE(message_order, TestingSetup)
+{
+    CAddress addr(CService("10.0.0.1", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = PROTOCOL_VERSION;
+    HoldSendQueue(node);
+
+    const uint64_t nPings = 200;
+    for (uint64_t nonce = 0; nonce < nPings; ++nonce) {
+        CDataStream payload(SER_NETWORK, PROTOCOL_VERSION);
+        payload << nonce;
+        ReceiveMessage(node, NetMsgType::PING, payload);
+    }
+
+    // several message handler threads go after the same peer, its messages are answered in order.
+    boost::thread_group threads;
+    for (int i = 0; i < 4; ++i)
+        threads.create_thread(boost::bind(&HandleMessages, &node, nPings / 4));
+    threads.join_all();
+    while (ProcessNodeMessages(&node));
+
+    std::vector<CDataStream> pongs = QueuedMessages(node, NetMsgType::PONG);
+    BOOST_REQUIRE_EQUAL(pongs.size(), nPings);
+    for (uint64_t i = 0; i < nPings; ++i) {
+        uint64_t nonce;
+        pongs[i] >> nonce;
+        BOOST_CHECK_EQUAL(nonce, i);
+    }
+}
+
+static void HandleAllMessages(std::vector<CNode*> *nodes, int nFirst, int nRounds)
+{
+    for (int i = 0; i < nRounds; ++i) {
+        for (size_t n = 0; n < nodes->size(); ++n)
+            ProcessNodeMessages((*nodes)[(nFirst + n) % nodes->size()]);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(concurrent_peers, TestingSetup)
+{
+    // a transaction we have, its invs are filtered out before cs_main is taken
+    CMutableTransaction known;
+    known.vin.resize(1);
+    known.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    known.vout.resize(1);
+    known.vout[0].nValue = COIN;
+    TestMemPoolEntryHelper entry;
+    mempool.addUnchecked(known.GetHash(), entry.FromTx(known));
+
+    const int nNodes = 4;
+    const uint64_t nRounds = 50;
+    std::vector<CNode*> nodes;
+    std::vector<std::set<uint256> > unknown(nNodes);
+    for (int n = 0; n < nNodes; ++n) {
+        CAddress addr(CService(strprintf("10.0.0.%d", n + 1), 8333));
+        CNode *node = new CNode(INVALID_SOCKET, addr, "", true);
+        node->nVersion = PROTOCOL_VERSION;
+        HoldSendQueue(*node);
+        for (uint64_t i = 0; i < nRounds; ++i) {
+            CDataStream ping(SER_NETWORK, PROTOCOL_VERSION);
+            ping << i;
+            ReceiveMessage(*node, NetMsgType::PING, ping);
+            std::vector<CInv> vInv;
+            vInv.push_back(CInv(MSG_TX, known.GetHash()));
+            vInv.push_back(CInv(MSG_TX, GetRandHash()));
+            unknown[n].insert(vInv.back().hash);
+            CDataStream inv(SER_NETWORK, PROTOCOL_VERSION);
+            inv << vInv;
+            ReceiveMessage(*node, NetMsgType::INV, inv);
+        }
+        nodes.push_back(node);
+    }
+
+    // the message handler threads work on all peers at the same time
+    boost::thread_group threads;
+    for (int i = 0; i < nNodes; ++i)
+        threads.create_thread(boost::bind(&HandleAllMessages, &nodes, i, nRounds));
+    threads.join_all();
+    for (CNode *node : nodes) {
+        while (ProcessNodeMessages(node));
+    }
+
+    for (int n = 0; n < nNodes; ++n) {
+        std::vector<CDataStream> pongs = QueuedMessages(*nodes[n], NetMsgType::PONG);
+        BOOST_REQUIRE_EQUAL(pongs.size(), nRounds);
+        for (uint64_t i = 0; i < nRounds; ++i) {
+            uint64_t nonce;
+            pongs[i] >> nonce;
+            BOOST_CHECK_EQUAL(nonce, i);
+        }
+        BOOST_CHECK(nodes[n]->setAskFor == unknown[n]);
+        delete nodes[n];
+    }
+    mempool.clear();
+}
+
+static void RequestHeaders(CNode &node, const CBlockIndex *fork)
+{
+    CDataStream payload(SER_NETWORK, PROTOCOL_VERSION);
+    payload << CBlockLocator(std::vector<uint256>(1, fork->GetBlockHash())) << uint256();
+    ReceiveMessage(node, NetMsgType::GETHEADERS, payload);
+}
+
+static std::vector<CBlock> LastHeaders(const CNode &node)
+{
+    std::vector<CDataStream> messages = QueuedMessages(node, NetMsgType::HEADERS);
+    BOOST_REQUIRE(!messages.empty());
+    std::vector<CBlock> headers;
+    messages.back() >> headers;
+    return headers;
+}
+
+BOOST_FIXTURE_TEST_CASE(getheaders_recent, TestChain100Setup)
+{
+    CAddress addr(CService("10.0.0.1", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = PROTOCOL_VERSION;
+    HoldSendQueue(node);
+
+    CBlockIndex *fork, *tip;
+    {
+        LOCK(cs_main);
+        fork = chainActive[90];
+        tip = chainActive.Tip();
+    }
+    // the first request may have to fill the recent headers
+    RequestHeaders(node, fork);
+    while (ProcessNodeMessages(&node));
+    BOOST_CHECK_EQUAL(LastHeaders(node).size(), 10U);
+
+    // a peer that is in sync is answered while someone else holds cs_main
+    std::future<bool> handled;
+    {
+        LOCK(cs_main);
+        RequestHeaders(node, fork);
+        handled = std::async(std::launch::async, &ProcessNodeMessages, &node);
+        BOOST_CHECK(handled.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+    }
+    handled.wait();
+    std::vector<CBlock> headers = LastHeaders(node);
+    BOOST_REQUIRE_EQUAL(headers.size(), 10U);
+    BOOST_CHECK(headers.back().GetHash() == tip->GetBlockHash());
+    BOOST_CHECK(node.pindexHeaderSentUnlocked == tip);
+
+    // the invalidated tip is not handed out anymore
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params().GetConsensus(), tip));
+    }
+    RequestHeaders(node, fork);
+    while (ProcessNodeMessages(&node));
+    headers = LastHeaders(node);
+    BOOST_REQUIRE_EQUAL(headers.size(), 9U);
+    BOOST_CHECK(headers.back().GetHash() == tip->pprev->GetBlockHash());
+}
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(epoll_set)
+{
+    CEpollSet epollSet;
+    BOOST_REQUIRE(epollSet.isValid());
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(listener != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(listener, (struct sockaddr*)&sockaddr, len) == 0);
+    BOOST_REQUIRE(getsockname(listener, (struct sockaddr*)&sockaddr, &len) == 0);
+    BOOST_REQUIRE(listen(listener, SOMAXCONN) == 0);
+
+    const int nConnections = 4;
+    std::vector<SOCKET> clients, servers;
+    for (int i = 0; i < nConnections; ++i) {
+        SOCKET client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        BOOST_REQUIRE(client != INVALID_SOCKET);
+        BOOST_REQUIRE(connect(client, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == 0);
+        SOCKET server = accept(listener, NULL, NULL);
+        BOOST_REQUIRE(server != INVALID_SOCKET);
+        // the index is the context, an offset from NULL so no context is NULL.
+        BOOST_CHECK(epollSet.add(server, reinterpret_cast<void*>(i + 1)));
+        clients.push_back(client);
+        servers.push_back(server);
+    }
+
+    struct epoll_event events[16];
+    // nothing to read yet, and nobody asked for writable.
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 0), 0);
+    epollSet.setWantWrite(servers[0], reinterpret_cast<void*>(1), true);
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 0), 1);
+    BOOST_CHECK(events[0].events & EPOLLOUT);
+    BOOST_CHECK(events[0].data.ptr == reinterpret_cast<void*>(1));
+    epollSet.setWantWrite(servers[0], reinterpret_cast<void*>(1), false);
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 0), 0);
+
+    // only the socket that received something is ready, with its own context.
+    char bytes[2] = { 'x', 'y' };
+    BOOST_REQUIRE(send(clients[2], bytes, 2, 0) == 2);
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 1000), 1);
+    BOOST_CHECK(events[0].events & EPOLLIN);
+    BOOST_CHECK(events[0].data.ptr == reinterpret_cast<void*>(3));
+
+    // edge triggered: unread data doesn't wake us again, only new data does.
+    BOOST_REQUIRE(recv(servers[2], bytes, 1, 0) == 1);
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 0), 0);
+    BOOST_REQUIRE(send(clients[2], bytes, 1, 0) == 1);
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 1000), 1);
+    BOOST_CHECK(events[0].data.ptr == reinterpret_cast<void*>(3));
+
+    // a removed socket is no longer reported.
+    epollSet.remove(servers[1]);
+    BOOST_REQUIRE(send(clients[1], bytes, 1, 0) == 1);
+    BOOST_CHECK_EQUAL(epollSet.wait(events, 16, 100), 0);
+
+    for (size_t i = 0; i < servers.size(); ++i) {
+        epollSet.remove(servers[i]);
+        CloseSocket(servers[i]);
+        CloseSocket(clients[i]);
+    }
+    CloseSocket(listener);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+// Copyright (c) 2017 The Bitcoin Classic developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+#include "key.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "util.h"
+
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace {
+struct Signature {
+    uint256 hash;
+    CPubKey pubkey;
+    std::vector<unsigned char> sig;
+};
+
+std::vector<Signature> CreateSignatures(int count)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    std::vector<Signature> answer(count);
+    for (int i = 0; i < count; ++i) {
+        answer[i].hash = GetRandHash();
+        answer[i].pubkey = key.GetPubKey();
+        key.Sign(answer[i].hash, answer[i].sig);
+    }
+    return answer;
+}
+
+void VerifyAll(const std::vector<Signature> *signatures, std::atomic<int> *failures)
+{
+    CTransaction tx;
+    CachingTransactionSignatureChecker checker(&tx, 0, 0, true);
+    for (size_t i = 0; i < signatures->size(); ++i) {
+        const Signature &s = signatures->at(i);
+        if (!checker.VerifySignature(s.sig, s.pubkey, s.hash))
+            ++*failures;
+        // a cached signature is not valid for a different hash
+        if (checker.VerifySignature(s.sig, s.pubkey, signatures->at((i + 1) % signatures->size()).hash))
+            ++*failures;
+    }
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(sigcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(sigcache_hits)
+{
+    const std::vector<Signature> sigs = CreateSignatures(2);
+    CTransaction tx;
+    CachingTransactionSignatureChecker mempoolChecker(&tx, 0, 0, true);
+    CachingTransactionSignatureChecker blockChecker(&tx, 0, 0, false, NULL, true);
+
+    SignatureCacheStats before = GetSignatureCacheStats();
+    BOOST_CHECK(before.nMaxEntries > 0);
+    // Any bucket count can be indexed, so at most one bucket of the configured size goes unused.
+    const size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) << 20;
+    BOOST_CHECK(before.nUsage <= nMaxCacheSize);
+    BOOST_CHECK(before.nUsage > nMaxCacheSize - 1024);
+    BOOST_CHECK(mempoolChecker.VerifySignature(sigs[0].sig, sigs[0].pubkey, sigs[0].hash));
+    BOOST_CHECK(mempoolChecker.VerifySignature(sigs[0].sig, sigs[0].pubkey, sigs[0].hash));
+    SignatureCacheStats after = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(after.nMempoolMisses - before.nMempoolMisses, 1);
+    BOOST_CHECK_EQUAL(after.nMempoolHits - before.nMempoolHits, 1);
+    BOOST_CHECK_EQUAL(after.nEntries - before.nEntries, 1);
+
+    // The block validation finds it, and removes it as it won't be needed again.
+    before = after;
+    BOOST_CHECK(blockChecker.VerifySignature(sigs[0].sig, sigs[0].pubkey, sigs[0].hash));
+    BOOST_CHECK(blockChecker.VerifySignature(sigs[0].sig, sigs[0].pubkey, sigs[0].hash));
+    BOOST_CHECK(blockChecker.VerifySignature(sigs[1].sig, sigs[1].pubkey, sigs[1].hash));
+    after = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(after.nBlockHits - before.nBlockHits, 1);
+    BOOST_CHECK_EQUAL(after.nBlockMisses - before.nBlockMisses, 2);
+    BOOST_CHECK_EQUAL(after.nMempoolHits, before.nMempoolHits);
+    BOOST_CHECK_EQUAL(before.nEntries - after.nEntries, 1);
+
+    // Checking a block template stores the results, it still counts as block validation.
+    CachingTransactionSignatureChecker templateChecker(&tx, 0, 0, true, NULL, true);
+    before = after;
+    BOOST_CHECK(templateChecker.VerifySignature(sigs[1].sig, sigs[1].pubkey, sigs[1].hash));
+    after = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(after.nBlockMisses - before.nBlockMisses, 1);
+    BOOST_CHECK_EQUAL(after.nMempoolMisses, before.nMempoolMisses);
+    BOOST_CHECK_EQUAL(after.nEntries - before.nEntries, 1);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_threads)
+{
+    const std::vector<Signature> sigs = CreateSignatures(100);
+    std::atomic<int> failures(0);
+    boost::thread_group threads;
+    for (int i = 0; i < 4; ++i)
+        threads.create_thread(boost::bind(&VerifyAll, &sigs, &failures));
+    threads.join_all();
+    BOOST_CHECK_EQUAL(failures, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
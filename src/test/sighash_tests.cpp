@@ -15,6 +15,7 @@
 #include "transaction_utils.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "version.h"
 
 #include <iostream>
@@ -186,4 +187,58 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
     }
 }
+
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    // The precomputed hashes give the same signature hash as computing them for every input.
+    seed_insecure_rand(false);
+    for (int i = 0; i < 2000; i++) {
+        const int nHashType = insecure_rand() | SIGHASH_FORKID;
+        CMutableTransaction txTo;
+        TxUtils::RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE ? TxUtils::SingleOutput: TxUtils::AnyOutputCount);
+        CScript scriptCode;
+        TxUtils::RandomScript(scriptCode);
+        const CTransaction tx(txTo);
+        const PrecomputedTransactionData txdata(tx);
+        const int nIn = insecure_rand() % tx.vin.size();
+        const CAmount amount = insecure_rand();
+        BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, amount, nHashType, SCRIPT_ENABLE_SIGHASH_FORKID)
+                    == SignatureHash(scriptCode, tx, nIn, amount, nHashType, SCRIPT_ENABLE_SIGHASH_FORKID, &txdata));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_precomputed_many_inputs)
+{
+    // A consolidation transaction, hashed with and without precomputed data. The
+    // times are only reported, and the input count only large, with TEST_BITCOIN_TIMING set.
+    CMutableTransaction txTo;
+    txTo.vin.resize(TimingTestsEnabled() ? 3000 : 100);
+    for (size_t i = 0; i < txTo.vin.size(); i++) {
+        txTo.vin[i].prevout = COutPoint(GetRandHash(), i % 3);
+        txTo.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 1) << std::vector<unsigned char>(33, 2);
+    }
+    txTo.vout.resize(2);
+    const CTransaction tx(txTo);
+    const CScript scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+    const int nHashType = SIGHASH_ALL | SIGHASH_FORKID;
+
+    std::vector<uint256> hashes(tx.vin.size());
+    int64_t nStart = GetTimeMicros();
+    for (size_t i = 0; i < tx.vin.size(); i++)
+        hashes[i] = SignatureHash(scriptCode, tx, i, 1000, nHashType, SCRIPT_ENABLE_SIGHASH_FORKID);
+    const int64_t nWithout = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    const PrecomputedTransactionData txdata(tx);
+    bool fSame = true;
+    for (size_t i = 0; i < tx.vin.size(); i++)
+        fSame &= hashes[i] == SignatureHash(scriptCode, tx, i, 1000, nHashType, SCRIPT_ENABLE_SIGHASH_FORKID, &txdata);
+    const int64_t nWith = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(fSame);
+    if (TimingTestsEnabled())
+        BOOST_TEST_MESSAGE("Signature hashes of a " << tx.vin.size() << " input transaction: "
+                           << nWithout / 1000.0 << "ms, with precomputed data: " << nWith / 1000.0 << "ms");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
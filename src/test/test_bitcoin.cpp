@@ -9,6 +9,7 @@
 #include "chainparams.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
@@ -34,6 +35,7 @@ extern void noui_connect();
 
 BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
 {
+        SHA256AutoDetect();
         ECC_Start();
         SetupEnvironment();
         SetupNetworking();
@@ -76,6 +78,11 @@ TestingSetup::TestingSetup(const std::string& chainName, BlocksDb bdb) : BasicTe
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i < nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
+        nTxInputCheckThreads = DEFAULT_INPUTCHECK_THREADS;
+        for (int i = 0; i < nTxInputCheckThreads; i++)
+            threadGroup.create_thread(&ThreadTxInputsCheck);
         RegisterNodeSignals(GetNodeSignals());
 
     MockApplication::doInit();
@@ -96,6 +103,7 @@ TestingSetup::~TestingSetup()
         UnloadBlockIndex();
         delete pcoinsTip;
         delete pcoinsdbview;
+        pcoinsdbview = NULL;
 #ifdef ENABLE_WALLET
         bitdb.Flush(true);
         bitdb.Reset();
@@ -112,7 +120,7 @@ TestChain100Setup::TestChain100Setup() : TestingSetup(CBaseChainParams::REGTEST)
     {
         std::vector<CMutableTransaction> noTxns;
         CBlock b = CreateAndProcessBlock(noTxns, scriptPubKey);
-        coinbaseTxns.push_back(b.vtx[0]);
+        coinbaseTxns.push_back(*b.vtx[0]);
     }
 }
 
@@ -132,7 +140,7 @@ TestChain100Setup::CreateAndProcessBlock(const std::vector<CMutableTransaction>&
     // Replace mempool-selected txns with just coinbase plus passed-in txns:
     block.vtx.resize(1);
     BOOST_FOREACH(const CMutableTransaction& tx, txns)
-        block.vtx.push_back(tx);
+        block.vtx.push_back(MakeTransactionRef(tx));
     // IncrementExtraNonce creates a valid coinbase and merkleRoot
     unsigned int extraNonce = 0;
     mining.IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
@@ -162,6 +170,11 @@ CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CMutableTransaction &tx, CTxMemPo
                            hasNoDependencies, inChainValue, spendsCoinbase, sigOpCount, lp);
 }
 
+bool TimingTestsEnabled()
+{
+    return getenv("TEST_BITCOIN_TIMING") != NULL;
+}
+
 void Shutdown(void* parg)
 {
   exit(0);
@@ -45,7 +45,6 @@ struct BasicTestingSetup {
  * and wallet (if enabled) setup.
  */
 struct TestingSetup: public BasicTestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
@@ -111,6 +110,13 @@ struct TestMemPoolEntryHelper
     TestMemPoolEntryHelper &SigOps(unsigned int _sigops) { sigOpCount = _sigops; return *this; }
 };
 
+/**
+ * Tests that time an operation on a large workload only do so when the
+ * TEST_BITCOIN_TIMING environment variable is set, otherwise they run a
+ * small workload or nothing at all.
+ */
+bool TimingTestsEnabled();
+
 class MockApplication : public Application
 {
 public:
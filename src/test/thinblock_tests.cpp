@@ -11,8 +11,20 @@
 #include "serialize.h"
 #include "utilstrencodings.h"
 #include "thinblock.h"
+#include "consensus/merkle.h"
+#include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "txmempool.h"
+#include "txorphancache.h"
+#include "utiltime.h"
+#include "test/test_bitcoin.h"
 #include <boost/test/unit_test.hpp>
 
+#include <set>
+
 
 CBlock TestBlock() { //Thanks dagurval :)
     // Block taken from bloom_tests.cpp merkle_block_1
@@ -37,6 +49,38 @@ CBloomFilter TestFilter() { //TODO all this should not be here...
     return memPoolFilter;
 }
 
+// A block on top of the tip with the coinbase and txs, with a valid proof of work.
+static CBlock MineBlock(const std::vector<CTransactionRef> &txs, const CScript &scriptPubKey)
+{
+    Mining mining;
+    mining.SetCoinbase(scriptPubKey);
+    std::unique_ptr<CBlockTemplate> pblocktemplate(mining.CreateNewBlock(Params()));
+    CBlock block = pblocktemplate->block;
+    block.vtx.resize(1);
+    block.vtx.insert(block.vtx.end(), txs.begin(), txs.end());
+    unsigned int extraNonce = 0;
+    mining.IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())) ++block.nNonce;
+    return block;
+}
+
+// Leave node.thinBlock as PreValidateThinBlock() does with the transactions at vReceivedPos
+// still missing, then complete it with vReceived.
+static void CompleteThinBlock(CNode &node, const CBlock &block, const std::vector<uint32_t> &vReceivedPos,
+                              const std::vector<CTransactionRef> &vReceived)
+{
+    node.thinBlock = block;
+    std::vector<uint256> leaves(block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); ++i)
+        leaves[i] = block.vtx[i]->GetHash();
+    for (size_t i = 0; i < vReceivedPos.size(); ++i) {
+        leaves[vReceivedPos[i]].SetNull();
+        node.thinBlock.vtx[vReceivedPos[i]] = vReceived[i];
+    }
+    node.thinBlockMerkleTree.reset(new IncompleteMerkleTree(leaves));
+    FinishThinBlockValidation(&node, vReceivedPos);
+}
+
 BOOST_AUTO_TEST_SUITE(thinblock_tests)
 
 BOOST_AUTO_TEST_CASE(thinblock_test) {
@@ -53,7 +97,7 @@ BOOST_AUTO_TEST_CASE(thinblock_test) {
     BOOST_CHECK_EQUAL(9, xthinblock1.vMissingTx.size());
 
     /* insert txid in block */
-    const uint256 hash_in_block = block.vtx[1].GetHash();
+    const uint256 hash_in_block = block.vtx[1]->GetHash();
     filter.insert(hash_in_block);
     CXThinBlock xthinblock2(block, &filter);
     BOOST_CHECK_EQUAL(8, xthinblock2.vMissingTx.size());
@@ -66,4 +110,172 @@ BOOST_AUTO_TEST_CASE(thinblock_test) {
     BOOST_CHECK(xthinblock3.collision);
 }
 
+BOOST_AUTO_TEST_CASE(thinblock_short_id_hasher)
+{
+    // Short ids that only differ in their high bits still spread over the buckets.
+    SaltedShortIdHasher hasher;
+    std::set<size_t> buckets;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        const uint64_t shortId = i << 48;
+        BOOST_CHECK_EQUAL(hasher(shortId), hasher(shortId));
+        buckets.insert(hasher(shortId) & 0xFFFF);
+    }
+    BOOST_CHECK(buckets.size() > 900);
+}
+
+BOOST_FIXTURE_TEST_CASE(thinblock_reconstruct, TestingSetup)
+{
+    // A block of transactions we have in the mempool and one in the orphan cache,
+    // reconstructed with a mempool around it that is only big with TEST_BITCOIN_TIMING set.
+    const int nMempool = TimingTestsEnabled() ? 100000 : 2000;
+    const int nBlockTx = nMempool / 20;
+    TestMemPoolEntryHelper entry;
+    CBlock block;
+    block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    const uint256 funding = GetRandHash();
+    for (int i = 0; i < nMempool; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(funding, i);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        mempool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+        if (i % (nMempool / nBlockTx) == 0)
+            block.vtx.push_back(mempool.get(tx.GetHash()));
+    }
+    CMutableTransaction orphan;
+    orphan.vin.resize(1);
+    orphan.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    orphan.vout.resize(1);
+    const CTransactionRef orphanRef = MakeTransactionRef(orphan);
+    BOOST_CHECK(CTxOrphanCache::instance()->AddOrphanTx(orphanRef, 1));
+    block.vtx.push_back(orphanRef);
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    CXThinBlock xthinblock(block);
+    BOOST_CHECK_EQUAL(1, xthinblock.vMissingTx.size()); // the coinbase
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 8333)), "", true);
+    const int64_t nStart = GetTimeMicros();
+    BOOST_CHECK(xthinblock.process(&node));
+    const int64_t nReconstruct = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(node.thinBlock.vtx.size(), block.vtx.size());
+    BOOST_CHECK(BlockMerkleRoot(node.thinBlock) == block.hashMerkleRoot);
+    BOOST_CHECK(!CTxOrphanCache::contains(orphanRef->GetHash())); // used orphans are removed
+    if (TimingTestsEnabled())
+        BOOST_TEST_MESSAGE("Reconstructed a thinblock of " << block.vtx.size() << " transactions with " << nMempool
+                           << " in the mempool in " << nReconstruct / 1000.0 << "ms");
+
+    // the index follows the removals from the mempool
+    BOOST_CHECK(mempool.getByShortId(block.vtx[1]->GetHash().GetCheapHash()) == block.vtx[1]);
+    std::list<CTransaction> removed;
+    mempool.remove(*block.vtx[1], removed);
+    BOOST_CHECK(!mempool.getByShortId(block.vtx[1]->GetHash().GetCheapHash()));
+    mempool.clear();
+    BOOST_CHECK(!mempool.getByShortId(block.vtx[2]->GetHash().GetCheapHash()));
+}
+
+BOOST_FIXTURE_TEST_CASE(thinblock_filter, TestingSetup)
+{
+    TestMemPoolEntryHelper entry;
+    CTxOrphanCache::clear(); // left over by other tests
+    CThinBlockFilter *filter = CThinBlockFilter::instance();
+    std::vector<uint256> txids;
+    for (int i = 0; i < 20; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        mempool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+        txids.push_back(tx.GetHash());
+    }
+    CMutableTransaction orphanTx;
+    orphanTx.vin.resize(1);
+    orphanTx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    orphanTx.vout.resize(1);
+    orphanTx.vout[0].nValue = 1;
+    const uint256 orphan = orphanTx.GetHash();
+    BOOST_CHECK(CTxOrphanCache::instance()->AddOrphanTx(MakeTransactionRef(orphanTx), 1));
+    filter->addOrphan(orphan);
+
+    // transactions are in the filter as soon as they enter the mempool
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    filter->serialize(stream);
+    CBloomFilter received;
+    stream >> received;
+    received.UpdateEmptyFull(); // like LoadFilter() does
+    BOOST_CHECK(received.IsWithinSizeConstraints());
+    BOOST_FOREACH (const uint256 &txid, txids) {
+        BOOST_CHECK(received.contains(txid));
+    }
+    BOOST_CHECK(received.contains(orphan));
+
+    // after enough of them left the mempool the filter is rebuilt without them
+    mempool.clear();
+    filter->serialize(stream);
+    stream >> received;
+    received.UpdateEmptyFull();
+    BOOST_CHECK(received.contains(orphan));
+    int found = 0;
+    BOOST_FOREACH (const uint256 &txid, txids) {
+        if (received.contains(txid))
+            ++found;
+    }
+    BOOST_CHECK(found < 5); // false positives
+    CThinBlockFilter::Stop();
+    CTxOrphanCache::clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(thinblock_finish_validation, TestChain100Setup)
+{
+    const CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = coinbaseTxns[0].vout[0].nValue;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    CMutableTransaction other(spend);
+    other.vout[0].nValue -= 1;
+    CMutableTransaction negative(spend);
+    negative.vout[0].nValue = -1;
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 8333)), "", true);
+
+    // the received transaction is the one in the merkle tree
+    CBlock block = MineBlock({MakeTransactionRef(spend)}, scriptPubKey);
+    CompleteThinBlock(node, block, {1}, {block.vtx[1]});
+    BOOST_CHECK(node.thinBlock.fChecked);
+
+    // the peer sent a different transaction
+    CompleteThinBlock(node, block, {1}, {MakeTransactionRef(other)});
+    BOOST_CHECK(!node.thinBlock.fChecked);
+    CValidationState state;
+    BOOST_CHECK(!ProcessNewBlock(state, Params(), NULL, &node.thinBlock, true, NULL));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txnmrklroot");
+
+    // a duplicated last transaction gives the same root, but a mutated tree
+    block = MineBlock({MakeTransactionRef(spend), MakeTransactionRef(other)}, scriptPubKey);
+    CBlock mutatedBlock(block);
+    mutatedBlock.vtx.push_back(block.vtx[2]);
+    CompleteThinBlock(node, mutatedBlock, {3}, {block.vtx[2]});
+    BOOST_CHECK(!node.thinBlock.fChecked);
+    state = CValidationState();
+    BOOST_CHECK(!ProcessNewBlock(state, Params(), NULL, &node.thinBlock, true, NULL));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-duplicate");
+
+    // the root matches, but the received transaction is invalid
+    block = MineBlock({MakeTransactionRef(negative)}, scriptPubKey);
+    CompleteThinBlock(node, block, {1}, {block.vtx[1]});
+    BOOST_CHECK(!node.thinBlock.fChecked);
+    state = CValidationState();
+    BOOST_CHECK(!ProcessNewBlock(state, Params(), NULL, &node.thinBlock, true, NULL));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-vout-negative");
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() != block.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
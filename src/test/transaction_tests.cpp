@@ -318,6 +318,59 @@ BOOST_AUTO_TEST_CASE(test_Get)
     BOOST_CHECK_EQUAL(coins.GetValueIn(t1), (50+21+22)*CENT);
 }
 
+BOOST_AUTO_TEST_CASE(test_cached_size_and_sigops)
+{
+    CBasicKeyStore keystore;
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+    std::vector<CMutableTransaction> dummyTransactions = SetupDummyInputs(keystore, coins);
+
+    CMutableTransaction t1;
+    t1.vin.resize(1);
+    t1.vin[0].prevout.hash = dummyTransactions[0].GetHash();
+    t1.vin[0].prevout.n = 1;
+    t1.vin[0].scriptSig << std::vector<unsigned char>(65, 0);
+    t1.vout.resize(2);
+    t1.vout[0].nValue = 10*CENT;
+    t1.vout[0].scriptPubKey << OP_1 << OP_CHECKSIG;
+    t1.vout[1].nValue = 10*CENT;
+    t1.vout[1].scriptPubKey << OP_CHECKMULTISIG;
+
+    const CTransaction tx(t1);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << tx;
+    BOOST_CHECK_EQUAL(tx.GetTxSize(), stream.size());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), stream.size());
+    BOOST_CHECK_EQUAL(GetLegacySigOpCount(tx), 1U + MAX_PUBKEYS_PER_MULTISIG);
+    BOOST_CHECK_EQUAL(tx.GetCachedP2SHSigOpCount(), -1);
+    BOOST_CHECK_EQUAL(GetP2SHSigOpCount(tx, coins), 0U);
+    BOOST_CHECK_EQUAL(tx.GetCachedP2SHSigOpCount(), 0);
+
+    // copies carry the cached values along
+    const CTransaction copy(tx);
+    BOOST_CHECK_EQUAL(copy.GetCachedP2SHSigOpCount(), 0);
+    BOOST_CHECK_EQUAL(copy.GetTxSize(), stream.size());
+
+    // a block adds up the cached transaction sizes
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(tx));
+    block.vtx.push_back(MakeTransactionRef(copy));
+    CDataStream blockStream(SER_NETWORK, PROTOCOL_VERSION);
+    blockStream << block;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION), blockStream.size());
+
+    // deserializing into an existing transaction forgets the old values
+    t1.vout.resize(1);
+    CTransaction other(t1);
+    BOOST_CHECK(other.GetTxSize() < tx.GetTxSize());
+    BOOST_CHECK_EQUAL(GetLegacySigOpCount(other), 1U);
+    stream >> other;
+    BOOST_CHECK(other == tx);
+    BOOST_CHECK_EQUAL(other.GetTxSize(), tx.GetTxSize());
+    BOOST_CHECK_EQUAL(GetLegacySigOpCount(other), GetLegacySigOpCount(tx));
+    BOOST_CHECK_EQUAL(other.GetCachedP2SHSigOpCount(), -1);
+}
+
 BOOST_AUTO_TEST_CASE(test_IsStandard)
 {
     LOCK(cs_main);
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "consensus/validation.h"
 #include "key.h"
 #include "main.h"
@@ -9,11 +10,15 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
 
+#include <atomic>
+
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_AUTO_TEST_SUITE(tx_validationcache_tests)
 
@@ -71,4 +76,281 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static CMutableTransaction SpendCoinbases(const std::vector<CTransaction> &coinbases, int nFirst, int nCount,
+                                          const CKey &key, const CScript &scriptPubKey)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(nCount);
+    for (int i = 0; i < nCount; i++) {
+        tx.vin[i].prevout.hash = coinbases[nFirst + i].GetHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nCount * 49 * COIN;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    for (int i = 0; i < nCount; i++) {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, tx, i, 50 * COIN, SIGHASH_ALL | SIGHASH_FORKID, SCRIPT_ENABLE_SIGHASH_FORKID);
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL + SIGHASH_FORKID);
+        tx.vin[i].scriptSig << vchSig;
+    }
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_parallel_scripts, TestChain100Setup)
+{
+    // Transactions with many inputs have their scripts checked on the script check threads.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const int nInputs = MEMPOOL_PARALLEL_SCRIPTCHECK_INPUTS + 2;
+    // mature enough coinbases to spend
+    for (int i = 0; i < nInputs + 10; i++) {
+        std::vector<CMutableTransaction> noTxns;
+        CreateAndProcessBlock(noTxns, scriptPubKey);
+    }
+    CMutableTransaction tx = SpendCoinbases(coinbaseTxns, 0, nInputs, coinbaseKey, scriptPubKey);
+
+    // a bad signature in the middle is found, and reported like in the serial case.
+    CMutableTransaction badTx(tx);
+    badTx.vin[nInputs / 2].scriptSig = badTx.vin[0].scriptSig;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, state, badTx, false, NULL, true, false));
+        BOOST_CHECK(state.GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+    }
+    BOOST_CHECK(ToMemPool(tx));
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+
+    // Independent transactions verified as a batch are accepted as usual.
+    std::vector<CTransactionRef> batch;
+    batch.push_back(MakeTransactionRef(SpendCoinbases(coinbaseTxns, nInputs, 5, coinbaseKey, scriptPubKey)));
+    batch.push_back(MakeTransactionRef(SpendCoinbases(coinbaseTxns, nInputs + 5, 5, coinbaseKey, scriptPubKey)));
+    PreverifyMempoolScripts(mempool, batch);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        CMutableTransaction mtx(*batch[i]);
+        BOOST_CHECK(ToMemPool(mtx));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+}
+
+static CMutableTransaction SpendOutput(const CTransaction &prev, int n, const CKey &key, const CScript &scriptPubKey, int nOutputs = 1,
+                                      CAmount nFee = 10000)
+{
+    const CAmount nValueIn = prev.vout[n].nValue;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev.GetHash(), n);
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = (nValueIn - nFee) / nOutputs;
+        tx.vout[i].scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(prev.vout[n].scriptPubKey, tx, 0, nValueIn, SIGHASH_ALL | SIGHASH_FORKID, SCRIPT_ENABLE_SIGHASH_FORKID);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL + SIGHASH_FORKID);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+// Runs a block with these transactions on top of the tip through ConnectBlock, without adding it.
+static CValidationState CheckBlockWith(const std::vector<CMutableTransaction> &txns, const CScript &scriptPubKey)
+{
+    Mining mining;
+    mining.SetCoinbase(scriptPubKey);
+    std::unique_ptr<CBlockTemplate> pblocktemplate(mining.CreateNewBlock(Params()));
+    CBlock &block = pblocktemplate->block;
+    block.vtx.resize(1);
+    for (const CMutableTransaction &tx : txns)
+        block.vtx.push_back(MakeTransactionRef(tx));
+    unsigned int extraNonce = 0;
+    LOCK(cs_main);
+    mining.IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
+    CValidationState state;
+    BOOST_CHECK(!TestBlockValidity(state, Params(), block, chainActive.Tip(), false, true));
+    return state;
+}
+
+BOOST_FIXTURE_TEST_CASE(connectblock_input_check_failure, TestChain100Setup)
+{
+    // A transaction the input check workers reject in the middle of a block of valid
+    // ones fails the block with the reason of that transaction.
+    BOOST_CHECK(nTxInputCheckThreads > 0);
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const int nOutputs = 200;
+    std::vector<CMutableTransaction> funding(1, SpendOutput(coinbaseTxns[0], 0, coinbaseKey, scriptPubKey, nOutputs));
+    CBlock block = CreateAndProcessBlock(funding, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    const CTransaction fundingTx(funding[0]);
+    std::vector<CMutableTransaction> txns;
+    for (int n = 0; n < nOutputs; n++)
+        txns.push_back(SpendOutput(fundingTx, n, coinbaseKey, scriptPubKey));
+
+    // spends more than its input
+    std::vector<CMutableTransaction> withBad(txns);
+    withBad[nOutputs / 2] = SpendOutput(fundingTx, nOutputs / 2, coinbaseKey, scriptPubKey, 1, -COIN);
+    CValidationState state = CheckBlockWith(withBad, scriptPubKey);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-in-belowout");
+
+    // spends a coinbase that is one block short of maturing
+    withBad = txns;
+    withBad.insert(withBad.begin() + nOutputs / 2, SpendOutput(coinbaseTxns[2], 0, coinbaseKey, scriptPubKey));
+    state = CheckBlockWith(withBad, scriptPubKey);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-premature-spend-of-coinbase");
+
+    // without the bad ones the block connects
+    block = CreateAndProcessBlock(txns, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+}
+
+static void AdmitFromPeer(const std::vector<CTransactionRef> &txs, int nPeer, int nPeers, std::atomic<int> *accepted)
+{
+    for (size_t i = nPeer; i < txs.size(); i += nPeers) {
+        CValidationState state;
+        if (!PreverifyMempoolTransaction(mempool, txs[i], state))
+            continue;
+        LOCK(cs_main);
+        if (AcceptToMemoryPool(mempool, state, txs[i], false, NULL, true, false))
+            ++*accepted;
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_concurrent_admission, TestChain100Setup)
+{
+    // Transactions from several peers have their scripts verified at the same time,
+    // only the AcceptToMemoryPool() calls that follow are serialized on cs_main.
+    // The throughput is compared on a larger batch with TEST_BITCOIN_TIMING set.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const int nFunding = 4;
+    const int nOutputs = TimingTestsEnabled() ? 1000 : 50;
+    const int nPeers = 4;
+    for (int i = 0; i < nFunding; i++) {
+        std::vector<CMutableTransaction> noTxns;
+        CreateAndProcessBlock(noTxns, scriptPubKey);
+    }
+    std::vector<CMutableTransaction> funding;
+    for (int i = 0; i < nFunding; i++)
+        funding.push_back(SpendOutput(coinbaseTxns[i], 0, coinbaseKey, scriptPubKey, nOutputs));
+    CBlock block = CreateAndProcessBlock(funding, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    // half of the transactions are accepted one by one, the other half by several peers at once
+    std::vector<CTransactionRef> serial, concurrent;
+    for (int i = 0; i < nFunding; i++) {
+        const CTransaction fundingTx(funding[i]);
+        for (int n = 0; n < nOutputs; n++) {
+            std::vector<CTransactionRef> &txs = i < nFunding / 2 ? serial : concurrent;
+            txs.push_back(MakeTransactionRef(SpendOutput(fundingTx, n, coinbaseKey, scriptPubKey)));
+        }
+    }
+
+    int64_t nStart = GetTimeMicros();
+    std::atomic<int> acceptedSerial(0);
+    AdmitFromPeer(serial, 0, 1, &acceptedSerial);
+    const int64_t nSerial = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL((size_t)acceptedSerial.load(), serial.size());
+
+    nStart = GetTimeMicros();
+    std::atomic<int> acceptedConcurrent(0);
+    boost::thread_group peers;
+    for (int i = 0; i < nPeers; i++)
+        peers.create_thread(boost::bind(&AdmitFromPeer, boost::cref(concurrent), i, nPeers, &acceptedConcurrent));
+    peers.join_all();
+    const int64_t nConcurrent = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL((size_t)acceptedConcurrent.load(), concurrent.size());
+    BOOST_CHECK_EQUAL(mempool.size(), serial.size() + concurrent.size());
+
+    if (TimingTestsEnabled())
+        BOOST_TEST_MESSAGE("Mempool admission of " << serial.size() << " transactions: "
+                           << serial.size() * 1000000 / std::max<int64_t>(nSerial, 1) << " tx/s from one peer, "
+                           << concurrent.size() * 1000000 / std::max<int64_t>(nConcurrent, 1) << " tx/s from " << nPeers << " peers");
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_preverify_policy, TestChain100Setup)
+{
+    // Only transactions that pass the policy checks get their scripts verified ahead of
+    // AcceptToMemoryPool(), and a bad signature is reported right away.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const CTransactionRef freeTx = MakeTransactionRef(SpendOutput(coinbaseTxns[0], 0, coinbaseKey, scriptPubKey, 1, 0));
+    const CTransactionRef payingTx = MakeTransactionRef(SpendOutput(coinbaseTxns[1], 0, coinbaseKey, scriptPubKey));
+    CMutableTransaction bad = SpendOutput(coinbaseTxns[2], 0, coinbaseKey, scriptPubKey);
+    CScript &scriptSig = bad.vin[0].scriptSig;
+    scriptSig[scriptSig.size() - 2] ^= 1; // the last byte of S
+    const CTransactionRef badTx = MakeTransactionRef(bad);
+
+    SignatureCacheStats before = GetSignatureCacheStats();
+    CValidationState state;
+    BOOST_CHECK(PreverifyMempoolTransaction(mempool, freeTx, state));
+    BOOST_CHECK(state.IsValid());
+    SignatureCacheStats after = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(after.nMempoolMisses, before.nMempoolMisses);
+
+    BOOST_CHECK(PreverifyMempoolTransaction(mempool, payingTx, state));
+    BOOST_CHECK(state.IsValid());
+    before = after;
+    after = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(after.nMempoolMisses - before.nMempoolMisses, 1);
+
+    BOOST_CHECK(!PreverifyMempoolTransaction(mempool, badTx, state));
+    int nDoS = 0;
+    BOOST_CHECK(state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK(mempool.size() == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_persist, TestChain100Setup)
+{
+    // A dumped mempool loads again with its deltas, entry times and chains intact.
+    // TEST_BITCOIN_TIMING makes the pool big enough to time the load.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const int nOutputs = TimingTestsEnabled() ? 1000 : 20;
+    std::vector<CMutableTransaction> noTxns;
+    CreateAndProcessBlock(noTxns, scriptPubKey);
+    std::vector<CMutableTransaction> funding(1, SpendOutput(coinbaseTxns[0], 0, coinbaseKey, scriptPubKey, nOutputs));
+    CreateAndProcessBlock(funding, scriptPubKey);
+
+    const CTransaction fundingTx(funding[0]);
+    std::vector<CTransactionRef> txs;
+    for (int n = 0; n < nOutputs; n++)
+        txs.push_back(MakeTransactionRef(SpendOutput(fundingTx, n, coinbaseKey, scriptPubKey)));
+    // a child, it has to be loaded after its parent
+    txs.push_back(MakeTransactionRef(SpendOutput(*txs[0], 0, coinbaseKey, scriptPubKey)));
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < txs.size(); ++i) {
+            CValidationState state;
+            BOOST_CHECK(AcceptToMemoryPool(mempool, state, txs[i], false, NULL, true, false));
+        }
+    }
+    const uint256 unknown = GetRandHash();
+    mempool.PrioritiseTransaction(txs[1]->GetHash(), txs[1]->GetHash().ToString(), 0, 5000);
+    mempool.PrioritiseTransaction(unknown, unknown.ToString(), 0, 7000);
+    SetMockTime(GetTime() + 100);
+    CTxMemPoolEntry entry = *mempool.mapTx.find(txs[2]->GetHash());
+    BOOST_CHECK(DumpMempool(mempool));
+
+    // as if we restarted
+    mempool.clear();
+    mempool.ClearPrioritisation(txs[1]->GetHash());
+    mempool.ClearPrioritisation(unknown);
+    const int64_t nStart = GetTimeMicros();
+    BOOST_CHECK(LoadMempool(mempool));
+    const int64_t nLoad = GetTimeMicros() - nStart;
+    SetMockTime(0);
+
+    BOOST_CHECK_EQUAL(mempool.size(), txs.size());
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(txs[1]->GetHash())->GetModifiedFee(), 15000);
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(txs[2]->GetHash())->GetTime(), entry.GetTime());
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(txs.back()->GetHash())->GetCountWithAncestors(), 2);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas.count(unknown), 1);
+    }
+    if (TimingTestsEnabled())
+        BOOST_TEST_MESSAGE("Loaded a mempool of " << txs.size() << " transactions, " << mempool.DynamicMemoryUsage() / 1000
+                           << " kB, in " << nLoad / 1000.0 << "ms");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
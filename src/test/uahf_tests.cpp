@@ -63,7 +63,7 @@ static CBlock createBlock(CBlockIndex *parent, const std::vector<CTransaction>&
     coinbase.vout[0].nValue = 50 * COIN;
 
     CBlock block;
-    block.vtx.push_back(coinbase);
+    block.vtx.push_back(MakeTransactionRef(std::move(coinbase)));
     block.nVersion = 4;
     block.hashPrevBlock = *parent->phashBlock;
     block.nTime = parent->GetMedianTimePast() + 20;
@@ -72,7 +72,7 @@ static CBlock createBlock(CBlockIndex *parent, const std::vector<CTransaction>&
 
     block.vtx.reserve(txns.size() + 1);
     for (const CTransaction &tx : txns) {
-        block.vtx.push_back(tx);
+        block.vtx.push_back(MakeTransactionRef(tx));
     }
 
     // make it actually valid
@@ -16,7 +16,9 @@
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "policy/policy.h"
+#include "validationinterface.h"
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
@@ -26,6 +28,8 @@ std::map<uint256, uint64_t> mapThinBlockTimer;
 std::vector<CNode*> xpeditedBlk; // Who requested expedited blocks from us
 std::vector<CNode*> xpeditedBlkUp; // Who we requested expedited blocks from
 std::vector<CNode*> xpeditedTxn;
+// Guards the expedited lists above and the recently sent blocks, for the message handler threads.
+static CCriticalSection cs_xpedited;
 
 CXThinBlock::CXThinBlock(const CBlock& block, CBloomFilter* filter)
     : collision(false)
@@ -36,7 +40,7 @@ CXThinBlock::CXThinBlock(const CBlock& block, CBloomFilter* filter)
     vTxHashes.reserve(nTx);
     std::set<uint64_t> setPartialTxHash;
     for (unsigned int i = 0; i < nTx; i++) {
-        const uint256 hash256 = block.vtx[i].GetHash();
+        const uint256 hash256 = block.vtx[i]->GetHash();
         const uint64_t cheapHash = hash256.GetCheapHash();
         vTxHashes.push_back(cheapHash);
 
@@ -60,138 +64,205 @@ CXThinBlock::CXThinBlock()
 
 bool CXThinBlock::process(CNode* pfrom)
 {
-    pfrom->thinBlock = CBlock(header);
-    pfrom->xThinBlockHashes = vTxHashes;
-
-    // Create the mapMissingTx from all the supplied tx's in the xthinblock
-    std::map<uint64_t, CTransaction> mapMissingTx;
-    BOOST_FOREACH(CTransaction tx, vMissingTx) {
-        mapMissingTx[tx.GetHash().GetCheapHash()] = tx;
-    }
-
-    std::map<uint64_t, uint256> orphanLookup;
+    const int64_t nStart = GetTimeMicros();
     {
-        auto orphans = CTxOrphanCache::instance()->mapOrphanTransactions();
-        BOOST_FOREACH (auto iter, orphans) {
-            orphanLookup.insert(std::make_pair(iter.first.GetCheapHash(), iter.first));
+        // Other peers clear our thin block state when they deliver the block first, see HandleBlockMessage().
+        LOCK(cs_main);
+        pfrom->thinBlock = CBlock(header);
+        pfrom->thinBlockMerkleTree.reset();
+        pfrom->xThinBlockHashes = vTxHashes;
+
+        // Create the mapMissingTx from all the supplied tx's in the xthinblock
+        std::map<uint64_t, CTransactionRef> mapMissingTx;
+        BOOST_FOREACH(const CTransactionRef &tx, vMissingTx) {
+            mapMissingTx[tx->GetHash().GetCheapHash()] = tx;
         }
-    }
 
-    std::map<uint64_t, uint256> mempoolLookup;
-    {
-        std::vector<uint256> memPoolHashes;
-        mempool.queryHashes(memPoolHashes);
+        // The mempool and the orphan cache are indexed by the short ids, so the lookups
+        // below are all we need to do for each transaction of the block.
+        std::vector<uint256> orphansUsed;
+        int missingCount = 0;
+        int collisionCount = 0;
+        std::uint32_t blockSize = ::GetSerializeSize(pfrom->thinBlock, SER_NETWORK, PROTOCOL_VERSION);
+        const std::uint32_t blockSizeAcceptLimit = Policy::blockSizeAcceptLimit();
+        {
+            LOCK(mempool.cs);
+            const bool isChainTip = (header.hashPrevBlock == chainActive.Tip()->GetBlockHash()) ? true : false;
+            pfrom->thinBlock.vtx.reserve(vTxHashes.size());
+            for (size_t i = 0; i < vTxHashes.size(); ++i) {
+                const uint64_t cheapHash = vTxHashes.at(i);
+                // Now we find the full transaction.
+                CTransactionRef tx;
+
+                auto foundInMissing = mapMissingTx.find(cheapHash);
+                if (foundInMissing != mapMissingTx.end()) {
+                    tx = foundInMissing->second;
+                }
 
-        for (size_t i = 0; i < memPoolHashes.size(); ++i) {
-            const uint256 &hash = memPoolHashes.at(i);
-            mempoolLookup.insert(std::make_pair(hash.GetCheapHash(), hash));
-        }
-    }
+                CTransactionRef memTx = mempool.getByShortId(cheapHash);
+                if (memTx) {
+                    if (!tx) {
+                        if (isChainTip) // only skip validation if we are constructing the new chaintip
+                            setPreVerifiedTxHash.insert(memTx->GetHash());
+                        tx = memTx;
+                    } else {
+                        ++collisionCount;
+                    }
+                }
 
-    std::vector<uint256> orphansUsed;
-    int missingCount = 0;
-    int collisionCount = 0;
-    std::uint32_t blockSize = ::GetSerializeSize(pfrom->thinBlock, SER_NETWORK, PROTOCOL_VERSION);
-    const std::uint32_t blockSizeAcceptLimit = Policy::blockSizeAcceptLimit();
-    {
-        LOCK2(cs_main, mempool.cs);
-        const bool isChainTip = (header.hashPrevBlock == chainActive.Tip()->GetBlockHash()) ? true : false;
-        for (size_t i = 0; i < vTxHashes.size(); ++i) {
-            const uint64_t cheapHash = vTxHashes.at(i);
-            // Now we find the full transaction.
-            CTransaction tx;
-
-            auto foundInMissing = mapMissingTx.find(cheapHash);
-            if (foundInMissing != mapMissingTx.end()) {
-                tx = foundInMissing->second;
+                CTransactionRef orphanTx;
+                if (CTxOrphanCache::valueByShortId(cheapHash, orphanTx)) {
+                    if (!tx) {
+                        tx = orphanTx;
+                        orphansUsed.push_back(orphanTx->GetHash());
+                    } else {
+                        ++collisionCount;
+                    }
+                }
+                if (tx)
+                    blockSize += tx->GetTxSize();
+                if (blockSize <= blockSizeAcceptLimit)
+                    pfrom->thinBlock.vtx.push_back(tx);
+                if (!tx)
+                    missingCount++;
             }
+        }
+        LogPrint("thin", "Reconstructed thinblock %s: %d of %d transactions found in %.2fms\n", header.GetHash().ToString(),
+                 vTxHashes.size() - missingCount, vTxHashes.size(), 0.001 * (GetTimeMicros() - nStart));
 
-            auto foundInMempool = mempoolLookup.find(cheapHash);
-            if (foundInMempool != mempoolLookup.end()) {
-                if (tx.IsNull()) {
-                    if (isChainTip) // only skip validation if we are constructing the new chaintip
-                        setPreVerifiedTxHash.insert(foundInMempool->second);
+        pfrom->thinBlockWaitingForTxns = missingCount; // TODO can that variable be removed from the CNode?
 
-                    /*bool found =*/ mempool.lookup(foundInMempool->second, tx);
-                } else {
-                    ++collisionCount;
-                }
-            }
+        if (blockSize > blockSizeAcceptLimit) {
+            pfrom->thinBlockWaitingForTxns = -1;
+            pfrom->thinBlock.vtx.clear();
+            const float punishment = (blockSize - blockSizeAcceptLimit) / (float) blockSizeAcceptLimit;
+            const int score = 10 * punishment + 0.5;
+            LogPrintf("thinblock (partially) reconstructed is over accept limits; (%d > %d), Dropping block and punishing (%d) peer %d\n",
+                    blockSize, blockSizeAcceptLimit, score, pfrom->id);
+            pfrom->mapThinBlocksInFlight.erase(pfrom->thinBlock.GetHash());
+            Misbehaving(pfrom->id, score);
+            return false;
+        }
 
-            auto foundInOrphan = orphanLookup.find(cheapHash);
-            if (foundInOrphan != orphanLookup.end()) {
-                if (tx.IsNull()) {
-                    bool found = CTxOrphanCache::value(foundInOrphan->second, tx);
-                    if (found) // a race condition may have caused it to be removed from the orphans cache
-                        orphansUsed.push_back(foundInOrphan->second);
-                } else {
-                    ++collisionCount;
-                }
+        if (missingCount == 0) {
+            bool mutated;
+            uint256 hashMerkleRoot2 = BlockMerkleRoot(pfrom->thinBlock, &mutated);
+            if (pfrom->thinBlock.hashMerkleRoot != hashMerkleRoot2) {
+                LogPrint("thin", "thinblock fully constructed, but merkle hash failed. Rejecting\n");
+                // If we hit this often, we should consider writing more code above to remember duplicate
+                // short hashes in our maps and also remember duplicate results from the different sources
+                // like the orphans and the mempool etc.
+                // With all these options we can then try different combinations and see which one gives us a proper merkle root.
+
+                // We'll wait for an INV to get this block, rejecting it for now.
+                pfrom->thinBlockWaitingForTxns = -1;
+                return false;
             }
-            blockSize += tx.GetSerializeSize(0, 0);
-            if (blockSize <= blockSizeAcceptLimit)
-                pfrom->thinBlock.vtx.push_back(tx);
-            if (tx.IsNull())
-                missingCount++;
         }
-    }
 
-    pfrom->thinBlockWaitingForTxns = missingCount; // TODO can that variable be removed from the CNode?
+        LogPrint("thin", "thinblock waiting for: %d, txs: %d full: %d\n", pfrom->thinBlockWaitingForTxns, pfrom->thinBlock.vtx.size(), mapMissingTx.size());
+        if (missingCount == 0) {
+            // We have all the transactions now that are in this block: try to reassemble and process.
+            pfrom->thinBlockWaitingForTxns = -1;
+            pfrom->AddInventoryKnown(GetInv());
+            CTxOrphanCache::instance()->EraseOrphans(orphansUsed);
+            return true;
+        }
+        // This marks the end of the transactions we've received. If we get this and we have NOT been able to
+        // finish reassembling the block, we need to re-request the transactions we're missing:
+        std::set<uint64_t> setHashesToRequest;
+        for (size_t i = 0; i < pfrom->thinBlock.vtx.size(); i++) {
+            if (!pfrom->thinBlock.vtx[i])
+                setHashesToRequest.insert(pfrom->xThinBlockHashes[i]);
+        }
 
-    if (blockSize > blockSizeAcceptLimit) {
-        pfrom->thinBlockWaitingForTxns = -1;
-        pfrom->thinBlock.vtx.clear();
-        const float punishment = (blockSize - blockSizeAcceptLimit) / (float) blockSizeAcceptLimit;
-        const int score = 10 * punishment + 0.5;
-        LogPrintf("thinblock (partially) reconstructed is over accept limits; (%d > %d), Dropping block and punishing (%d) peer %d\n",
-                blockSize, blockSizeAcceptLimit, score, pfrom->id);
-        pfrom->mapThinBlocksInFlight.erase(pfrom->thinBlock.GetHash());
-        LOCK(cs_main);
-        Misbehaving(pfrom->id, score);
-        return false;
+        // Re-request transactions that we are still missing
+        CXRequestThinBlockTx thinBlockTx(header.GetHash(), setHashesToRequest);
+        pfrom->PushMessage(NetMsgType::GET_XBLOCKTX, thinBlockTx);
+        LogPrint("thin", "Missing %d transactions for xthinblock, re-requesting\n", pfrom->thinBlockWaitingForTxns);
     }
 
-    if (missingCount == 0) {
-        bool mutated;
-        uint256 hashMerkleRoot2 = BlockMerkleRoot(pfrom->thinBlock, &mutated);
-        if (pfrom->thinBlock.hashMerkleRoot != hashMerkleRoot2) {
-            LogPrint("thin", "thinblock fully constructed, but merkle hash failed. Rejecting\n");
-            // If we hit this often, we should consider writing more code above to remember duplicate
-            // short hashes in our maps and also remember duplicate results from the different sources
-            // like the orphans and the mempool etc.
-            // With all these options we can then try different combinations and see which one gives us a proper merkle root.
-
-            // We'll wait for an INV to get this block, rejecting it for now.
+    // and validate what we have while they are on their way
+    PreValidateThinBlock(pfrom, vMissingTx);
+
+    return false;
+}
+
+bool PreValidateThinBlock(CNode *pfrom, const std::vector<CTransactionRef> &vReceivedTx)
+{
+    const int64_t nStart = GetTimeMicros();
+    CValidationState state;
+    // Our own transactions passed CheckTransaction() when they entered the mempool or the orphan cache.
+    BOOST_FOREACH (const CTransactionRef &tx, vReceivedTx) {
+        if (!CheckTransaction(*tx, state))
+            break;
+    }
+    uint256 hash;
+    {
+        LOCK(cs_main);
+        const CBlock &block = pfrom->thinBlock;
+        hash = block.GetHash();
+        if (state.IsValid() && AcceptBlockHeader(block, state, Params())) {
+            // Load the coins the block spends, ConnectBlock() will then find them in memory.
+            std::vector<uint256> prevouts;
+            for (const auto &tx : block.vtx) {
+                if (!tx || tx->IsCoinBase())
+                    continue;
+                BOOST_FOREACH (const CTxIn &txin, tx->vin) {
+                    prevouts.push_back(txin.prevout.hash);
+                }
+            }
+            pcoinsTip->PrefetchCoins(prevouts);
+        }
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS)) {
+            LogPrint("thin", "thinblock %s failed validation: %s, dropping it\n", hash.ToString(), FormatStateMessage(state));
             pfrom->thinBlockWaitingForTxns = -1;
+            pfrom->mapThinBlocksInFlight.erase(hash);
+            if (nDoS > 0)
+                Misbehaving(pfrom->id, nDoS);
             return false;
         }
-    }
 
-    LogPrint("thin", "thinblock waiting for: %d, txs: %d full: %d\n", pfrom->thinBlockWaitingForTxns, pfrom->thinBlock.vtx.size(), mapMissingTx.size());
-    if (missingCount == 0) {
-        // We have all the transactions now that are in this block: try to reassemble and process.
-        pfrom->thinBlockWaitingForTxns = -1;
-        pfrom->AddInventoryKnown(GetInv());
-        CTxOrphanCache::instance()->EraseOrphans(orphansUsed);
-        return true;
-    }
-    // This marks the end of the transactions we've received. If we get this and we have NOT been able to
-    // finish reassembling the block, we need to re-request the transactions we're missing:
-    std::set<uint64_t> setHashesToRequest;
-    for (size_t i = 0; i < pfrom->thinBlock.vtx.size(); i++) {
-        if (pfrom->thinBlock.vtx[i].IsNull())
-            setHashesToRequest.insert(pfrom->xThinBlockHashes[i]);
+        // With flextrans the transactions that are still missing add leaves to the tree.
+        if (!flexTransActive) {
+            std::vector<uint256> leaves(block.vtx.size());
+            for (size_t i = 0; i < block.vtx.size(); ++i) {
+                if (block.vtx[i])
+                    leaves[i] = block.vtx[i]->GetHash();
+            }
+            pfrom->thinBlockMerkleTree.reset(new IncompleteMerkleTree(std::move(leaves)));
+        }
     }
+    LogPrint("thin", "Pre-validated thinblock %s in %.2fms\n", hash.ToString(), 0.001 * (GetTimeMicros() - nStart));
+    return true;
+}
 
-    // Re-request transactions that we are still missing
-    CXRequestThinBlockTx thinBlockTx(header.GetHash(), setHashesToRequest);
-    pfrom->PushMessage(NetMsgType::GET_XBLOCKTX, thinBlockTx);
-    LogPrint("thin", "Missing %d transactions for xthinblock, re-requesting\n", pfrom->thinBlockWaitingForTxns);
+void FinishThinBlockValidation(CNode *pfrom, const std::vector<uint32_t> &vReceivedPos)
+{
+    std::shared_ptr<IncompleteMerkleTree> tree;
+    tree.swap(pfrom->thinBlockMerkleTree);
+    if (!tree)
+        return;
+    const int64_t nStart = GetTimeMicros();
+    const CBlock &block = pfrom->thinBlock;
+    std::vector<bool> vTxChecked(block.vtx.size(), true);
+    BOOST_FOREACH (uint32_t pos, vReceivedPos) {
+        tree->setLeaf(pos, block.vtx[pos]->GetHash());
+        vTxChecked[pos] = false;
+    }
+    bool mutated;
+    if (tree->root(&mutated) != block.hashMerkleRoot || mutated)
+        return; // ProcessNewBlock() rejects it
 
-    return false;
+    CValidationState state;
+    if (CheckBlock(block, state, true, false, &vTxChecked))
+        block.fChecked = true; // so ProcessNewBlock() doesn't check it again
+    LogPrint("thin", "Checked the %d received transactions and the merkle root of thinblock %s in %.2fms\n",
+             vReceivedPos.size(), block.GetHash().ToString(), 0.001 * (GetTimeMicros() - nStart));
 }
 
-CXThinBlockTx::CXThinBlockTx(uint256 blockHash, std::vector<CTransaction>& vTx)
+CXThinBlockTx::CXThinBlockTx(uint256 blockHash, std::vector<CTransactionRef>& vTx)
 {
     blockhash = blockHash;
     vMissingTx = vTx;
@@ -240,30 +311,110 @@ bool IsChainNearlySyncd()
     return true;
 }
 
-CBloomFilter createSeededBloomFilter(const std::vector<uint256>& vOrphanHashes)
+CThinBlockFilter *CThinBlockFilter::s_instance = 0;
+static CCriticalSection cs_filterInstance; // protects CThinBlockFilter::s_instance
+
+CThinBlockFilter *CThinBlockFilter::instance()
+{
+    LOCK(cs_filterInstance);
+    if (s_instance == 0)
+        s_instance = new CThinBlockFilter();
+    return s_instance;
+}
+
+void CThinBlockFilter::Stop()
+{
+    LOCK(cs_filterInstance);
+    delete s_instance;
+    s_instance = 0;
+}
+
+CThinBlockFilter::CThinBlockFilter()
+    : m_built(0),
+    m_count(0)
+{
+    m_mempoolConnection = mempool.NotifyEntryAdded.connect(boost::bind(&CThinBlockFilter::mempoolEntryAdded, this, _1));
+    m_tipConnection = GetMainSignals().UpdatedBlockTip.connect(boost::bind(&CThinBlockFilter::updatedBlockTip, this, _1));
+    rebuild();
+}
+
+void CThinBlockFilter::mempoolEntryAdded(const CTransactionRef &tx)
+{
+    LOCK(m_lock);
+    m_filter.insert(tx->GetHash());
+    ++m_count;
+}
+
+void CThinBlockFilter::addOrphan(const uint256 &txid)
+{
+    LOCK(m_lock);
+    m_filter.insert(txid);
+    ++m_count;
+}
+
+void CThinBlockFilter::updatedBlockTip(const CBlockIndex *)
+{
+    // The block removed its transactions from the mempool, rebuild now instead of
+    // when we request the next block.
+    rebuildIfStale();
+}
+
+bool CThinBlockFilter::isStale() const
+{
+    // Every transaction that left the mempool or the orphan cache since the build is still in the filter.
+    // Takes the mempool lock, so call this without holding m_lock.
+    const int nLive = mempool.size() + CTxOrphanCache::instance()->size();
+    LOCK(m_lock);
+    const int nSlack = std::max(m_built / 4, 10);
+    return m_count - m_built > nSlack || m_count - nLive > nSlack;
+}
+
+void CThinBlockFilter::rebuildIfStale()
 {
-    LogPrint("thin", "Starting creation of bloom filter\n");
+    if (isStale())
+        rebuild();
+}
+
+void CThinBlockFilter::rebuild()
+{
+    const int64_t nStart = GetTimeMicros();
+    // Holding the mempool lock means no mempool transaction is added while we build.
+    LOCK(mempool.cs);
+    std::vector<uint256> vMemPoolHashes;
+    mempool.queryHashes(vMemPoolHashes);
+    const std::vector<uint256> vOrphanHashes = CTxOrphanCache::instance()->fetchTransactionIds();
+
     seed_insecure_rand();
-    double nBloomPoolSize = (double)mempool.mapTx.size();
+    double nBloomPoolSize = (double)vMemPoolHashes.size();
     if (nBloomPoolSize > MAX_BLOOM_FILTER_SIZE / 1.8)
         nBloomPoolSize = MAX_BLOOM_FILTER_SIZE / 1.8;
     double nBloomDecay = 1.5 - (nBloomPoolSize * 1.8 / MAX_BLOOM_FILTER_SIZE);  // We should never go below 0.5 as we will start seeing re-requests for tx's
-    int nElements = std::max((int)(((int)mempool.mapTx.size() + (int)vOrphanHashes.size()) * nBloomDecay), 1); // Must make sure nElements is greater than zero or will assert
+    int nElements = std::max((int)(((int)vMemPoolHashes.size() + (int)vOrphanHashes.size()) * nBloomDecay), 1); // Must make sure nElements is greater than zero or will assert
     double nFPRate = .001 + (((double)nElements * 1.8 / MAX_BLOOM_FILTER_SIZE) * .004); // The false positive rate in percent decays as the mempool grows
-    CBloomFilter filterMemPool(nElements, nFPRate, insecure_rand(), BLOOM_UPDATE_ALL);
-    LogPrint("thin", "Bloom multiplier: %f FPrate: %f Num elements in bloom filter: %d num mempool entries: %d\n", nBloomDecay, nFPRate, nElements, (int)mempool.mapTx.size());
+    CBloomFilter filter(nElements, nFPRate, insecure_rand(), BLOOM_UPDATE_ALL);
 
-    // Seed the filter with the transactions in the memory pool
-    LOCK(cs_main);
-    std::vector<uint256> vMemPoolHashes;
-    mempool.queryHashes(vMemPoolHashes);
-    for (uint64_t i = 0; i < vMemPoolHashes.size(); i++)
-         filterMemPool.insert(vMemPoolHashes[i]);
-    for (uint64_t i = 0; i < vOrphanHashes.size(); i++)
-         filterMemPool.insert(vOrphanHashes[i]);
-    LogPrint("thin", "Created bloom filter: %d bytes\n",::GetSerializeSize(filterMemPool, SER_NETWORK, PROTOCOL_VERSION));
+    for (size_t i = 0; i < vMemPoolHashes.size(); i++)
+         filter.insert(vMemPoolHashes[i]);
+    for (size_t i = 0; i < vOrphanHashes.size(); i++)
+         filter.insert(vOrphanHashes[i]);
+
+    {
+        LOCK(m_lock);
+        m_filter = std::move(filter);
+        m_built = m_count = vMemPoolHashes.size() + vOrphanHashes.size();
+    }
+    LogPrint("thin", "Built bloom filter in %.2fms. Bloom multiplier: %f FPrate: %f Num elements in bloom filter: %d num mempool entries: %d\n",
+             0.001 * (GetTimeMicros() - nStart), nBloomDecay, nFPRate, nElements, (int)vMemPoolHashes.size());
+}
 
-    return filterMemPool;
+void CThinBlockFilter::serialize(CDataStream &stream)
+{
+    rebuildIfStale();
+    const int64_t nStart = GetTimeMicros();
+    LOCK(m_lock);
+    const size_t nSizeBefore = stream.size();
+    stream << m_filter;
+    LogPrint("thin", "Serialized bloom filter: %d bytes in %.2fms\n", stream.size() - nSizeBefore, 0.001 * (GetTimeMicros() - nStart));
 }
 
 void LoadFilter(CNode *pfrom, CBloomFilter *filter)
@@ -311,12 +462,14 @@ void HandleBlockMessage(CNode *pfrom, const std::string &strCommand, const CBloc
     // was passed to us (&block), so do not use it after this.
     {
         int nTotalThinBlocksInFlight = 0;
-        LOCK(cs_vNodes);
+        // The thin block state of all peers is guarded by cs_main, as their message handlers may run concurrently.
+        LOCK2(cs_main, cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes) {
             if (pnode->mapThinBlocksInFlight.count(inv.hash)) {
                 pnode->mapThinBlocksInFlight.erase(inv.hash);
                 pnode->thinBlockWaitingForTxns = -1;
                 pnode->thinBlock.SetNull();
+                pnode->thinBlockMerkleTree.reset();
             }
             if (pnode->mapThinBlocksInFlight.size() > 0)
                 nTotalThinBlocksInFlight++;
@@ -328,10 +481,23 @@ void HandleBlockMessage(CNode *pfrom, const std::string &strCommand, const CBloc
             setPreVerifiedTxHash.clear();
             setUnVerifiedOrphanTxHash.clear();
         }
+
+        // Clear the thinblock timer used for preferential download
+        mapThinBlockTimer.erase(inv.hash);
     }
+}
 
-    // Clear the thinblock timer used for preferential download
-    mapThinBlockTimer.erase(inv.hash);
+void HandleCompletedThinBlock(CNode *pfrom, const std::string &strCommand, const CInv &inv)
+{
+    CBlock block;
+    {
+        LOCK(cs_main);
+        // another peer may have delivered the block and cleared ours meanwhile
+        if (pfrom->thinBlock.IsNull() || pfrom->thinBlock.GetHash() != inv.hash)
+            return;
+        block = pfrom->thinBlock;
+    }
+    HandleBlockMessage(pfrom, strCommand, block, inv);
 }
 
 void CheckAndRequestExpeditedBlocks(CNode* pfrom)
@@ -365,6 +531,7 @@ void CheckAndRequestExpeditedBlocks(CNode* pfrom)
                 } else {
                     LogPrintf("Requesting expedited blocks from peer %s (%d).\n", strListeningPeerIP, pfrom->id);
                     pfrom->PushMessage(NetMsgType::XPEDITEDREQUEST, ((uint64_t) EXPEDITED_BLOCKS));
+                    LOCK(cs_xpedited);
                     xpeditedBlkUp.push_back(pfrom);
                 }
                 return;
@@ -375,6 +542,7 @@ void CheckAndRequestExpeditedBlocks(CNode* pfrom)
 
 void SendExpeditedBlock(CXThinBlock& thinBlock, unsigned char hops, const CNode* skip)
 {
+    LOCK(cs_xpedited);
     std::vector<CNode*>::iterator end = xpeditedBlk.end();
     for (std::vector<CNode*>::iterator it = xpeditedBlk.begin(); it != end; it++) {
         CNode* node = *it;
@@ -400,9 +568,9 @@ void SendExpeditedBlock(const CBlock& block,const CNode* skip)
 }
 void HandleExpeditedRequest(CDataStream& vRecv,CNode* pfrom)
 {
-    // TODO locks
     uint64_t options;
     vRecv >> options;
+    LOCK(cs_xpedited);
     bool stop = ((options & EXPEDITED_STOP) != 0);  // Are we starting or stopping expedited service?
     if (options & EXPEDITED_BLOCKS)
     {
@@ -483,6 +651,7 @@ int xpeditedBlkSendPos=0;
 
 bool IsRecentlyExpeditedAndStore(const uint256& hash)
 {
+    LOCK(cs_xpedited);
     for (int i=0;i<NUM_XPEDITED_STORE;i++)
         if (xpeditedBlkSent[i]==hash) return true;
     xpeditedBlkSent[xpeditedBlkSendPos] = hash;
@@ -501,14 +670,16 @@ void HandleExpeditedBlock(CDataStream& vRecv, CNode* pfrom)
         CXThinBlock thinBlock;
         vRecv >> thinBlock;
 
-        auto mapEntry = Blocks::indexMap.find(thinBlock.header.GetHash());
-        CBlockIndex *blockIndex = nullptr;
         unsigned int status = 0;
-        if (mapEntry != Blocks::indexMap.end()) {
-            blockIndex = mapEntry->second;
-            status = blockIndex->nStatus;
+        bool isNewBlock = true;  // If I have never seen the block or just seen an INV, treat the block as new
+        {
+            LOCK(cs_main);
+            auto mapEntry = Blocks::indexMap.find(thinBlock.header.GetHash());
+            if (mapEntry != Blocks::indexMap.end()) {
+                status = mapEntry->second->nStatus;
+                isNewBlock = !(status & BLOCK_HAVE_DATA);
+            }
         }
-        bool isNewBlock = blockIndex == nullptr || (!(blockIndex->nStatus & BLOCK_HAVE_DATA));  // If I have never seen the block or just seen an INV, treat the block as new
 
         const int nSizeThinBlock = ::GetSerializeSize(thinBlock, SER_NETWORK, PROTOCOL_VERSION);  // TODO replace with size of vRecv for efficiency
         const CInv inv(MSG_BLOCK, thinBlock.header.GetHash());
@@ -533,7 +704,7 @@ void HandleExpeditedBlock(CDataStream& vRecv, CNode* pfrom)
 
         SendExpeditedBlock(thinBlock, hops + 1, pfrom); // I should push the vRecv rather than reserialize
         if (thinBlock.process(pfrom))
-            HandleBlockMessage(pfrom, NetMsgType::XPEDITEDBLK, pfrom->thinBlock,  thinBlock.GetInv());  // clears the thin block
+            HandleCompletedThinBlock(pfrom, NetMsgType::XPEDITEDBLK, thinBlock.GetInv());  // clears the thin block
     } else {
         LogPrint("thin", "Received unknown (0x%x) expedited message from peer %s (%d). Hop %d.\n", msgType, pfrom->addrName.c_str(),pfrom->id, hops);
     }
@@ -13,11 +13,14 @@
 #include "bloom.h"
 
 #include "net.h"
+#include "sync.h"
 #include "util.h"
 
+#include <boost/signals2/connection.hpp>
 #include <vector>
 
 class CBlock;
+class CBlockIndex;
 class CNode;
 
 
@@ -26,7 +29,7 @@ class CXThinBlock
 public:
     CBlockHeader header;
     std::vector<uint64_t> vTxHashes; // List of all transactions id's in the block
-    std::vector<CTransaction> vMissingTx; // vector of transactions that did not match the bloom filter
+    std::vector<CTransactionRef> vMissingTx; // vector of transactions that did not match the bloom filter
     bool collision;
 
 public:
@@ -54,10 +57,10 @@ class CXThinBlockTx
 public:
     /** Public only for unit testing */
     uint256 blockhash;
-    std::vector<CTransaction> vMissingTx; // map of missing transactions
+    std::vector<CTransactionRef> vMissingTx; // map of missing transactions
 
 public:
-    CXThinBlockTx(uint256 blockHash, std::vector<CTransaction>& vTx);
+    CXThinBlockTx(uint256 blockHash, std::vector<CTransactionRef>& vTx);
     CXThinBlockTx() {}
 
     ADD_SERIALIZE_METHODS
@@ -98,9 +101,66 @@ inline bool IsThinBlocksEnabled() {
     return GetBoolArg("-use-thinblocks", true);
 }
 bool IsChainNearlySyncd();
-CBloomFilter createSeededBloomFilter(const std::vector<uint256>& vOrphanHashes);
+
+/**
+ * Validate what we can of the partially reconstructed pfrom->thinBlock while its missing
+ * transactions are being fetched: the header, the transactions the peer sent along and
+ * the merkle tree branches of the transactions we have.
+ * On failure the thin block is dropped and the peer punished as appropriate.
+ * Takes cs_main, the coins the block spends are loaded into pcoinsTip for ConnectBlock().
+ */
+bool PreValidateThinBlock(CNode *pfrom, const std::vector<CTransactionRef> &vReceivedTx);
+/**
+ * Check the transactions at vReceivedPos of the completed pfrom->thinBlock and its merkle root.
+ * If it passes, the block is marked as checked so ProcessNewBlock() skips CheckBlock().
+ */
+void FinishThinBlockValidation(CNode *pfrom, const std::vector<uint32_t> &vReceivedPos);
+
+/**
+ * The bloom filter of our mempool and orphan transactions that we send with a get_xthin.
+ * Transactions are inserted as they enter the mempool or the orphan cache, so a request
+ * only has to serialize the filter.
+ * A bloom filter can't forget, so it is rebuilt from scratch when too many of its
+ * transactions left the mempool or too many were added since it was sized. That normally
+ * happens right after a new tip, well before we request the next block.
+ */
+class CThinBlockFilter
+{
+public:
+    /// Returns the filter, creating it on first use. Init creates it before the network threads start.
+    static CThinBlockFilter *instance();
+    /// Delete the filter, only once the threads that use it have finished.
+    static void Stop();
+
+    /// Insert a transaction that was added to the orphan cache.
+    void addOrphan(const uint256 &txid);
+    /// Append the filter to a get_xthin message, rebuilding it first if it is stale.
+    void serialize(CDataStream &stream);
+    /// Rebuild the filter from the mempool and the orphan cache, if it is stale.
+    void rebuildIfStale();
+
+private:
+    CThinBlockFilter();
+    void mempoolEntryAdded(const CTransactionRef &tx);
+    void updatedBlockTip(const CBlockIndex *pindex);
+    bool isStale() const;
+    void rebuild();
+
+    static CThinBlockFilter *s_instance;
+
+    mutable CCriticalSection m_lock;
+    CBloomFilter m_filter;
+    int m_built; // transactions in the filter when it was built
+    int m_count; // transactions inserted since, including m_built
+
+    boost::signals2::scoped_connection m_mempoolConnection;
+    boost::signals2::scoped_connection m_tipConnection;
+};
+
 void LoadFilter(CNode *pfrom, CBloomFilter *filter);
 void HandleBlockMessage(CNode *pfrom, const std::string &strCommand, const CBlock &block, const CInv &inv);
+/// Process a copy of the completed pfrom->thinBlock, unless another peer delivered the block first.
+void HandleCompletedThinBlock(CNode *pfrom, const std::string &strCommand, const CInv &inv);
 
 
 // TODO namespace the new methods?
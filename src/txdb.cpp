@@ -10,35 +10,120 @@
 #include "main.h"
 #include "BlocksDB.h"
 
+#include <algorithm>
+
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 static const char DB_COINS = 'c';
 static const char DB_BEST_BLOCK = 'B';
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, false)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe)
+    : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, false),
+    m_background(false),
+    m_stop(false),
+    m_writing(false)
+{
+}
+
+CCoinsViewDB::~CCoinsViewDB()
 {
+    SetBackgroundFlush(false);
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
+    if (m_background) {
+        boost::mutex::scoped_lock lock(m_lock);
+        if (m_writing) {
+            CCoinsMap::const_iterator it = m_pending.find(txid);
+            if (it != m_pending.end()) {
+                if (it->second.coins.IsPruned())
+                    return false;
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
     return db.Read(std::make_pair(DB_COINS, txid), coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
+    if (m_background) {
+        boost::mutex::scoped_lock lock(m_lock);
+        if (m_writing) {
+            CCoinsMap::const_iterator it = m_pending.find(txid);
+            if (it != m_pending.end())
+                return !it->second.coins.IsPruned();
+        }
+    }
     return db.Exists(std::make_pair(DB_COINS, txid));
 }
 
+void CCoinsViewDB::BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const
+{
+    if (txids.empty())
+        return;
+    std::vector<uint256> sorted;
+    if (m_background) {
+        // entries of the write in flight are not in the database yet
+        sorted.reserve(txids.size());
+        boost::mutex::scoped_lock lock(m_lock);
+        for (size_t i = 0; i < txids.size(); ++i) {
+            CCoinsMap::const_iterator it = m_writing ? m_pending.find(txids[i]) : m_pending.end();
+            if (it == m_pending.end())
+                sorted.push_back(txids[i]);
+            else if (!it->second.coins.IsPruned())
+                result.push_back(std::make_pair(txids[i], it->second.coins));
+        }
+    } else {
+        sorted = txids;
+    }
+    if (sorted.empty())
+        return;
+    // Walk the keys in database order with a single iterator; this turns a series of
+    // random reads into a mostly sequential sweep over the table files.
+    std::sort(sorted.begin(), sorted.end());
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    std::pair<char, uint256> key;
+    size_t found = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (i > 0 && sorted[i] == sorted[i - 1])
+            continue;
+        pcursor->Seek(std::make_pair(DB_COINS, sorted[i]));
+        if (!pcursor->Valid())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        if (key.second != sorted[i])
+            continue;
+        result.push_back(std::make_pair(sorted[i], CCoins()));
+        if (pcursor->GetValue(result.back().second)) {
+            ++found;
+        } else {
+            result.pop_back();
+            LogPrintf("CCoinsViewDB::BatchGetCoins(): unable to read value for %s\n", sorted[i].ToString());
+        }
+    }
+    LogPrint("coindb", "Prefetched %u of %u transactions from coin database\n", (unsigned int)found, (unsigned int)sorted.size());
+}
+
 uint256 CCoinsViewDB::GetBestBlock() const {
+    if (m_background) {
+        boost::mutex::scoped_lock lock(m_lock);
+        if (m_writing && !m_pendingBlock.IsNull())
+            return m_pendingBlock;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(&db.GetObfuscateKey());
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             if (it->second.coins.IsPruned())
                 batch.Erase(std::make_pair(DB_COINS, it->first));
@@ -47,20 +132,147 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    // A background write is synced, GetBestBlock() already reports the new block
+    // and the next write may depend on this one being on disk.
+    return db.WriteBatch(batch, m_background);
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    const int64_t nStart = GetTimeMicros();
+    if (!m_background) {
+        const bool ok = WriteCoins(mapCoins, hashBlock);
+        mapCoins.clear();
+        // the caller waited for the whole write
+        const int64_t nDuration = GetTimeMicros() - nStart;
+        boost::mutex::scoped_lock lock(m_lock);
+        m_stats.nFlushes++;
+        m_stats.nLastDuration = m_stats.nLastStall = nDuration;
+        m_stats.nTotalDuration += nDuration;
+        m_stats.nTotalStall += nDuration;
+        return ok;
+    }
+
+    // Take over the entries that need writing, the caller continues with an empty
+    // cache. The clean ones are dropped right away, the snapshot only holds the
+    // changes and the cache can be refilled without doubling memory usage.
+    CCoinsMap dirty;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            CCoinsCacheEntry &entry = dirty[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.flags = it->second.flags;
+        }
+    }
+    mapCoins.clear();
+
+    boost::mutex::scoped_lock lock(m_lock);
+    while (m_writing)
+        m_cond.wait(lock);
+    m_stats.nLastStall = GetTimeMicros() - nStart;
+    m_stats.nTotalStall += m_stats.nLastStall;
+    if (!m_error.empty())
+        return error("CCoinsViewDB::BatchWrite(): previous write failed: %s", m_error);
+
+    assert(m_pending.empty());
+    m_pending.swap(dirty);
+    m_pendingBlock = hashBlock;
+    m_writing = true;
+    m_cond.notify_all();
+    return true;
+}
+
+void CCoinsViewDB::ThreadFlush()
+{
+    RenameThread("bitcoin-coinsflush");
+    boost::mutex::scoped_lock lock(m_lock);
+    while (true) {
+        while (!m_writing && !m_stop)
+            m_cond.wait(lock);
+        if (!m_writing)
+            return;
+
+        // BatchWrite() does not touch m_pending while m_writing is set, and
+        // readers only look, so the write can go ahead without the lock.
+        const uint256 hashBlock = m_pendingBlock;
+        lock.unlock();
+        const int64_t nStart = GetTimeMicros();
+        std::string strError;
+        try {
+            if (!WriteCoins(m_pending, hashBlock))
+                strError = "write failed";
+        } catch (const std::exception &e) {
+            strError = e.what();
+        }
+        const int64_t nDuration = GetTimeMicros() - nStart;
+        LogPrint("coindb", "Background write of coin database took %.2fms\n", nDuration * 0.001);
+
+        CCoinsMap done;
+        lock.lock();
+        if (!strError.empty()) {
+            LogPrintf("ERROR: CCoinsViewDB: background write failed: %s\n", strError);
+            m_error = strError;
+        }
+        done.swap(m_pending);
+        m_pendingBlock.SetNull();
+        m_writing = false;
+        m_stats.nFlushes++;
+        m_stats.nLastDuration = nDuration;
+        m_stats.nTotalDuration += nDuration;
+        m_cond.notify_all();
+
+        // free the entries outside of the lock
+        lock.unlock();
+        done.clear();
+        lock.lock();
+    }
+}
+
+void CCoinsViewDB::SetBackgroundFlush(bool on)
+{
+    if (on == m_background)
+        return;
+    if (on) {
+        m_stop = false;
+        m_background = true;
+        m_thread = boost::thread(&CCoinsViewDB::ThreadFlush, this);
+    } else {
+        {
+            boost::mutex::scoped_lock lock(m_lock);
+            m_stop = true;
+            m_cond.notify_all();
+        }
+        m_thread.join(); // finishes the write in flight first
+        m_background = false;
+    }
+}
+
+bool CCoinsViewDB::WaitForFlush() const
+{
+    boost::mutex::scoped_lock lock(m_lock);
+    while (m_writing)
+        m_cond.wait(lock);
+    return m_error.empty();
+}
+
+CCoinsFlushStats CCoinsViewDB::GetFlushStats() const
+{
+    boost::mutex::scoped_lock lock(m_lock);
+    CCoinsFlushStats stats(m_stats);
+    stats.fPending = m_writing;
+    return stats;
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
+    if (!WaitForFlush())
+        return false;
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
     pcursor->Seek(DB_COINS);
 
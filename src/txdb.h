@@ -9,19 +9,75 @@
 #include "coins.h"
 #include "dbwrapper.h"
 
-/** CCoinsView backed by the coin database (chainstate/) */
+#include <atomic>
+#include <string>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Default for -backgroundflush */
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
+
+/** Timing of the coin database writes, all durations in microseconds. */
+struct CCoinsFlushStats
+{
+    uint64_t nFlushes;
+    int64_t nLastDuration;
+    int64_t nTotalDuration;
+    /** Time BatchWrite() spent waiting on the previous write to finish */
+    int64_t nLastStall;
+    int64_t nTotalStall;
+    bool fPending;
+
+    CCoinsFlushStats() : nFlushes(0), nLastDuration(0), nTotalDuration(0), nLastStall(0), nTotalStall(0), fPending(false) {}
+};
+
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * With background flushing enabled BatchWrite() takes over the entries of the
+ * cache that need writing and returns right away, the actual database write happens on a separate
+ * thread. Until that write is done the entries are served from the pending
+ * snapshot. The best block is written in the same batch as the coins and that
+ * batch is synced, so the marker on disk only moves once the coins are durable.
+ * Only one write is in flight at a time, a second BatchWrite() waits for it.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
+    void BatchGetCoins(const std::vector<uint256> &txids, std::vector<std::pair<uint256, CCoins> > &result) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    /** Start or stop writing to the database from a background thread. */
+    void SetBackgroundFlush(bool on);
+    /** Block until the write in flight, if any, is on disk. Returns false if it failed. */
+    bool WaitForFlush() const;
+    CCoinsFlushStats GetFlushStats() const;
+
+private:
+    void ThreadFlush();
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    mutable boost::mutex m_lock;
+    mutable boost::condition_variable m_cond;
+    boost::thread m_thread;
+    std::atomic<bool> m_background; // read without m_lock by the view methods
+    bool m_stop;
+    bool m_writing;
+    std::string m_error; // set when a background write failed
+    CCoinsMap m_pending;
+    uint256 m_pendingBlock;
+    CCoinsFlushStats m_stats;
 };
 
 #endif // BITCOIN_TXDB_H
@@ -35,11 +35,11 @@ CTxOrphanCache* CTxOrphanCache::instance()
     return s_instance;
 }
 
-bool CTxOrphanCache::AddOrphanTx(const CTransaction& tx, NodeId peer)
+bool CTxOrphanCache::AddOrphanTx(const CTransactionRef& tx, NodeId peer)
 {
     LOCK(m_lock);
 
-    uint256 hash = tx.GetHash();
+    uint256 hash = tx->GetHash();
     if (m_mapOrphanTransactions.count(hash))
         return false;
 
@@ -51,7 +51,7 @@ bool CTxOrphanCache::AddOrphanTx(const CTransaction& tx, NodeId peer)
     // 5000 orphans, each of which is at most 100,000 bytes big is
     // at most 500 megabytes of orphans:
 
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    unsigned int sz = tx->GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
     if (sz > 100000) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
@@ -60,7 +60,8 @@ bool CTxOrphanCache::AddOrphanTx(const CTransaction& tx, NodeId peer)
     m_mapOrphanTransactions[hash].tx = tx;
     m_mapOrphanTransactions[hash].fromPeer = peer;
     m_mapOrphanTransactions[hash].nEntryTime = GetTime();
-    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+    m_shortIds.insert(std::make_pair(hash.GetCheapHash(), hash));
+    BOOST_FOREACH(const CTxIn& txin, tx->vin) {
         m_mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
     }
 
@@ -74,7 +75,7 @@ void CTxOrphanCache::EraseOrphanTx(uint256 hash)
     std::map<uint256, COrphanTx>::iterator it = m_mapOrphanTransactions.find(hash);
     if (it == m_mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin) {
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin) {
         auto itPrev = m_mapOrphanTransactionsByPrev.find(txin.prevout.hash);
         if (itPrev == m_mapOrphanTransactionsByPrev.end())
             continue;
@@ -82,6 +83,13 @@ void CTxOrphanCache::EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             m_mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    auto shortIds = m_shortIds.equal_range(hash.GetCheapHash());
+    for (auto shortId = shortIds.first; shortId != shortIds.second; ++shortId) {
+        if (shortId->second == hash) {
+            m_shortIds.erase(shortId);
+            break;
+        }
+    }
     m_mapOrphanTransactions.erase(it);
 }
 
@@ -100,7 +108,7 @@ void CTxOrphanCache::EraseOrphansByTime()
         const auto entry = iter++;
         int64_t nEntryTime = entry->second.nEntryTime;
         if (nEntryTime < nOrphanTxCutoffTime) {
-            uint256 txHash = entry->second.tx.GetHash();
+            uint256 txHash = entry->second.tx->GetHash();
             EraseOrphanTx(txHash);
             LogPrint("mempool", "Erased old orphan tx %s of age %d seconds\n", txHash.ToString(), GetTime() - nEntryTime);
         }
@@ -136,10 +144,11 @@ void CTxOrphanCache::clear()
         LOCK(s_instance->m_lock);
         s_instance->m_mapOrphanTransactions.clear();
         s_instance->m_mapOrphanTransactionsByPrev.clear();
+        s_instance->m_shortIds.clear();
     }
 }
 
-bool CTxOrphanCache::value(const uint256 &txid, CTransaction &output)
+bool CTxOrphanCache::value(const uint256 &txid, CTransactionRef &output)
 {
     CTxOrphanCache *s = instance();
     LOCK(s->m_lock);
@@ -150,6 +159,17 @@ bool CTxOrphanCache::value(const uint256 &txid, CTransaction &output)
     return true;
 }
 
+bool CTxOrphanCache::valueByShortId(uint64_t shortId, CTransactionRef &output)
+{
+    CTxOrphanCache *s = instance();
+    LOCK(s->m_lock);
+    auto iter = s->m_shortIds.find(shortId);
+    if (iter == s->m_shortIds.end())
+        return false;
+    output = s->m_mapOrphanTransactions.at(iter->second).tx;
+    return true;
+}
+
 bool CTxOrphanCache::contains(const uint256 &txid)
 {
     CTxOrphanCache *s = instance();
@@ -167,6 +187,12 @@ std::vector<uint256> CTxOrphanCache::fetchTransactionIds() const
     return answer;
 }
 
+size_t CTxOrphanCache::size() const
+{
+    LOCK(m_lock);
+    return m_mapOrphanTransactions.size();
+}
+
 void CTxOrphanCache::setLimit(uint32_t limit)
 {
     m_limit = limit;
@@ -189,19 +215,6 @@ std::vector<CTxOrphanCache::COrphanTx> CTxOrphanCache::fetchTransactionsByPrev(c
 void CTxOrphanCache::EraseOrphans(const std::vector<uint256> &txIds)
 {
     LOCK(m_lock);
-    for (auto hashIter = txIds.begin(); hashIter != txIds.end(); ++hashIter) {
-        auto it = m_mapOrphanTransactions.find(*hashIter);
-        if (it == m_mapOrphanTransactions.end())
-            continue;
-
-        BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin) {
-            auto itPrev = m_mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-            if (itPrev == m_mapOrphanTransactionsByPrev.end())
-                continue;
-            itPrev->second.erase(*hashIter);
-            if (itPrev->second.empty())
-                m_mapOrphanTransactionsByPrev.erase(itPrev);
-        }
-        m_mapOrphanTransactions.erase(it);
-    }
+    for (auto hashIter = txIds.begin(); hashIter != txIds.end(); ++hashIter)
+        EraseOrphanTx(*hashIter);
 }
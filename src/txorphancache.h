@@ -20,6 +20,9 @@
 
 #include "sync.h"
 #include "primitives/transaction.h"
+#include "txmempool.h"
+
+#include <boost/unordered_map.hpp>
 
 class CTxOrphanCache
 {
@@ -28,11 +31,11 @@ public:
     static CTxOrphanCache *instance();
 
     struct COrphanTx {
-        CTransaction tx;
+        CTransactionRef tx;
         int fromPeer;
         uint64_t nEntryTime;
     };
-    bool AddOrphanTx(const CTransaction& tx, int peerId);
+    bool AddOrphanTx(const CTransactionRef& tx, int peerId);
 
     void EraseOrphansByTime();
 
@@ -43,10 +46,13 @@ public:
     }
 
     static void clear();
-    static bool value(const uint256 &txid, CTransaction &output);
+    static bool value(const uint256 &txid, CTransactionRef &output);
+    /// Find an orphan by the 64 bit short id that xthin blocks use.
+    static bool valueByShortId(uint64_t shortId, CTransactionRef &output);
     static bool contains(const uint256 &txid);
 
     std::vector<uint256> fetchTransactionIds() const;
+    size_t size() const;
 
     void setLimit(std::uint32_t limit);
 
@@ -58,6 +64,7 @@ protected:
     mutable CCriticalSection m_lock;
     std::map<uint256, COrphanTx> m_mapOrphanTransactions;
     std::map<uint256, std::set<uint256> > m_mapOrphanTransactionsByPrev;
+    boost::unordered_multimap<uint64_t, uint256, SaltedShortIdHasher> m_shortIds; // xthin short id to txid, short ids can collide
 
     static CTxOrphanCache *s_instance;
 
@@ -134,6 +134,12 @@ public:
         return ReadLE64(data);
     }
 
+    /** The 64 bit word at pos (0 to 3), little endian. */
+    uint64_t GetUint64(int pos) const
+    {
+        return ReadLE64(data + pos * 8);
+    }
+
     /** A more secure, salted hash function.
      * @note This hash is not stable between little and big endian.
      */
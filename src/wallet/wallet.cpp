@@ -922,7 +922,8 @@ void CWallet::SyncAllTransactionsInBlock(const CBlock *pblock)
 {
     LOCK2(cs_main, cs_wallet);
 
-    for (const CTransaction &tx : pblock->vtx) {
+    for (const auto &ptx : pblock->vtx) {
+        const CTransaction &tx = *ptx;
         if (!AddToWalletIfInvolvingMe(tx, pblock, true))
             continue; // Not one of ours
 
@@ -1232,9 +1233,9 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
             CBlock block;
             ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            for (const auto &tx : block.vtx)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                if (AddToWalletIfInvolvingMe(*tx, &block, fUpdate))
                     ret++;
             }
             pindex = chainActive.Next(pindex);
@@ -2977,7 +2978,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size())
     {
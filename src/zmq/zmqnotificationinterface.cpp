@@ -161,7 +161,7 @@ void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CB
 
 void CZMQNotificationInterface::SyncAllTransactionsInBlock(const CBlock *pblock)
 {
-    for (const CTransaction &tx : pblock->vtx) {
-        SyncTransaction(tx, nullptr);
+    for (const auto &tx : pblock->vtx) {
+        SyncTransaction(*tx, nullptr);
     }
 }